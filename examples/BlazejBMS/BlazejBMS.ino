@@ -40,6 +40,9 @@ TwizyVirtualBMS twizy;
 // i.e. Arduino Nano: RX = pin 8, TX = pin 9
 AltSoftSerial bt;
 
+// Analog inputs sampled in the background (TWIZY_ADC_CHANNELS = 5):
+const byte adcPins[] = { PORT_C1, PORT_C2, PORT_C3, PORT_C4, PORT_TEMP };
+
 
 // --------------------------------------------------------------------------
 // State variables
@@ -114,10 +117,10 @@ void bmsTicker(unsigned int clockCnt) {
     // bmsTicker: Read stacked cell voltages
     //
     
-    c1 = analogRead(PORT_C1) / 1024.0 * SCALE_C1;   // 60 V
-    c2 = analogRead(PORT_C2) / 1024.0 * SCALE_C2;   // 45 V
-    c3 = analogRead(PORT_C3) / 1024.0 * SCALE_C3;   // 30 V
-    c4 = analogRead(PORT_C4) / 1024.0 * SCALE_C4;   // 15 V
+    c1 = twizy.getAnalog(0) / 65536.0 * SCALE_C1;   // 60 V
+    c2 = twizy.getAnalog(1) / 65536.0 * SCALE_C2;   // 45 V
+    c3 = twizy.getAnalog(2) / 65536.0 * SCALE_C3;   // 30 V
+    c4 = twizy.getAnalog(3) / 65536.0 * SCALE_C4;   // 15 V
 
     #if INPUT_CALIBRATION >= 1
       // raw output for calibration:
@@ -257,9 +260,9 @@ void bmsTicker(unsigned int clockCnt) {
     
     float newtemp;
 
-    // dual read _seems_ to yield better results (LM35D issue?)
-    newtemp = analogRead(PORT_TEMP);
-    newtemp = BASE_TEMP + analogRead(PORT_TEMP) / 1024.0 * SCALE_TEMP;
+    // (the ADC acquisition discards the first sample after switching inputs,
+    //  which replaces the former dual read for the LM35D)
+    newtemp = BASE_TEMP + twizy.getAnalog(4) / 65536.0 * SCALE_TEMP;
 
     // raw output for calibration:
     #if INPUT_CALIBRATION >= 1
@@ -392,6 +395,7 @@ void setup() {
   twizy.begin();
   twizy.attachTicker(bmsTicker);
   twizy.attachEnterState(bmsEnterState);
+  twizy.adcBegin(adcPins, sizeof(adcPins));
   
   // Init:
   twizy.setPowerLimits(drvpwr, recpwr);
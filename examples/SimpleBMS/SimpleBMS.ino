@@ -65,6 +65,9 @@ TwizyVirtualBMS twizy;
 // Temperature smoothing samples:
 #define SMOOTH_TEMP           10
 
+// Analog inputs sampled in the background (TWIZY_ADC_CHANNELS = 2):
+const byte adcPins[] = { PORT_VOLT, PORT_TEMP };
+
 
 // -----------------------------------------------------
 // Status
@@ -111,7 +114,7 @@ void bmsTicker(unsigned int clockCnt) {
     float vpack, newsoc, newtemp;
     
     // read pack voltage:
-    vpack = analogRead(PORT_VOLT) / 1024.0 * SCALE_VOLT;
+    vpack = twizy.getAnalog(0) / 65536.0 * SCALE_VOLT;
     
     Serial.print(F("- vpack=")); Serial.println(vpack, 2);
     twizy.setVoltage(vpack, true);
@@ -165,7 +168,7 @@ void bmsTicker(unsigned int clockCnt) {
     }
     
     // read battery temperature:
-    newtemp = BASE_TEMP + analogRead(PORT_TEMP) / 1024.0 * SCALE_TEMP;
+    newtemp = BASE_TEMP + twizy.getAnalog(1) / 65536.0 * SCALE_TEMP;
     
     // smooth:
     temp = (temp * (SMOOTH_TEMP-1) + newtemp) / SMOOTH_TEMP;
@@ -200,6 +203,7 @@ void setup() {
   twizy.begin();
   twizy.attachTicker(bmsTicker);
   twizy.attachEnterState(bmsEnterState);
+  twizy.adcBegin(adcPins, sizeof(adcPins));
   
   twizy.setPowerLimits(MAX_DRIVE_POWER, MAX_RECUP_POWER);
   twizy.setChargeCurrent(MAX_CHARGE_CURRENT);
@@ -88,7 +88,8 @@ bool bmsCheckState(TwizyState currentState, TwizyState newState) {
 // --------------------------------------------------------------------------
 // Callback: process received CAN message
 //  - called on reception of a CAN frame that passed the filters
-//    (i.e. normally only IDs 0x423, 0x597 & 0x599)
+//    (i.e. normally only IDs 0x423, 0x597 & 0x599 plus the IDs
+//    registered by twizy.onFrame())
 // Note: avoid complex operations, this needs to be fast.
 // 
 void bmsProcessCanMsg(unsigned long rxId, byte rxLen, byte *rxBuf) {
@@ -0,0 +1,220 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Closed-loop drive & charge cycle test
+ * ==========================================================================
+ *
+ * Runs the VirtualBMS against the charger & SEVCON models
+ * (TwizyVirtualBMS_models.h) with a simple battery model:
+ *  1. Drive: key on, power demand profile exceeding the BMS drive &
+ *     recuperation limits, SOC × temperature derating map, key off
+ *  2. Charge: plug in at low SOC, charge to 100 % with the charge current
+ *     level reduced near full, BMS stops the charge, trickle charge,
+ *     charger shuts down
+ * Checks the protocol states reached, the limits respected & the BMS
+ * switching off after each cycle. Exit code 0 = all checks passed.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o CycleTest CycleTest.cpp
+ *
+ * Usage:
+ *   CycleTest [-v]
+ *     -v   print BMS state transitions & charger phases
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+#include "TwizyVirtualBMS_models.h"
+
+#include <chrono>
+
+TwizyVirtualBMS twizy;
+TwizyHostCharger charger;
+TwizyHostSevcon sevcon;
+
+bool verbose = false;
+int failures = 0;
+
+// Battery model: 100 Ah
+int socCP = 8000;                     // 1/100 %
+long chargeAcc = 0;                   // 1/4 A * 10 ms remainder
+bool statesSeen[13];
+
+#define CAPACITY_QA10MS   (100L * 4 * 3600 * 100)     // 100 Ah in 1/4 A * 10 ms
+
+
+void bmsEnterState(TwizyState currentState, TwizyState newState) {
+  statesSeen[newState] = true;
+  if (verbose) {
+    printf("%10.2f s  BMS %s -> %s\n", micros() / 1e6,
+      (const char *) twizy.stateName(currentState),
+      (const char *) twizy.stateName(newState));
+  }
+}
+
+// Derating map: drive power reduced below 20 % SOC, recuperation &
+// charge current reduced above 95 %, all reduced when cold or hot
+const TwizyDerateMap<6, 3> derateMap PROGMEM = {
+  {     0,  1000,  2000,  9500,  9999, 10000 },
+  { 0, 20, 50 },
+  { {  2000,  4500,  9000,  9000,  9000,  9000 },     // drive [W]
+    {  4000,  9000, 18000, 18000, 18000, 18000 },
+    {  2000,  4500,  9000,  9000,  9000,  9000 } },
+  { {  2000,  2000,  2000,  2000,   500,   500 },     // recup [W]
+    {  8000,  8000,  8000,  8000,  2000,  2000 },
+    {     0,     0,     0,     0,     0,     0 } },
+  { {     5,     5,     5,     5,     5,     0 },     // charge [A]
+    {    35,    35,    35,    35,     5,     0 },
+    {     0,     0,     0,     0,     0,     0 } }
+};
+
+// Derating & model update, every 100 ms:
+void bmsTicker(unsigned int clockCnt) {
+  if (clockCnt % 10 != 0) {
+    return;
+  }
+  twizy.setSOCCP(socCP);
+  twizyDerate(twizy, derateMap, socCP, 20);
+}
+
+void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) failures++;
+}
+
+
+// Run for <seconds>, optionally until <done> returns true:
+template <typename T>
+void run(double seconds, T done) {
+  unsigned long long end = twizyHost->clockUs + (unsigned long long)(seconds * 1e6);
+  TwizyHostChargerPhase phase = charger.getPhase();
+  int overTicks = 0;
+  while (twizyHost->clockUs < end && !done()) {
+    twizyHostAdvance(10000);
+    charger.loop();
+    sevcon.loop();
+
+    // battery: integrate current, voltage with 50 mΩ internal resistance
+    long currentQA = charger.getCurrentQA() + sevcon.getCurrentQA();
+    chargeAcc += currentQA * 10000L;
+    socCP += chargeAcc / CAPACITY_QA10MS;
+    chargeAcc %= CAPACITY_QA10MS;
+    socCP = std::max(0, std::min(10000, socCP));
+    twizy.setCurrentQA(currentQA);
+    twizy.setVoltageMV(48000 + socCP * 96UL / 100 + currentQA * 50 / 4, true);
+
+    twizy.looper();
+
+    // charger must follow the BMS charge current level within its 100 ms cycle:
+    if (charger.getCurrentQA() > charger.bms.chargeLevel() * 20L) {
+      if (++overTicks == 11) {
+        printf("%10.2f s  charger current %ld QA exceeds level %d\n", micros() / 1e6,
+          charger.getCurrentQA(), charger.bms.chargeLevel());
+        failures++;
+      }
+    }
+    else {
+      overTicks = 0;
+    }
+    if (verbose && charger.getPhase() != phase) {
+      phase = charger.getPhase();
+      printf("%10.2f s  CHG %s\n", micros() / 1e6, charger.phaseName());
+    }
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Serial.out = NULL;
+  twizy.begin();
+  twizy.attachEnterState(bmsEnterState);
+  twizy.attachTicker(bmsTicker);
+  twizy.setPowerLimits(18000, 8000);
+  twizy.setChargeCurrent(35);
+  twizy.setSOH(100);
+  twizy.setSOCCP(socCP);
+  twizy.setTemperature(20, 22, true);
+  twizy.setVoltageMV(55000, true);
+  twizy.setCurrentQA(0);
+
+  charger.attach();
+  sevcon.attach();
+
+  auto wallStart = std::chrono::steady_clock::now();
+
+  //
+  // 1. Drive cycle
+  //
+
+  printf("Drive cycle:\n");
+  memset(statesSeen, 0, sizeof(statesSeen));
+  charger.key = true;
+  run(30, []() { return sevcon.isEnabled(); });
+  check(sevcon.isEnabled(), "SEVCON enabled within 30 s");
+
+  // 20 kW acceleration / 8 kW cruise / -10 kW recuperation, until SOC < 15 %:
+  for (int lap = 0; lap < 200 && socCP >= 1500; lap++) {
+    sevcon.demand = 20000;  run(10, []() { return false; });
+    sevcon.demand = 8000;   run(60, []() { return false; });
+    sevcon.demand = -10000; run(5,  []() { return false; });
+  }
+  sevcon.demand = 0;
+  long drivePeak = sevcon.maxPower, recupPeak = sevcon.minPower;
+  charger.key = false;
+  run(120, []() { return twizy.state() == Off; });
+
+  check(statesSeen[Driving], "BMS reached Driving");
+  check(socCP < 1500, "SOC drained below 15 %");
+  check(sevcon.limitedTicks > 0, "SEVCON power limited by BMS");
+  check(drivePeak <= 18000 && recupPeak >= -8000, "power within 18 kW / 8 kW limits");
+  check(twizy.state() == Off, "BMS Off after key off");
+  check(!sevcon.isEnabled(), "SEVCON disabled (3MW low)");
+  printf("  energy: %.0f Wh drive, %.0f Wh recuperation, peaks %ld W / %ld W\n",
+    sevcon.getDriveWh(), sevcon.getRecupWh(), drivePeak, recupPeak);
+
+  //
+  // 2. Charge cycle
+  //
+
+  printf("Charge cycle:\n");
+  memset(statesSeen, 0, sizeof(statesSeen));
+  int startSOC = socCP;
+  charger.plugged = true;
+  run(8 * 3600, []() { return charger.charges > 0; });
+  run(3600, []() { return twizy.state() == Off; });
+  charger.plugged = false;
+  run(60, []() { return false; });
+
+  check(statesSeen[Charging], "BMS reached Charging");
+  check(statesSeen[StopCharge], "BMS stopped the charge");
+  check(statesSeen[Trickle], "BMS reached Trickle");
+  check(socCP == 10000, "SOC 100 %");
+  check(charger.charges == 1, "one charge session");
+  check(twizy.state() == Off && charger.getPhase() == ChgOff, "BMS & charger Off after charge");
+  check(charger.timeouts == 0, "no handshake timeouts");
+  printf("  charged %.1f Ah, SOC %.2f %% -> %.2f %%\n",
+    charger.getChargedAh(), startSOC / 100.0, socCP / 100.0);
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  printf("%.0f s simulated in %.3f s wall time\n", micros() / 1e6, wallSec);
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,532 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Fleet soak simulator
+ * ==========================================================================
+ *
+ * Runs a fleet of VirtualBMS instances on the host backend, each with its
+ * own virtual clock & CAN bus (TwizyHostContext), driven by a simulated
+ * charger & display producing 0x423 / 0x597 / 0x599 through randomized
+ * park → drive → park → charge cycles. The user ticker feeds current, SOC,
+ * voltage & temperatures through the integer setters.
+ *
+ * The fleet is stepped in epochs of virtual time. Each epoch, the vehicles
+ * are split into chunks distributed over the worker threads; a worker
+ * takes chunks from the back of its own deque and steals from the front
+ * of the others' when done. Statistics are collected per worker and
+ * merged at the end:
+ *  - state transition counts
+ *  - frame counts per ID (sent by the VirtualBMS / injected)
+ *  - timing anomalies: 0x155 gaps > 2 periods, wakeup latency (first
+ *    frame injected after parking to the next 0x155), TX queue drops,
+ *    RX overflows, Error states
+ *
+ * Build (add -DFLEET_SLEEP to park the VirtualBMS in sleep mode):
+ *   g++ -std=c++11 -O2 -pthread -I../../src -o FleetSim FleetSim.cpp
+ *
+ * Usage:
+ *   FleetSim [-n vehicles] [-d hours] [-t threads] [-e minutes] [-s seed]
+ *     -n   fleet size (default: 1000)
+ *     -d   virtual time to simulate in hours (default: 24)
+ *     -t   worker threads (default: all cores)
+ *     -e   epoch length in minutes (default: 60), progress is printed per epoch
+ *     -s   random seed (default: 1)
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+
+#ifdef FLEET_SLEEP
+// Sleep mode needs the CAN IRQ pin:
+#ifndef TWIZY_CAN_IRQ_PIN
+#define TWIZY_CAN_IRQ_PIN       2
+#endif
+#undef TWIZY_SLEEP
+#define TWIZY_SLEEP             1
+#endif
+
+#include "TwizyVirtualBMS.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define FLEET_CHUNK       16        // vehicles per work item
+#define FLEET_STATES      13        // TwizyState values
+#define FLEET_GAP_US      (2 * TWIZY_CAN_CLOCK_US)
+
+
+// -----------------------------------------------------
+// Statistics (one per worker, merged at the end)
+//
+
+struct FleetStats {
+  unsigned long long ticks = 0;
+  unsigned long long transitions[FLEET_STATES][FLEET_STATES] = {};
+  unsigned long long txFrames[0x800] = {};
+  unsigned long long rxFrames[0x800] = {};
+  unsigned long long gaps155 = 0;
+  unsigned long long maxGap155 = 0;
+  unsigned long long wakeups = 0;
+  unsigned long long wakeLatencySum = 0;
+  unsigned long long maxWakeLatency = 0;
+  unsigned long long txDrops = 0;
+  unsigned long long rxOverflows = 0;
+  unsigned long long errors = 0;
+
+  void merge(const FleetStats &o) {
+    ticks += o.ticks;
+    for (int i = 0; i < FLEET_STATES; i++)
+      for (int j = 0; j < FLEET_STATES; j++)
+        transitions[i][j] += o.transitions[i][j];
+    for (int i = 0; i < 0x800; i++) {
+      txFrames[i] += o.txFrames[i];
+      rxFrames[i] += o.rxFrames[i];
+    }
+    gaps155 += o.gaps155;
+    maxGap155 = std::max(maxGap155, o.maxGap155);
+    wakeups += o.wakeups;
+    wakeLatencySum += o.wakeLatencySum;
+    maxWakeLatency = std::max(maxWakeLatency, o.maxWakeLatency);
+    txDrops += o.txDrops;
+    rxOverflows += o.rxOverflows;
+    errors += o.errors;
+  }
+};
+
+
+// -----------------------------------------------------
+// Simulated vehicle
+//
+
+enum SimPhase {
+  SimParked,        // CAN silent
+  SimKeyOn,         // 597 mode D0
+  SimDriving,       // 597 mode C0
+  SimKeyOff,        // 597 mode D0
+  SimCharging,      // 597 mode B0
+  SimTrickle,       // 597 mode 90
+  SimChargeEnd,     // 597 mode D0
+};
+
+class Vehicle;
+
+thread_local Vehicle *simVehicle = NULL;
+thread_local FleetStats *simStats = NULL;
+
+void bmsEnterState(TwizyState currentState, TwizyState newState);
+void bmsTicker(unsigned int clockCnt);
+
+class Vehicle {
+public:
+
+  TwizyHostContext ctx;
+  TwizyHostCanBus bus;
+  TwizyVirtualBMS bms;
+
+  uint32_t rng;
+  SimPhase phase = SimParked;
+  unsigned long long phaseEnd = 0;
+  unsigned long long nextFrame = 0;
+
+  // Physical model:
+  int socCP = 8000;                   // 1/100 %
+  long currentQA = 0;                 // 1/4 A
+  long chargeAcc = 0;                 // 1/4 As, SOC integration remainder
+  int temp = 20;                      // °C
+  unsigned long odometer = 0;         // 1/100 km
+
+  // Anomaly tracking:
+  unsigned long long last155 = 0;
+  bool wakePending = false;           // parked, waiting for the first frame
+  unsigned long long wakeTime = 0;    // time of the first frame after parking
+  unsigned int txDrops = 0;
+  unsigned int rxOverflows = 0;
+
+  void setup(uint32_t seed) {
+    rng = seed ? seed : 1;
+    socCP = 3000 + random(7000);
+    temp = 10 + random(20);
+    twizyHost = &ctx;
+    ctx.canBus = &bus;
+    bus.monitor = [this](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+      frameSeen(frame, sender);
+    };
+    simVehicle = this;
+    bms.begin();
+    bms.attachEnterState(::bmsEnterState);
+    bms.attachTicker(::bmsTicker);
+    bms.setPowerLimits(18000, 8000);
+    bms.setChargeCurrent(35);
+    bms.setSOH(100);
+    updateModel();
+    // start parked, first event within an hour:
+    phaseEnd = ctx.clockUs + 60000000ULL * (1 + random(60));
+  }
+
+  // Run up to virtual time <until>:
+  void run(unsigned long long until) {
+    twizyHost = &ctx;
+    simVehicle = this;
+    while (ctx.clockUs < until) {
+      if (ctx.clockUs >= phaseEnd) {
+        nextPhase();
+      }
+      if (phase != SimParked && ctx.clockUs >= nextFrame) {
+        sendFrames();
+        nextFrame = ctx.clockUs + 100000;
+      }
+      twizyHostAdvance(TWIZY_CAN_CLOCK_US);
+      bms.looper();
+      simStats->ticks++;
+    }
+    // collect counter deltas:
+    simStats->txDrops += (unsigned int)(bms.getTxDrops() - txDrops);
+    simStats->rxOverflows += (unsigned int)(bms.getRxOverflows() - rxOverflows);
+    txDrops = bms.getTxDrops();
+    rxOverflows = bms.getRxOverflows();
+  }
+
+  // xorshift32:
+  uint32_t random(uint32_t range) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng % range;
+  }
+
+  void enterPhase(SimPhase newPhase, unsigned long seconds) {
+    if (phase == SimParked && newPhase != SimParked) {
+      wakePending = true;
+    }
+    phase = newPhase;
+    phaseEnd = ctx.clockUs + seconds * 1000000ULL;
+    nextFrame = ctx.clockUs;
+  }
+
+  void nextPhase() {
+    switch (phase) {
+      case SimParked:
+        if (socCP < 5000 && random(4) != 0)
+          enterPhase(SimCharging, 8 * 3600);  // ends when full
+        else
+          enterPhase(SimKeyOn, 2 + random(10));
+        break;
+      case SimKeyOn:
+        enterPhase(SimDriving, 60 * (5 + random(85)));
+        break;
+      case SimDriving:
+        enterPhase(SimKeyOff, 2 + random(5));
+        break;
+      case SimCharging:
+        enterPhase(SimTrickle, 60 * (10 + random(20)));
+        break;
+      case SimTrickle:
+        enterPhase(SimChargeEnd, 5);
+        break;
+      case SimKeyOff:
+      case SimChargeEnd:
+        enterPhase(SimParked, 60 * (15 + random(465)));
+        break;
+    }
+  }
+
+  // Simulated CHARGER & DISPLAY, every 100 ms while the car is awake:
+  void sendFrames() {
+    static const byte mode[] = { 0x00, 0xD0, 0xC0, 0xD0, 0xB0, 0x90, 0xD0 };
+    byte id423[8] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    byte id597[8] = { 0x00, 0xF4, 0x00, mode[phase], 0x00, 0x00, 0x00, 0x3C };
+    byte id599[8] = {
+      (byte)(odometer >> 24), (byte)(odometer >> 16), (byte)(odometer >> 8), (byte)odometer,
+      0x00, 0x00, 0x00, 0x00 };
+    bus.inject(0x423, 8, id423);
+    bus.inject(0x597, 8, id597);
+    if (phase == SimKeyOn || phase == SimDriving) {
+      bus.inject(0x599, 8, id599);
+    }
+  }
+
+  // Once per second from the BMS ticker:
+  void updateModel() {
+    // current: random drive profile, charger follows the charge current level
+    if (phase == SimDriving) {
+      currentQA = -(long)random(600) + 40;   // -150 … +10 A
+      odometer += 1 + random(3);
+    }
+    else if (phase == SimCharging) {
+      currentQA = (socCP > 9500) ? 20 : 120;
+    }
+    else if (phase == SimTrickle) {
+      currentQA = (socCP < 10000) ? 8 : 0;
+    }
+    else {
+      currentQA = 0;
+    }
+
+    // coulomb counting, 100 Ah = 1440000 QAs = 10000 cp:
+    chargeAcc += currentQA;
+    socCP += chargeAcc / 144;
+    chargeAcc %= 144;
+    socCP = std::max(0, std::min(10000, socCP));
+    if (phase == SimCharging && socCP >= 10000) {
+      phaseEnd = ctx.clockUs;
+    }
+    if (phase == SimDriving && socCP < 1000) {
+      phaseEnd = ctx.clockUs;
+    }
+
+    // temperature random walk:
+    int dt = (int)random(3) - 1;
+    temp = std::max(-10, std::min(45, temp + dt));
+
+    bms.setCurrentQA(currentQA);
+    bms.setSOCCP(socCP);
+    bms.setVoltageMV(48000 + socCP * 96UL / 100 + currentQA * 2, true);
+    bms.setTemperature(temp, temp + 2, true);
+    bms.setChargeCurrent(socCP > 9500 ? 5 : 35);
+  }
+
+  void frameSeen(const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (!sender) {
+      simStats->rxFrames[frame.id & 0x7FF]++;
+      if (wakePending) {
+        wakeTime = frame.time;
+        wakePending = false;
+      }
+      return;
+    }
+    simStats->txFrames[frame.id & 0x7FF]++;
+    if (frame.id == 0x155) {
+      if (last155) {
+        unsigned long long gap = frame.time - last155;
+        if (gap > FLEET_GAP_US) {
+          simStats->gaps155++;
+          simStats->maxGap155 = std::max(simStats->maxGap155, gap);
+        }
+      }
+      if (wakeTime) {
+        unsigned long long latency = frame.time - wakeTime;
+        simStats->wakeups++;
+        simStats->wakeLatencySum += latency;
+        simStats->maxWakeLatency = std::max(simStats->maxWakeLatency, latency);
+        wakeTime = 0;
+      }
+      last155 = frame.time;
+    }
+  }
+
+  void enterState(TwizyState currentState, TwizyState newState) {
+    simStats->transitions[currentState][newState]++;
+    if (newState == Error) {
+      simStats->errors++;
+    }
+    if (newState == Off || newState == Error) {
+      last155 = 0;
+    }
+  }
+};
+
+
+void bmsEnterState(TwizyState currentState, TwizyState newState) {
+  simVehicle->enterState(currentState, newState);
+}
+
+void bmsTicker(unsigned int clockCnt) {
+  if (clockCnt % 100 == 0) {
+    simVehicle->updateModel();
+  }
+}
+
+
+// -----------------------------------------------------
+// Work stealing scheduler
+//
+
+struct FleetTask {
+  size_t first, count;
+};
+
+struct FleetWorker {
+  std::mutex lock;
+  std::deque<FleetTask> tasks;
+  FleetStats stats;
+  unsigned long long chunks = 0;
+  unsigned long long steals = 0;
+  double busySec = 0;
+};
+
+std::vector<std::unique_ptr<Vehicle>> fleet;
+std::vector<std::unique_ptr<FleetWorker>> workers;
+
+bool takeTask(size_t self, FleetTask &task) {
+  FleetWorker &own = *workers[self];
+  {
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    FleetWorker &victim = *workers[(self + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      own.steals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+void workerRun(size_t self, unsigned long long until) {
+  FleetWorker &own = *workers[self];
+  simStats = &own.stats;
+  auto start = std::chrono::steady_clock::now();
+  FleetTask task;
+  while (takeTask(self, task)) {
+    for (size_t i = task.first; i < task.first + task.count; i++) {
+      fleet[i]->run(until);
+    }
+    own.chunks++;
+  }
+  own.busySec += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void runEpoch(unsigned long long until) {
+  // distribute chunks round robin:
+  size_t w = 0;
+  for (size_t i = 0; i < fleet.size(); i += FLEET_CHUNK) {
+    workers[w]->tasks.push_back({ i, std::min((size_t)FLEET_CHUNK, fleet.size() - i) });
+    w = (w + 1) % workers.size();
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers.size(); i++) {
+    threads.push_back(std::thread(workerRun, i, until));
+  }
+  workerRun(0, until);
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+
+// -----------------------------------------------------
+// Main
+//
+
+int main(int argc, char *argv[]) {
+
+  size_t vehicles = 1000;
+  double hours = 24;
+  double epochMin = 60;
+  size_t threadCnt = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t seed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      vehicles = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+      hours = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      threadCnt = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-e") == 0 && i+1 < argc) {
+      epochMin = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      seed = strtoul(argv[++i], NULL, 0);
+    } else {
+      fprintf(stderr, "Usage: %s [-n vehicles] [-d hours] [-t threads] [-e minutes] [-s seed]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (vehicles < 1 || threadCnt < 1 || hours <= 0 || epochMin <= 0) {
+    fprintf(stderr, "invalid parameters\n");
+    return 1;
+  }
+
+  Serial.out = NULL;
+
+  for (size_t i = 0; i < threadCnt; i++) {
+    workers.push_back(std::unique_ptr<FleetWorker>(new FleetWorker));
+  }
+
+  // setup counts as worker 0 activity:
+  simStats = &workers[0]->stats;
+  for (size_t i = 0; i < vehicles; i++) {
+    fleet.push_back(std::unique_ptr<Vehicle>(new Vehicle));
+    fleet[i]->setup(seed * 2654435761u + i * 40503u);
+  }
+
+  printf("Fleet: %zu vehicles, %.1f h, %zu threads, %zu chunks of %d\n",
+    vehicles, hours, threadCnt, (vehicles + FLEET_CHUNK - 1) / FLEET_CHUNK, FLEET_CHUNK);
+
+  auto wallStart = std::chrono::steady_clock::now();
+  unsigned long long endUs = (unsigned long long)(hours * 3600e6);
+  unsigned long long epochUs = (unsigned long long)(epochMin * 60e6);
+
+  for (unsigned long long t = 0; t < endUs; ) {
+    t = std::min(t + epochUs, endUs);
+    runEpoch(t);
+    double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    printf("  %8.2f h simulated, %8.1f s wall time\n", t / 3600e6, wallSec);
+    fflush(stdout);
+  }
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  FleetStats total;
+  for (size_t i = 0; i < workers.size(); i++) {
+    total.merge(workers[i]->stats);
+  }
+
+  printf("\nState transitions:\n");
+  for (int i = 0; i < FLEET_STATES; i++) {
+    for (int j = 0; j < FLEET_STATES; j++) {
+      if (total.transitions[i][j]) {
+        printf("  %-12s -> %-12s %12llu\n",
+          (const char *) fleet[0]->bms.stateName((TwizyState) i),
+          (const char *) fleet[0]->bms.stateName((TwizyState) j),
+          total.transitions[i][j]);
+      }
+    }
+  }
+
+  printf("\nFrames:            sent by BMS     injected\n");
+  for (int id = 0; id < 0x800; id++) {
+    if (total.txFrames[id] || total.rxFrames[id]) {
+      printf("  0x%03X       %15llu %12llu\n", id, total.txFrames[id], total.rxFrames[id]);
+    }
+  }
+
+  printf("\nAnomalies:\n");
+  printf("  0x155 gaps > %d ms:   %llu (max %.1f ms)\n", FLEET_GAP_US / 1000,
+    total.gaps155, total.maxGap155 / 1e3);
+  printf("  wakeup → 0x155:       avg %.1f ms, max %.1f ms (%llu wakeups)\n",
+    total.wakeups ? total.wakeLatencySum / 1e3 / total.wakeups : 0.0,
+    total.maxWakeLatency / 1e3, total.wakeups);
+  printf("  TX queue drops:       %llu\n", total.txDrops);
+  printf("  RX overflows:         %llu\n", total.rxOverflows);
+  printf("  Error states:         %llu\n", total.errors);
+
+  printf("\nWorkers:\n");
+  for (size_t i = 0; i < workers.size(); i++) {
+    printf("  #%-3zu %8llu chunks %6llu stolen %8.1f s busy %14llu ticks\n", i,
+      workers[i]->chunks, workers[i]->steals, workers[i]->busySec, workers[i]->stats.ticks);
+  }
+
+  double fleetHours = hours * vehicles;
+  printf("\n%.0f vehicle hours in %.1f s wall time: %.0f ticks/s, %.0fx realtime per vehicle\n",
+    fleetHours, wallSec, total.ticks / wallSec, fleetHours * 3600 / wallSec);
+
+  return 0;
+}
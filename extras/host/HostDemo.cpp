@@ -0,0 +1,90 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Host demo
+ * ==========================================================================
+ *
+ * Runs the VirtualBMS on the host backend through a simple scripted
+ * wakeup → drive → shutdown sequence, prints the state transitions and
+ * a frame statistics summary.
+ *
+ * Build & run:
+ *   g++ -std=c++11 -O2 -I../../src -o HostDemo HostDemo.cpp && ./HostDemo
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#include <map>
+#include <chrono>
+
+TwizyVirtualBMS twizy;
+
+std::map<unsigned long, unsigned long> txCount;
+
+
+void bmsEnterState(TwizyState currentState, TwizyState newState) {
+  printf("%8.3f s: %s -> %s\n", micros() / 1e6,
+    (const char *) twizy.stateName(currentState),
+    (const char *) twizy.stateName(newState));
+}
+
+
+// Simulated CHARGER: 423 + 597 every 100 ms
+void sendCharger(byte mode) {
+  byte id423[8] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  byte id597[8] = { 0x00, 0xF4, 0x00, mode, 0x00, 0x00, 0x00, 0x3C };
+  twizyHostCanBus.inject(0x423, 8, id423);
+  twizyHostCanBus.inject(0x597, 8, id597);
+}
+
+
+int main() {
+
+  twizyHostCanBus.monitor = [](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (sender) txCount[frame.id]++;
+  };
+
+  Serial.begin(115200);
+  twizy.begin();
+  twizy.attachEnterState(bmsEnterState);
+
+  twizy.setPowerLimits(18000, 8000);
+  twizy.setChargeCurrent(35);
+  twizy.setSOH(100);
+  twizy.setSOC(90);
+  twizy.setTemperature(20, 20, true);
+  twizy.setVoltage(50.0, true);
+  twizy.setCurrent(0.0);
+
+  auto wallStart = std::chrono::steady_clock::now();
+  unsigned long ticks = 0;
+
+  // 60 seconds: 20 s key on, 20 s driving, then switch off (CAN silence):
+  for (unsigned long ms = 0; ms < 60000; ms++) {
+    if (ms < 40000 && ms % 100 == 0) {
+      sendCharger(ms < 20000 ? 0xD0 : 0xC0);
+    }
+    twizyHostAdvance(1000);
+    twizy.looper();
+    if (ms % 10 == 0) ticks++;
+  }
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  printf("\nFrames sent by BMS:\n");
+  for (auto it = txCount.begin(); it != txCount.end(); ++it) {
+    printf("  0x%03lX: %lu\n", it->first, it->second);
+  }
+  printf("3MW pin: %d\n", digitalRead(TWIZY_3MW_CONTROL_PIN));
+  printf("%lu ticks in %.3f s wall time = %.0f ticks/s\n", ticks, wallSec, ticks / wallSec);
+
+  return 0;
+}
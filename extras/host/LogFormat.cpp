@@ -0,0 +1,139 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Binary log formatter
+ * ==========================================================================
+ *
+ * Converts the serial output of a VirtualBMS built with TWIZY_LOG_BUFFER
+ * into text: binary log records (TWIZY_LOG_SYNC, message, time,
+ * arguments) are formatted using the message table TWIZY_LOG_MESSAGES of
+ * the library, resulting in the same text as printed without the log
+ * buffer. Other serial output (i.e. begin() messages, sketch output) is
+ * passed through unchanged.
+ *
+ * Build with the library version running on the Arduino, the record
+ * format depends on the message numbers.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o LogFormat LogFormat.cpp
+ *
+ * Usage:
+ *   LogFormat [-t] [file]
+ *     -t   prefix log messages by their time [s] (millis() of the Arduino)
+ *   Reads stdin if no file is given, i.e.
+ *     stty -F /dev/ttyUSB0 115200 raw && LogFormat -t < /dev/ttyUSB0
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+
+// Argument bytes of message <msg>, -1 = unknown message.
+// <args> holds the arguments read so far (needed for variable length frames).
+int argsLength(byte msg, const byte *args, int have) {
+  if (msg >= TwizyLogMessages) {
+    return -1;
+  }
+  int len = 0;
+  for (const char *type = twizyLogArgs[msg]; *type; type++) {
+    switch (*type) {
+      case 'B': case 'S': case 'P': len += 1; break;
+      case 'W': case 'X':           len += 2; break;
+      case 'L': case 'l':           len += 4; break;
+      case 'H':                     len += 2 * TWIZY_TICK_BUCKETS; break;
+      case 'F':
+        if (have <= len) {
+          return len + 1;   // need the length byte first
+        }
+        len += 1 + args[len];
+        break;
+    }
+  }
+  return len;
+}
+
+
+int main(int argc, char *argv[]) {
+
+  bool timestamps = false;
+  FILE *in = stdin;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0) {
+      timestamps = true;
+    } else if (argv[i][0] != '-' && in == stdin) {
+      in = fopen(argv[i], "rb");
+      if (!in) {
+        perror(argv[i]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [-t] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  Serial.out = stdout;
+  unsigned long records = 0, dropped = 0;
+  unsigned long long timeMs = 0;
+  uint16_t lastTime = 0;
+  int c;
+
+  while ((c = fgetc(in)) != EOF) {
+
+    if (c != TWIZY_LOG_SYNC) {
+      fputc(c, stdout);
+      continue;
+    }
+
+    // record header:
+    byte head[3];
+    if (fread(head, 1, sizeof(head), in) != sizeof(head)) {
+      break;
+    }
+    byte msg = head[0];
+    if (msg >= TwizyLogMessages) {
+      fprintf(stderr, "Unknown log message %u, library version mismatch?\n", msg);
+      continue;
+    }
+
+    // arguments:
+    byte args[TWIZY_LOG_ARGS_MAX];
+    int have = 0, need;
+    while ((need = argsLength(msg, args, have)) > have && need <= (int) sizeof(args)) {
+      if (fread(args + have, 1, need - have, in) != (size_t)(need - have)) {
+        break;
+      }
+      have = need;
+    }
+    if (need != have) {
+      break;
+    }
+
+    // time: 16 bit millis() → continuous:
+    uint16_t time = head[1] | (head[2] << 8);
+    timeMs += (uint16_t)(time - lastTime);
+    lastTime = time;
+
+    if (timestamps) {
+      printf("%10.3f  ", timeMs / 1000.0);
+    }
+    twizyLogPrint(msg, args);
+    fflush(stdout);
+
+    records++;
+    if (msg == TwizyLogDropped) {
+      dropped += args[0] | (args[1] << 8);
+    }
+  }
+
+  fprintf(stderr, "%lu records, %lu dropped\n", records, dropped);
+  return 0;
+}
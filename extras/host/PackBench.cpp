@@ -0,0 +1,147 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Pack model benchmark
+ * ==========================================================================
+ *
+ * Measures TwizyPack::publish() for packs of 96 … 768 cells and checks
+ * the cell voltages sent in 0x556 / 0x557 / 0x55E / 0x700 and the module
+ * temperatures in 0x554 against a straightforward reference aggregation.
+ *
+ * Build:
+ *   g++ -std=c++11 -O3 -march=native -I../../src -o PackBench PackBench.cpp
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#include <chrono>
+
+TwizyVirtualBMS twizy;
+
+byte frame554[8], frame556[8], frame557[8], frame55E[8], frame700[8];
+int failures = 0;
+
+
+// Decode 12 bit cell level <n> (0-based) of a frame, in mV:
+unsigned int cellMV(const byte *frame, int n) {
+  const byte *p = frame + n / 2 * 3;
+  unsigned int level = (n & 1) ? ((p[1] & 0x0F) << 8) | p[2] : (p[0] << 4) | (p[1] >> 4);
+  return level * 5;
+}
+
+unsigned int sentCellMV(int cell) {
+  if (cell < 5)  return cellMV(frame556, cell);
+  if (cell < 10) return cellMV(frame557, cell - 5);
+  if (cell < 14) return cellMV(frame55E, cell - 10);
+  return cellMV(frame700 + 2, cell - 14);
+}
+
+
+template <uint16_t CELLS, uint8_t SENSORS, uint8_t REPORT_CELLS, uint8_t MODULES>
+void bench(TwizyAggregate cellAgg, TwizyAggregate tempAgg) {
+
+  TwizyPack<CELLS, SENSORS, REPORT_CELLS, MODULES> pack(cellAgg, tempAgg);
+  static const char *aggName[] = { "min", "max", "mean" };
+
+  srand(CELLS);
+  for (int i = 0; i < CELLS; i++) {
+    pack.cellMV[i] = 3300 + rand() % 900;
+  }
+  for (int i = 0; i < SENSORS; i++) {
+    pack.temp[i] = 5 + rand() % 30;
+  }
+
+  // publish & let the VirtualBMS send all frames:
+  TwizyPackStats stats;
+  if (!pack.publish(twizy, &stats)) {
+    printf("publish() failed\n");
+    failures++;
+    return;
+  }
+  for (int i = 0; i < 100; i++) {
+    twizyHostAdvance(10000);
+    twizy.looper();
+  }
+
+  // reference aggregation:
+  int errors = 0;
+  for (int g = 0; g < REPORT_CELLS; g++) {
+    int first = g * CELLS / REPORT_CELLS, last = (g + 1) * CELLS / REPORT_CELLS;
+    unsigned long ref = (cellAgg == TwizyAggMin) ? 0xFFFF : 0;
+    for (int i = first; i < last; i++) {
+      if (cellAgg == TwizyAggMin) ref = std::min(ref, (unsigned long) pack.cellMV[i]);
+      else if (cellAgg == TwizyAggMax) ref = std::max(ref, (unsigned long) pack.cellMV[i]);
+      else ref += pack.cellMV[i];
+    }
+    if (cellAgg == TwizyAggMean) ref /= (last - first);
+    if (g >= 14 && !TWIZY_INFO_FRAME) continue;   // cells 15+16 are sent in 0x700
+    if (sentCellMV(g) != ref / 5 * 5) errors++;
+  }
+  for (int g = 0; g < MODULES; g++) {
+    int first = g * SENSORS / MODULES, last = (g + 1) * SENSORS / MODULES;
+    int ref = (tempAgg == TwizyAggMin) ? 127 : (tempAgg == TwizyAggMax) ? -128 : 0;
+    for (int i = first; i < last; i++) {
+      if (tempAgg == TwizyAggMin) ref = std::min(ref, (int) pack.temp[i]);
+      else if (tempAgg == TwizyAggMax) ref = std::max(ref, (int) pack.temp[i]);
+      else ref += pack.temp[i];
+    }
+    if (tempAgg == TwizyAggMean) ref /= (last - first);
+    if (frame554[g] - 40 != ref) errors++;
+  }
+  if (pack.cellMV[stats.minCell - 1] != stats.minMV || pack.cellMV[stats.maxCell - 1] != stats.maxMV) {
+    errors++;
+  }
+  failures += errors;
+
+  // timing:
+  const int calls = 200000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    pack.cellMV[i % CELLS] ^= 1;
+    pack.publish(twizy);
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+
+  printf("%4d cells → %2d, %3d sensors → %d, %-4s/%-4s: %7.1f ns/publish  %s\n",
+    CELLS, REPORT_CELLS, SENSORS, MODULES, aggName[cellAgg], aggName[tempAgg], ns,
+    errors ? "FAIL" : "ok");
+}
+
+
+int main() {
+
+  twizyHostCanBus.monitor = [](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (!sender) return;
+    switch (frame.id) {
+      case 0x554: memcpy(frame554, frame.buf, 8); break;
+      case 0x556: memcpy(frame556, frame.buf, 8); break;
+      case 0x557: memcpy(frame557, frame.buf, 8); break;
+      case 0x55E: memcpy(frame55E, frame.buf, 8); break;
+      case 0x700: memcpy(frame700, frame.buf, 8); break;
+    }
+  };
+
+  Serial.out = NULL;
+  twizy.begin();
+  twizy.setInfoBmsType(bmsType_VirtualBMS);
+  twizy.enterState(Init);
+  twizy.enterState(Ready);
+
+  bench<96, 24, 14, 7>(TwizyAggMin, TwizyAggMax);
+  bench<96, 24, 14, 7>(TwizyAggMean, TwizyAggMean);
+  bench<192, 48, 16, 8>(TwizyAggMin, TwizyAggMax);
+  bench<384, 96, 16, 8>(TwizyAggMax, TwizyAggMin);
+  bench<768, 192, 16, 8>(TwizyAggMean, TwizyAggMax);
+  bench<100, 13, 14, 7>(TwizyAggMin, TwizyAggMean);
+
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
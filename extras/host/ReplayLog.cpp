@@ -0,0 +1,237 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: CAN log replay
+ * ==========================================================================
+ *
+ * Replays a recorded candump log (i.e. charger & display traffic 0x423,
+ * 0x597, 0x599) into the VirtualBMS on the virtual clock, as fast as the
+ * CPU allows. Records all frames sent by the VirtualBMS and all state
+ * transitions, so replay results can be compared to regression test the
+ * protocol behaviour (3MW pulse cycle, Init → Ready timing etc.).
+ *
+ * Frames with IDs sent by the VirtualBMS itself (0x155, 0x424 …) are
+ * skipped, the VirtualBMS generates them.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o ReplayLog ReplayLog.cpp
+ *
+ * Usage:
+ *   ReplayLog [-o outfile] [-e seconds] [-q] [file]
+ *     -o   write frames sent by the VirtualBMS to outfile (candump log format)
+ *     -e   continue the simulation after the log end (default: 0)
+ *     -q   don't print state transitions
+ *   Reads stdin if no file is given.
+ *
+ * Input formats (candump -l / candump -ta):
+ *   (1514764800.123456) can0 423#0300000000000000
+ *   (1514764800.123456)  can0  423   [8]  03 00 00 00 00 00 00 00
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#include <chrono>
+#include <cctype>
+
+TwizyVirtualBMS twizy;
+
+FILE *outFile = NULL;
+bool quiet = false;
+unsigned long framesSent = 0;
+unsigned long transitions = 0;
+
+
+void bmsEnterState(TwizyState currentState, TwizyState newState) {
+  transitions++;
+  if (!quiet) {
+    printf("%12.6f %s -> %s\n", twizyHost->clockUs / 1e6,
+      (const char *) twizy.stateName(currentState),
+      (const char *) twizy.stateName(newState));
+  }
+}
+
+
+bool isBmsFrame(unsigned long id) {
+  #define TWIZY_TX_ID(txid, buf, len, period, phase, error, cond, init, initData, data) \
+    if (id == txid) return true;
+  TWIZY_FRAMES(TWIZY_TX_ID)
+  #undef TWIZY_TX_ID
+  return false;
+}
+
+
+int hexNibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c = toupper(c);
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+// Parse candump log line, returns false on unknown format:
+bool parseLine(const char *line, unsigned long long *timeUs, unsigned long *id, byte *len, byte *buf) {
+  unsigned long sec, usec;
+  char ifname[32];
+  int n;
+
+  if (sscanf(line, " (%lu.%lu) %31s %n", &sec, &usec, ifname, &n) != 3) {
+    return false;
+  }
+  *timeUs = (unsigned long long) sec * 1000000 + usec;
+  line += n;
+
+  char *end;
+  *id = strtoul(line, &end, 16);
+  if (end == line) {
+    return false;
+  }
+  line = end;
+  *len = 0;
+
+  if (*line == '#') {
+    // compact: ID#DATA
+    line++;
+    while (*len < 8 && hexNibble(line[0]) >= 0 && hexNibble(line[1]) >= 0) {
+      buf[(*len)++] = (hexNibble(line[0]) << 4) | hexNibble(line[1]);
+      line += 2;
+    }
+  }
+  else {
+    // verbose: ID [len] xx xx …
+    unsigned int dlc;
+    if (sscanf(line, " [%u]%n", &dlc, &n) != 1 || dlc > 8) {
+      return false;
+    }
+    line += n;
+    for (unsigned int i = 0; i < dlc; i++) {
+      unsigned int val;
+      if (sscanf(line, " %2x%n", &val, &n) != 1) {
+        return false;
+      }
+      buf[(*len)++] = val;
+      line += n;
+    }
+  }
+  return true;
+}
+
+
+// Run the VirtualBMS up to the virtual time target:
+void runUntil(unsigned long long target) {
+  while (twizyHost->clockUs < target) {
+    unsigned long long step = target - twizyHost->clockUs;
+    if (step > TWIZY_CAN_CLOCK_US) {
+      step = TWIZY_CAN_CLOCK_US;
+    }
+    twizyHostAdvance(step);
+    twizy.looper();
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+
+  FILE *in = stdin;
+  double extraSec = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+      outFile = fopen(argv[++i], "w");
+      if (!outFile) {
+        perror(argv[i]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "-e") == 0 && i+1 < argc) {
+      extraSec = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-q") == 0) {
+      quiet = true;
+    } else if (argv[i][0] != '-' && in == stdin) {
+      in = fopen(argv[i], "r");
+      if (!in) {
+        perror(argv[i]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [-o outfile] [-e seconds] [-q] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  twizyHostCanBus.monitor = [](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (!sender) return;
+    framesSent++;
+    if (outFile) {
+      fprintf(outFile, "(%llu.%06llu) vbms %03lX#", frame.time / 1000000, frame.time % 1000000, frame.id);
+      for (byte i = 0; i < frame.len; i++) {
+        fprintf(outFile, "%02X", frame.buf[i]);
+      }
+      fputc('\n', outFile);
+    }
+  };
+
+  Serial.out = NULL;
+  twizy.begin();
+  twizy.attachEnterState(bmsEnterState);
+
+  twizy.setPowerLimits(18000, 8000);
+  twizy.setChargeCurrent(35);
+  twizy.setSOH(100);
+  twizy.setSOC(90);
+  twizy.setTemperature(20, 20, true);
+  twizy.setVoltage(55.0, true);
+  twizy.setCurrent(0.0);
+
+  auto wallStart = std::chrono::steady_clock::now();
+
+  char line[256];
+  unsigned long lineNo = 0, framesRead = 0, framesReplayed = 0;
+  unsigned long long logStart = 0, simStart = twizyHost->clockUs;
+
+  while (fgets(line, sizeof(line), in)) {
+    lineNo++;
+    unsigned long long timeUs;
+    unsigned long id;
+    byte len, buf[8];
+    if (!parseLine(line, &timeUs, &id, &len, buf)) {
+      if (line[0] != '\n' && line[0] != '#') {
+        fprintf(stderr, "line %lu: skipped, unknown format\n", lineNo);
+      }
+      continue;
+    }
+    if (framesRead++ == 0) {
+      logStart = timeUs;
+    }
+    if (isBmsFrame(id)) {
+      continue;
+    }
+    if (timeUs >= logStart) {
+      runUntil(simStart + (timeUs - logStart));
+    }
+    twizyHostCanBus.inject(id, len, buf);
+    framesReplayed++;
+  }
+
+  runUntil(twizyHost->clockUs + (unsigned long long)(extraSec * 1e6));
+  twizy.looper();
+
+  double wallSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double simSec = (twizyHost->clockUs - simStart) / 1e6;
+
+  fprintf(stderr, "%lu frames read, %lu replayed, %lu sent by VirtualBMS, %lu state transitions\n",
+    framesRead, framesReplayed, framesSent, transitions);
+  fprintf(stderr, "%.3f s simulated in %.3f s wall time: %.0f frames/s, %.0fx realtime\n",
+    simSec, wallSec, (framesReplayed + framesSent) / wallSec, simSec / wallSec);
+
+  if (outFile) {
+    fclose(outFile);
+  }
+  return 0;
+}
@@ -0,0 +1,329 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Signal codec test & decoder
+ * ==========================================================================
+ *
+ * Uses the signal table TWIZY_SIGNALS of the library:
+ *  - Test (default): round-trips every value of every signal of up to 24
+ *    bits (2^24 values of 32 bit signals) through the compile-time codec
+ *    (TwizySignal) and an independent runtime bit-by-bit codec driven by
+ *    the table, on random frame contents: both must decode the same
+ *    value, bits outside the signal must stay unchanged. Checks the
+ *    multi-signal twizyPut() against single puts and measures the time
+ *    per put & get of both codecs. Exit code 0 = all checks passed.
+ *  - Decode (-d): reads a candump log and prints the signals of each
+ *    frame in physical units.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o SignalCodec SignalCodec.cpp
+ *
+ * Usage:
+ *   SignalCodec [-q]          run the tests (-q: only print failures & result)
+ *   SignalCodec -d [file]     decode a candump log (stdin if no file is given)
+ *
+ * Input formats (candump -l / candump -ta):
+ *   (1514764800.123456) can0 155#0797CA5452300072
+ *   (1514764800.123456)  can0  155   [8]  07 97 CA 54 52 30 00 72
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#include <chrono>
+#include <cctype>
+#include <random>
+
+int failures = 0;
+bool quiet = false;
+std::mt19937 rng(1);
+
+
+// Runtime signal table:
+struct SignalInfo {
+  const char *name;
+  unsigned int id;
+  int pos, len;
+  long bias;
+  double scale;
+  const char *unit;
+};
+
+#define SIGNAL_INFO(name, id, buf, pos, len, bias, scale, unit) \
+  { #name, id, pos, len, bias, scale, unit },
+const SignalInfo signals[] = {
+  TWIZY_SIGNALS(SIGNAL_INFO)
+};
+#undef SIGNAL_INFO
+const int signalCount = sizeof(signals) / sizeof(signals[0]);
+
+
+// Runtime codec, bit by bit (MSB first numbering):
+uint32_t genericGet(const SignalInfo &s, const byte *frame) {
+  uint32_t raw = 0;
+  for (int p = s.pos; p < s.pos + s.len; p++) {
+    raw = (raw << 1) | ((frame[p >> 3] >> (7 - (p & 7))) & 1);
+  }
+  return raw;
+}
+
+void genericPut(const SignalInfo &s, byte *frame, uint32_t raw) {
+  for (int p = s.pos + s.len - 1; p >= s.pos; p--, raw >>= 1) {
+    byte bit = 0x80 >> (p & 7);
+    frame[p >> 3] = (raw & 1) ? (frame[p >> 3] | bit) : (frame[p >> 3] & ~bit);
+  }
+}
+
+void genericMask(const SignalInfo &s, byte *mask) {
+  memset(mask, 0, 8);
+  genericPut(s, mask, 0xFFFFFFFF);
+}
+
+
+void check(bool ok, const char *what) {
+  if (!quiet || !ok) {
+    printf("  %s: %s\n", ok ? "ok  " : "FAIL", what);
+  }
+  if (!ok) failures++;
+}
+
+void randomFrame(byte *frame) {
+  for (int i = 0; i < 8; i++) {
+    frame[i] = rng();
+  }
+}
+
+
+// Round trip of all raw values of a signal:
+template <class S>
+void testSignal(const SignalInfo &info, double &nsTemplate, double &nsGeneric) {
+
+  typedef typename S::value_t value_t;
+  unsigned long long values = (info.len > 24) ? (1ULL << 24) : (1ULL << info.len);
+  unsigned long errors = 0;
+  byte mask[8], background[8], frame1[8], frame2[8];
+  genericMask(info, mask);
+  randomFrame(background);
+
+  for (unsigned long long n = 0; n < values; n++) {
+    // all values, or edges & random values for 32 bit signals:
+    uint32_t raw = (info.len > 24)
+      ? ((n < 256) ? (uint32_t) n : (n < 512) ? (uint32_t) -(n - 255) : (uint32_t) rng())
+      : (uint32_t) n;
+    value_t value = (value_t) ((long) raw - info.bias);
+    if ((n & 0xFFF) == 0) {
+      randomFrame(background);
+    }
+
+    // template put → generic get, template get:
+    memcpy(frame1, background, 8);
+    S::put(frame1, value);
+    if (genericGet(info, frame1) != raw || S::get(frame1) != value) {
+      errors++;
+    }
+    // generic put → same frame, template get:
+    memcpy(frame2, background, 8);
+    genericPut(info, frame2, raw);
+    if (memcmp(frame1, frame2, 8) != 0 || S::get(frame2) != value) {
+      errors++;
+    }
+    // bits outside the signal unchanged:
+    for (int i = 0; i < 8; i++) {
+      if ((frame1[i] ^ background[i]) & ~mask[i]) {
+        errors++;
+        break;
+      }
+    }
+  }
+
+  char what[100];
+  snprintf(what, sizeof(what), "%-16s %3x  bit %2d … %2d: %8llu values%s",
+    info.name, info.id, info.pos, info.pos + info.len - 1, values,
+    errors ? " MISMATCH" : "");
+  check(errors == 0, what);
+
+  // timing: put & get of 1M random values
+  const int calls = 1 << 20;
+  static value_t in[1 << 10];
+  for (int i = 0; i < (1 << 10); i++) {
+    in[i] = (value_t) ((long) (rng() & (uint32_t)((1ULL << info.len) - 1)) - info.bias);
+  }
+  volatile uint32_t sink = 0;
+  memcpy(frame1, background, 8);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    S::put(frame1, in[i & 1023]);
+    sink += S::get(frame1);
+  }
+  nsTemplate += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < calls; i++) {
+    genericPut(info, frame1, (uint32_t) ((long) in[i & 1023] + info.bias));
+    sink += genericGet(info, frame1);
+  }
+  nsGeneric += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+
+// Multi-signal put against single puts:
+template <class S1, class S2>
+void testPair(const char *name) {
+  unsigned long errors = 0;
+  byte frame1[8], frame2[8];
+  for (int n = 0; n < 1000000; n++) {
+    randomFrame(frame1);
+    memcpy(frame2, frame1, 8);
+    typename S1::value_t v1 = (typename S1::value_t) ((long) rng() % 4096 - S1::bias);
+    typename S2::value_t v2 = (typename S2::value_t) ((long) rng() % 4096 - S2::bias);
+    twizyPut<S1, S2>(frame1, v1, v2);
+    S1::put(frame2, v1);
+    S2::put(frame2, v2);
+    if (memcmp(frame1, frame2, 8) != 0) {
+      errors++;
+    }
+  }
+  char what[100];
+  snprintf(what, sizeof(what), "twizyPut<%s>: 1000000 random values", name);
+  check(errors == 0, what);
+}
+
+
+int runTests() {
+
+  double nsTemplate = 0, nsGeneric = 0;
+
+  printf("Round trip (%d signals):\n", signalCount);
+  int index = 0;
+  #define SIGNAL_TEST(name, id, buf, pos, len, bias, scale, unit) \
+    testSignal<TwizySig##name>(signals[index++], nsTemplate, nsGeneric);
+  TWIZY_SIGNALS(SIGNAL_TEST)
+  #undef SIGNAL_TEST
+
+  printf("Multi-signal put:\n");
+  testPair<TwizySigCell1, TwizySigCell2>("Cell1, Cell2");
+  testPair<TwizySigVoltage55F, TwizySigVoltage55Fb>("Voltage55F, Voltage55Fb");
+  testPair<TwizySigVoltLevel425b, TwizySigVoltLevel425>("VoltLevel425b, VoltLevel425");
+  testPair<TwizySigTempMin424, TwizySigTempMax424>("TempMin424, TempMax424");
+  testPair<TwizySigRecupLimit424, TwizySigDriveLimit424>("RecupLimit424, DriveLimit424");
+
+  printf("put + get, mean over all signals: %.2f ns compile-time codec, %.2f ns runtime codec\n",
+    nsTemplate / signalCount, nsGeneric / signalCount);
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
+
+
+int hexNibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c = toupper(c);
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Parse candump log line, returns false on unknown format:
+bool parseLine(const char *line, double *time, unsigned long *id, byte *len, byte *buf) {
+  char ifname[32];
+  int n;
+
+  if (sscanf(line, " (%lf) %31s %n", time, ifname, &n) != 2) {
+    return false;
+  }
+  line += n;
+
+  char *end;
+  *id = strtoul(line, &end, 16);
+  if (end == line) {
+    return false;
+  }
+  line = end;
+  *len = 0;
+
+  if (*line == '#') {
+    // compact: ID#DATA
+    line++;
+    while (*len < 8 && hexNibble(line[0]) >= 0 && hexNibble(line[1]) >= 0) {
+      buf[(*len)++] = (hexNibble(line[0]) << 4) | hexNibble(line[1]);
+      line += 2;
+    }
+  }
+  else {
+    // verbose: ID [len] xx xx …
+    unsigned int dlc;
+    if (sscanf(line, " [%u]%n", &dlc, &n) != 1 || dlc > 8) {
+      return false;
+    }
+    line += n;
+    for (unsigned int i = 0; i < dlc; i++) {
+      unsigned int val;
+      if (sscanf(line, " %2x%n", &val, &n) != 1) {
+        return false;
+      }
+      buf[(*len)++] = val;
+      line += n;
+    }
+  }
+  return true;
+}
+
+int decodeLog(FILE *in) {
+  char line[256];
+  double time;
+  unsigned long id;
+  byte len, buf[8];
+
+  while (fgets(line, sizeof(line), in)) {
+    if (!parseLine(line, &time, &id, &len, buf)) {
+      continue;
+    }
+    bool known = false;
+    for (int i = 0; i < signalCount; i++) {
+      const SignalInfo &s = signals[i];
+      if (s.id != id || s.pos + s.len > len * 8) {
+        continue;
+      }
+      if (!known) {
+        printf("%17.6f %03lx ", time, id);
+        known = true;
+      }
+      long value = (long) genericGet(s, buf) - s.bias;
+      if (s.scale == 1 && !*s.unit) {
+        printf(" %s=0x%lx", s.name, value);
+      } else {
+        printf(" %s=%g%s", s.name, value * s.scale, s.unit);
+      }
+    }
+    if (known) {
+      printf("\n");
+    }
+  }
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+  if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
+    FILE *in = stdin;
+    if (argc >= 3 && !(in = fopen(argv[2], "r"))) {
+      perror(argv[2]);
+      return 1;
+    }
+    return decodeLog(in);
+  }
+  else if (argc == 2 && strcmp(argv[1], "-q") == 0) {
+    quiet = true;
+  }
+  else if (argc > 1) {
+    fprintf(stderr, "Usage: %s [-q] | -d [file]\n", argv[0]);
+    return 1;
+  }
+
+  return runTests();
+}
@@ -0,0 +1,221 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Sleep mode & wake up latency test
+ * ==========================================================================
+ *
+ * Runs the VirtualBMS with TWIZY_SLEEP against the charger & SEVCON models
+ * (TwizyVirtualBMS_models.h) through park / drive cycles with random
+ * parking times and wake up phases:
+ *  - the BMS must power down after the CAN inactivity timeout, and no
+ *    CAN clock ticks may run while asleep
+ *  - on key on, the time from the first CHARGER frame (waking up the
+ *    MCP2515, that frame is lost) to the first 0x155 on the bus is
+ *    measured; it must stay within 250 ms (the charger repeats its frames
+ *    every 100 ms and waits up to 10 s for the BMS)
+ *  - the drive handshake must complete without charger timeouts
+ *  - a wake up by a frame not passing the filters (foreign ID, bus
+ *    glitch) must not switch on the 3MW line or send 0x155, the BMS must
+ *    power down again
+ * Exit code 0 = all checks passed.
+ *
+ * Build (add -DTWIZY_CAN_RX_RING=8 to test with the RX ring):
+ *   g++ -std=c++11 -O2 -I../../src -o SleepTest SleepTest.cpp
+ *
+ * Usage:
+ *   SleepTest [-n cycles] [-v]
+ *     -n   park / drive cycles (default: 50)
+ *     -v   print each cycle
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+
+// Sleep mode needs the CAN IRQ pin:
+#ifndef TWIZY_CAN_IRQ_PIN
+#define TWIZY_CAN_IRQ_PIN       2
+#endif
+#undef TWIZY_SLEEP
+#define TWIZY_SLEEP             1
+
+#include "TwizyVirtualBMS.h"
+#include "TwizyVirtualBMS_models.h"
+
+#define WAKE_LIMIT_US           250000UL
+
+TwizyVirtualBMS twizy;
+TwizyHostCharger charger;
+TwizyHostSevcon sevcon;
+
+int failures = 0;
+unsigned long sleepTicks = 0;
+
+// Wake up latency measurement:
+unsigned long long firstWakeFrame = 0, first155 = 0;
+
+
+void bmsTicker(unsigned int clockCnt) {
+  if (twizy.isSleeping()) {
+    sleepTicks++;
+  }
+}
+
+void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// Run for <seconds> in 1 ms steps, optionally until <done> returns true:
+template <typename T>
+void run(double seconds, T done) {
+  unsigned long long end = twizyHost->clockUs + (unsigned long long)(seconds * 1e6);
+  while (twizyHost->clockUs < end && !done()) {
+    twizyHostAdvance(1000);
+    charger.loop();
+    sevcon.loop();
+    twizy.looper();
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+
+  int cycles = 50;
+  bool verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      cycles = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = true;
+    } else {
+      fprintf(stderr, "Usage: %s [-n cycles] [-v]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // bus monitor: charger frames (injected) & BMS 0x155
+  twizyHostCanBus.monitor = [](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (!sender && twizy.isSleeping() && !firstWakeFrame) {
+      firstWakeFrame = frame.time;
+    }
+    if (sender && frame.id == 0x155 && firstWakeFrame && !first155) {
+      first155 = frame.time;
+    }
+  };
+
+  Serial.out = NULL;
+  twizy.begin();
+  twizy.attachTicker(bmsTicker);
+  twizy.setPowerLimits(18000, 8000);
+  twizy.setChargeCurrent(35);
+  twizy.setSOH(100);
+  twizy.setSOCCP(8000);
+  twizy.setTemperature(20, 22, true);
+  twizy.setVoltageMV(55000, true);
+  twizy.setCurrentQA(0);
+
+  charger.attach();
+  sevcon.attach();
+
+  srand(1);
+  unsigned long long latencySum = 0, latencyMax = 0, bmsLatencyMax = 0;
+  unsigned long long maxSleepDelay = 0;
+  int wakeups = 0, late = 0, drives = 0, notAsleep = 0;
+
+  run(1, []() { return false; });
+  check(twizy.isSleeping(), "asleep after begin()");
+
+  // foreign frames: wake up (frame lost), another one not passing the filters:
+  {
+    static unsigned long frames155;
+    frames155 = 0;
+    auto monitor = twizyHostCanBus.monitor;
+    twizyHostCanBus.monitor = [monitor](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+      if (sender && frame.id == 0x155) frames155++;
+      monitor(frame, sender);
+    };
+    byte data[8] = { 0 };
+    unsigned long powerDowns = twizyHost->sleepCount;
+    bool ctlHigh = false;
+    twizyHostCanBus.inject(0x7FF, 8, data);
+    run(0.05, []() { return false; });
+    twizyHostCanBus.inject(0x7FF, 8, data);
+    for (int i = 0; i < 1000; i++) {
+      run(0.01, []() { return false; });
+      ctlHigh |= (digitalRead(TWIZY_3MW_CONTROL_PIN) == HIGH);
+    }
+    check(twizy.isSleeping() && twizyHost->sleepCount > powerDowns, "asleep again after a foreign frame wake up");
+    check(!ctlHigh && frames155 == 0, "no 3MW & 0x155 after a foreign frame wake up");
+    twizyHostCanBus.monitor = monitor;
+    firstWakeFrame = 0;
+  }
+
+  for (int cycle = 0; cycle < cycles; cycle++) {
+
+    // park 1 … 30 minutes, random phase:
+    unsigned long long parkStart = twizyHost->clockUs;
+    twizyHostAdvance(rand() % 100000);
+    run(60.0 * (1 + rand() % 30), []() { return false; });
+    if (!twizy.isSleeping()) {
+      notAsleep++;
+    }
+
+    // key on → drive mode, 20 s drive:
+    firstWakeFrame = first155 = 0;
+    charger.key = true;
+    run(30, []() { return sevcon.isEnabled(); });
+    if (sevcon.isEnabled()) {
+      drives++;
+    }
+    if (firstWakeFrame && first155) {
+      unsigned long long latency = first155 - firstWakeFrame;
+      wakeups++;
+      latencySum += latency;
+      latencyMax = std::max(latencyMax, latency);
+      bmsLatencyMax = std::max(bmsLatencyMax, (unsigned long long) twizy.getWakeLatency());
+      if (latency > WAKE_LIMIT_US) {
+        late++;
+      }
+      if (verbose) {
+        printf("cycle %3d: parked %4.0f s, wake frame → 0x155 %5.1f ms (BMS wake up → 0x155 %5.1f ms)\n",
+          cycle, (firstWakeFrame - parkStart) / 1e6, latency / 1e3, twizy.getWakeLatency() / 1e3);
+      }
+    }
+    sevcon.demand = 5000;
+    run(20, []() { return false; });
+    sevcon.demand = 0;
+
+    // key off → BMS asleep:
+    charger.key = false;
+    run(10, []() { return charger.getPhase() == ChgOff; });
+    unsigned long long chargerOff = twizyHost->clockUs;
+    run(10, []() { return twizy.isSleeping(); });
+    maxSleepDelay = std::max(maxSleepDelay, twizyHost->clockUs - chargerOff);
+  }
+
+  double simSec = twizyHost->clockUs / 1e6;
+  printf("%d cycles, %.0f s simulated, asleep %.1f %% (%lu power downs)\n",
+    cycles, simSec, 100.0 * twizyHost->sleepUs / twizyHost->clockUs, twizyHost->sleepCount);
+  printf("  wake frame → first 0x155: avg %.1f ms, max %.1f ms (limit %.0f ms)\n",
+    wakeups ? latencySum / 1e3 / wakeups : 0.0, latencyMax / 1e3, WAKE_LIMIT_US / 1e3);
+  printf("  BMS wake up → first 0x155: max %.1f ms\n", bmsLatencyMax / 1e3);
+  printf("  charger off → BMS asleep: max %.2f s\n", maxSleepDelay / 1e6);
+
+  check(notAsleep == 0, "asleep while parked");
+  check(sleepTicks == 0, "no CAN clock ticks while asleep");
+  check(wakeups == cycles, "woken up by the charger in every cycle");
+  check(late == 0, "wake up latency within limit");
+  check(drives == cycles, "drive mode reached in every cycle");
+  check(charger.timeouts == 0, "no charger handshake timeouts");
+  check(maxSleepDelay <= 2500000, "asleep within 2.5 s after the charger went silent");
+
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: SocketCAN runner (Linux)
+ * ==========================================================================
+ *
+ * Runs the VirtualBMS on a SocketCAN interface, i.e. on an SBC with a
+ * native CAN interface connected to the Twizy, or on vcan0 for testing.
+ * Prints the tick jitter & frame statistics every 10 seconds.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o SocketCanBMS SocketCanBMS.cpp
+ *
+ * Usage:
+ *   SocketCanBMS [-r prio] [ifname]
+ *     -r   run with realtime priority (SCHED_FIFO, needs CAP_SYS_NICE)
+ *   ifname defaults to vcan0.
+ *
+ * Test with vcan0:
+ *   sudo modprobe vcan
+ *   sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+ *   ./SocketCanBMS vcan0 &
+ *   cangen vcan0 -g 100 -I 423 -L 8 -D 0300000000000000 &
+ *   candump vcan0
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+#include "TwizyVirtualBMS_socketcan.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+
+TwizyVirtualBMS twizy;
+TwizySocketCan socketCan;
+
+volatile sig_atomic_t stopRequest = 0;
+
+void onSignal(int sig) {
+  stopRequest = 1;
+}
+
+
+void bmsEnterState(TwizyState currentState, TwizyState newState) {
+  printf("%10.3f s: %s -> %s\n", micros() / 1e6,
+    (const char *) twizy.stateName(currentState),
+    (const char *) twizy.stateName(newState));
+}
+
+
+void printStats() {
+  const TwizySocketCanStats &st = socketCan.getStats();
+  printf("%10.3f s: ticks=%lu missed=%lu jitter min/avg/max=%ld/%llu/%ld us"
+    " rx=%lu (%lu batches) tx=%lu (%lu batches) txDrops=%lu\n",
+    micros() / 1e6, st.ticks, st.missed,
+    st.ticks ? st.jitterMinUs : 0, st.ticks ? st.jitterSumUs / st.ticks : 0, st.jitterMaxUs,
+    st.rxFrames, st.rxBatches, st.txFrames, st.txBatches, st.txDrops);
+  fflush(stdout);
+}
+
+
+void loop() {
+  static unsigned long lastStats = 0;
+  twizy.looper();
+  if (millis() - lastStats >= 10000) {
+    lastStats = millis();
+    printStats();
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+
+  const char *ifname = "vcan0";
+  int prio = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i+1 < argc) {
+      prio = atoi(argv[++i]);
+    } else if (argv[i][0] != '-') {
+      ifname = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [-r prio] [ifname]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (prio > 0) {
+    struct sched_param sp;
+    sp.sched_priority = prio;
+    if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0 || mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+      perror("realtime priority");
+    }
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+
+  twizy.begin();
+  twizy.attachEnterState(bmsEnterState);
+
+  twizy.setPowerLimits(18000, 8000);
+  twizy.setChargeCurrent(35);
+  twizy.setSOH(100);
+  twizy.setSOC(90);
+  twizy.setTemperature(20, 20, true);
+  twizy.setVoltage(55.0, true);
+  twizy.setCurrent(0.0);
+
+  if (!socketCan.open(ifname)) {
+    perror(ifname);
+    return 1;
+  }
+  if (!socketCan.run(loop, &stopRequest)) {
+    perror("run");
+    return 1;
+  }
+
+  printStats();
+  return 0;
+}
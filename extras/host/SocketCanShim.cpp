@@ -0,0 +1,219 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: SocketCAN stand-in for kernels without CAN support
+ * ==========================================================================
+ *
+ * LD_PRELOAD library replacing the raw CAN socket of TwizyVirtualBMS_socketcan.h
+ * by one end of an AF_UNIX SOCK_SEQPACKET socket pair (one struct can_frame
+ * per datagram), so the gateway runs unchanged (epoll, timerfd, recvmmsg,
+ * sendmmsg) where vcan is not available, i.e. in containers. The other end
+ * is served by a thread simulating the CHARGER:
+ *  - sends 0x423 & 0x597 (drive) every 100 ms, plus 0x7FF which has to be
+ *    dropped by the kernel filters set by the gateway (CAN_RAW_FILTER,
+ *    applied by the shim like the kernel does)
+ *  - receives the frames sent by the VirtualBMS, measures the 0x155 period
+ * The statistics are printed to stderr on exit.
+ *
+ * This does not cover the kernel CAN stack & driver timing, use vcan-test.sh
+ * on a kernel with CAN support for that.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -shared -fPIC -pthread -o SocketCanShim.so SocketCanShim.cpp -ldl
+ *
+ * Usage:
+ *   LD_PRELOAD=./SocketCanShim.so ./SocketCanBMS vcan0
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+static int shimFd = -1;                 // gateway end
+static int peerFd = -1;                 // CHARGER end
+static std::mutex filterLock;
+static std::vector<struct can_filter> filters;
+static bool filtersSet = false;
+static std::atomic<bool> stopPeer(false);
+static pthread_t peerThread;
+static bool peerStarted = false;
+static bool filtersBeforeBind = false;
+
+// Statistics:
+static unsigned long sent423 = 0, sent597 = 0, sent7FF = 0, filtered = 0;
+static unsigned long rxFrames = 0, rx155 = 0, filterUpdates = 0;
+static long long periodMin = LLONG_MAX, periodMax = 0, periodSum = 0, periodCnt = 0;
+
+
+static long long monotonicUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Kernel CAN_RAW filter semantics: pass if any (id & mask) matches,
+// no filters set = pass all, empty filter list = pass none
+static bool passes(canid_t id) {
+  std::lock_guard<std::mutex> guard(filterLock);
+  if (!filtersSet) {
+    return true;
+  }
+  for (size_t i = 0; i < filters.size(); i++) {
+    if ((id & filters[i].can_mask) == (filters[i].can_id & filters[i].can_mask)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void peerSend(canid_t id, const char *hex, unsigned long &count) {
+  if (!passes(id)) {
+    filtered++;
+    return;
+  }
+  struct can_frame cf;
+  memset(&cf, 0, sizeof(cf));
+  cf.can_id = id;
+  cf.can_dlc = 8;
+  for (int i = 0; i < 8; i++) {
+    sscanf(hex + 2 * i, "%2hhx", &cf.data[i]);
+  }
+  if (send(peerFd, &cf, sizeof(cf), MSG_DONTWAIT) == sizeof(cf)) {
+    count++;
+  }
+}
+
+static void *peerRun(void *) {
+  long long nextSend = monotonicUs(), last155 = 0;
+  while (!stopPeer) {
+    long long now = monotonicUs();
+    if (now >= nextSend) {
+      nextSend += 100000;
+      peerSend(0x423, "0300000000000000", sent423);
+      peerSend(0x597, "00F400D00000003C", sent597);
+      peerSend(0x7FF, "0000000000000000", sent7FF);
+    }
+    struct can_frame cf;
+    while (recv(peerFd, &cf, sizeof(cf), MSG_DONTWAIT) == sizeof(cf)) {
+      rxFrames++;
+      if (cf.can_id == 0x155) {
+        now = monotonicUs();
+        if (last155) {
+          long long period = now - last155;
+          if (period < periodMin) periodMin = period;
+          if (period > periodMax) periodMax = period;
+          periodSum += period;
+          periodCnt++;
+        }
+        last155 = now;
+        rx155++;
+      }
+    }
+    usleep(500);
+  }
+  return NULL;
+}
+
+__attribute__((destructor)) static void shimReport() {
+  if (!peerStarted) {
+    return;
+  }
+  stopPeer = true;
+  pthread_join(peerThread, NULL);
+  fprintf(stderr, "SocketCanShim: sent 423=%lu 597=%lu 7FF=%lu, dropped by filters=%lu, filter updates=%lu%s\n",
+    sent423, sent597, sent7FF, filtered, filterUpdates, filtersBeforeBind ? "" : " (NOT set before bind)");
+  fprintf(stderr, "SocketCanShim: received %lu frames, 0x155=%lu, period min/avg/max=%lld/%lld/%lld us\n",
+    rxFrames, rx155, periodCnt ? periodMin : 0, periodCnt ? periodSum / periodCnt : 0, periodMax);
+}
+
+
+extern "C" {
+
+int socket(int domain, int type, int protocol) {
+  static int (*real)(int, int, int) = (int (*)(int, int, int)) dlsym(RTLD_NEXT, "socket");
+  if (domain != PF_CAN || shimFd >= 0) {
+    return real(domain, type, protocol);
+  }
+  int sv[2];
+  int flags = type & (SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | flags, 0, sv) < 0) {
+    return -1;
+  }
+  shimFd = sv[0];
+  peerFd = sv[1];
+  return shimFd;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  static int (*real)(int, unsigned long, void *) = (int (*)(int, unsigned long, void *)) dlsym(RTLD_NEXT, "ioctl");
+  va_list ap;
+  va_start(ap, request);
+  void *arg = va_arg(ap, void *);
+  va_end(ap);
+  if (fd == shimFd && fd >= 0 && request == SIOCGIFINDEX) {
+    ((struct ifreq *) arg)->ifr_ifindex = 1;
+    return 0;
+  }
+  return real(fd, request, arg);
+}
+
+int bind(int fd, const struct sockaddr *addr, socklen_t len) {
+  static int (*real)(int, const struct sockaddr *, socklen_t) =
+    (int (*)(int, const struct sockaddr *, socklen_t)) dlsym(RTLD_NEXT, "bind");
+  if (fd == shimFd && fd >= 0) {
+    if (addr->sa_family != AF_CAN) {
+      errno = EINVAL;
+      return -1;
+    }
+    // frames are received from bind() on:
+    filtersBeforeBind = filtersSet;
+    peerStarted = (pthread_create(&peerThread, NULL, peerRun, NULL) == 0);
+    return 0;
+  }
+  return real(fd, addr, len);
+}
+
+int setsockopt(int fd, int level, int name, const void *val, socklen_t len) {
+  static int (*real)(int, int, int, const void *, socklen_t) =
+    (int (*)(int, int, int, const void *, socklen_t)) dlsym(RTLD_NEXT, "setsockopt");
+  if (fd == shimFd && fd >= 0 && level == SOL_CAN_RAW) {
+    if (name != CAN_RAW_FILTER || len % sizeof(struct can_filter)) {
+      errno = EINVAL;
+      return -1;
+    }
+    std::lock_guard<std::mutex> guard(filterLock);
+    const struct can_filter *f = (const struct can_filter *) val;
+    filters.assign(f, f + len / sizeof(struct can_filter));
+    filtersSet = true;
+    filterUpdates++;
+    return 0;
+  }
+  return real(fd, level, name, val, len);
+}
+
+}
@@ -0,0 +1,173 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: State transition table check
+ * ==========================================================================
+ *
+ * Prints the state × event matrix of the transition table of the library
+ * (twizyTransitions) and checks it:
+ *  - all rows refer to valid events & states
+ *  - no row is shadowed by an earlier row for the same event
+ *  - all states except Error are reachable from Off by events
+ *  - Off is reachable from all states by TwizyEvChargerOff
+ *  - all frame state bytes (twizyStateFrames) fit their signals
+ * Exit code 0 = all checks passed.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o StateTable StateTable.cpp
+ *
+ * Usage:
+ *   StateTable [-d]
+ *     -d   print the transitions in Graphviz dot format instead
+ *          (i.e. ./StateTable -d | dot -Tsvg > states.svg)
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#define STATES    13
+#define EVENTS    (TwizyEvTick + 1)
+
+const char *eventName[EVENTS] = {
+  "ChargerOn", "ChargerOff", "Drive", "Charge", "Trickle", "Stop", "Tick"
+};
+const int rowCount = sizeof(twizyTransitions) / sizeof(twizyTransitions[0]);
+
+int failures = 0;
+
+
+void check(bool ok, const char *what) {
+  printf("  %s: %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok) failures++;
+}
+
+// New state for <event> in <state> like TwizyVirtualBMS::handleEvent(),
+// -1 = no transition; <row> = matching row index or -1:
+int lookup(int state, int event, int *row = NULL) {
+  for (int i = 0; i < rowCount; i++) {
+    const TwizyTransition &t = twizyTransitions[i];
+    if (t.event == event && (t.from == state || t.from == TWIZY_ANY_STATE)) {
+      if (row) *row = i;
+      return (t.to == TWIZY_STAY || t.to == state) ? -1 : t.to;
+    }
+  }
+  if (row) *row = -1;
+  return -1;
+}
+
+
+int main(int argc, char *argv[]) {
+
+  bool dot = false;
+  if (argc == 2 && strcmp(argv[1], "-d") == 0) {
+    dot = true;
+  } else if (argc > 1) {
+    fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
+    return 1;
+  }
+
+  if (dot) {
+    printf("digraph TwizyVirtualBMS {\n");
+    for (int s = 0; s < STATES; s++) {
+      for (int e = 0; e < EVENTS; e++) {
+        int to = lookup(s, e);
+        if (to >= 0) {
+          printf("  %s -> %s [label=\"%s\"%s];\n", (const char *) twizyStateName[s],
+            (const char *) twizyStateName[to], eventName[e], (e == TwizyEvTick) ? " style=dashed" : "");
+        }
+      }
+    }
+    printf("}\n");
+    return 0;
+  }
+
+  // matrix:
+  printf("%-13s", "");
+  for (int e = 0; e < EVENTS; e++) {
+    printf(" %-12s", eventName[e]);
+  }
+  printf("\n");
+  for (int s = 0; s < STATES; s++) {
+    printf("%-13s", (const char *) twizyStateName[s]);
+    for (int e = 0; e < EVENTS; e++) {
+      int to = lookup(s, e);
+      printf(" %-12s", (to >= 0) ? (const char *) twizyStateName[to] : "-");
+    }
+    printf("\n");
+  }
+  printf("%d transitions, %d bytes flash\n", rowCount, (int) sizeof(twizyTransitions));
+
+  // rows valid & used:
+  bool valid = true, used = true;
+  for (int i = 0; i < rowCount; i++) {
+    const TwizyTransition &t = twizyTransitions[i];
+    if (t.event >= EVENTS
+        || (t.from >= STATES && t.from != TWIZY_ANY_STATE)
+        || (t.to >= STATES && t.to != TWIZY_STAY)) {
+      printf("  row %d: invalid\n", i);
+      valid = false;
+      continue;
+    }
+    bool hit = false;
+    for (int s = 0; s < STATES && !hit; s++) {
+      int row;
+      lookup(s, t.event, &row);
+      hit = (row == i);
+    }
+    if (!hit) {
+      printf("  row %d: %s in %s shadowed by an earlier row\n", i, eventName[t.event],
+        (t.from == TWIZY_ANY_STATE) ? "any state" : (const char *) twizyStateName[t.from]);
+      used = false;
+    }
+  }
+  check(valid, "all rows valid");
+  check(used, "no row shadowed");
+
+  // reachability from Off:
+  bool reached[STATES] = { true };
+  for (bool more = true; more; ) {
+    more = false;
+    for (int s = 0; s < STATES; s++) {
+      for (int e = 0; e < EVENTS && reached[s]; e++) {
+        int to = lookup(s, e);
+        if (to >= 0 && !reached[to]) {
+          reached[to] = more = true;
+        }
+      }
+    }
+  }
+  bool allReached = true;
+  for (int s = 0; s < STATES; s++) {
+    if (!reached[s] && s != Error) {
+      printf("  %s not reachable from Off\n", (const char *) twizyStateName[s]);
+      allReached = false;
+    }
+  }
+  check(allReached, "all states except Error reachable from Off");
+
+  bool offReached = true;
+  for (int s = 1; s < STATES; s++) {
+    offReached &= (lookup(s, TwizyEvChargerOff) == Off);
+  }
+  check(offReached, "all states go Off on ChargerOff");
+
+  // frame state bytes:
+  bool bytesOk = true;
+  for (int s = 0; s < STATES; s++) {
+    const TwizyStateFrames &f = twizyStateFrames[s];
+    for (uint16_t val : { f.level155, f.state155, f.state424, f.state425 }) {
+      bytesOk &= (val <= 0xFF || val == TWIZY_KEEP);
+    }
+  }
+  check(bytesOk, "frame state bytes are byte values or TWIZY_KEEP");
+
+  printf("%s\n", failures ? "FAILED" : "PASSED");
+  return failures ? 1 : 0;
+}
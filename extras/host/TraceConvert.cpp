@@ -0,0 +1,154 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: CAN trace converter
+ * ==========================================================================
+ *
+ * Converts a binary CAN trace written by TwizyVirtualBMS::dumpTrace()
+ * (TWIZY_CAN_TRACE) into candump log, Vector ASC or a text listing
+ * including the VirtualBMS state.
+ *
+ * The input may contain other serial output (i.e. debug logs), the
+ * converter searches for the trace header.
+ *
+ * Build:
+ *   g++ -std=c++11 -O2 -I../../src -o TraceConvert TraceConvert.cpp
+ *
+ * Usage:
+ *   TraceConvert [-a | -l] [-i ifname] [file]
+ *     -a   Vector ASC format
+ *     -l   text listing with direction & VirtualBMS state
+ *     -i   interface name for candump format (default: can0)
+ *   Default output is candump log format, reads stdin if no file is given.
+ *
+ * Author: Michael Balzer <dexter@dexters-web.de>
+ *
+ * License:
+ *  This is free software under GNU Lesser General Public License (LGPL)
+ *  https://www.gnu.org/licenses/lgpl.html
+ *
+ */
+
+#define TWIZY_HOST
+#include "TwizyVirtualBMS_config.h"
+#include "TwizyVirtualBMS.h"
+
+#include <vector>
+#include <string>
+
+enum OutputFormat { Candump, Asc, Listing };
+
+
+int main(int argc, char *argv[]) {
+
+  OutputFormat format = Candump;
+  const char *ifname = "can0";
+  FILE *in = stdin;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-a") == 0) {
+      format = Asc;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      format = Listing;
+    } else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+      ifname = argv[++i];
+    } else if (argv[i][0] != '-' && in == stdin) {
+      in = fopen(argv[i], "rb");
+      if (!in) {
+        perror(argv[i]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "Usage: %s [-a | -l] [-i ifname] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<byte> data;
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    data.push_back((byte) c);
+  }
+
+  // find header:
+  size_t pos = 0;
+  const size_t magicLen = strlen(TWIZY_TRACE_MAGIC);
+  while (pos + magicLen + 3 <= data.size() && memcmp(&data[pos], TWIZY_TRACE_MAGIC, magicLen) != 0) {
+    pos++;
+  }
+  if (pos + magicLen + 3 > data.size()) {
+    fprintf(stderr, "No trace found\n");
+    return 1;
+  }
+  pos += magicLen;
+  if (data[pos] != TWIZY_TRACE_VERSION) {
+    fprintf(stderr, "Unsupported trace version %d\n", data[pos]);
+    return 1;
+  }
+  unsigned int count = data[pos+1];
+  pos += 3;
+
+  if (format == Asc) {
+    printf("date Thu Jan 1 00:00:00.000 am 1970\n");
+    printf("base hex  timestamps absolute\n");
+    printf("no internal events logged\n");
+  }
+
+  // timestamps relative to the first record (the MCU clock wraps after ~71 minutes):
+  unsigned long long time = 0;
+  uint32_t lastTime = 0;
+
+  for (unsigned int n = 0; n < count; n++) {
+    if (pos + 7 > data.size()) {
+      fprintf(stderr, "Trace truncated at record %u\n", n);
+      return 1;
+    }
+    uint32_t recTime = data[pos] | (data[pos+1] << 8) | (data[pos+2] << 16) | ((uint32_t) data[pos+3] << 24);
+    unsigned int idFlags = data[pos+4] | (data[pos+5] << 8);
+    byte len = data[pos+6] & 0x0F;
+    byte state = data[pos+6] >> 4;
+    pos += 7;
+    if (len > 8 || pos + len > data.size()) {
+      fprintf(stderr, "Trace corrupted at record %u\n", n);
+      return 1;
+    }
+    const byte *buf = &data[pos];
+    pos += len;
+
+    if (n > 0) {
+      time += (uint32_t)(recTime - lastTime);
+    }
+    lastTime = recTime;
+
+    unsigned int id = idFlags & 0x7FF;
+    bool tx = (idFlags & TWIZY_TRACE_TX) != 0;
+
+    switch (format) {
+      case Candump:
+        printf("(%llu.%06llu) %s %03X#", time / 1000000, time % 1000000, ifname, id);
+        for (byte i = 0; i < len; i++) {
+          printf("%02X", buf[i]);
+        }
+        printf("\n");
+        break;
+      case Asc:
+        printf("%11.6f 1  %-15X %s   d %d", time / 1e6, id, tx ? "Tx" : "Rx", len);
+        for (byte i = 0; i < len; i++) {
+          printf(" %02X", buf[i]);
+        }
+        printf("\n");
+        break;
+      case Listing:
+        printf("%11.6f %s %03X [%d]", time / 1e6, tx ? "TX" : "RX", id, len);
+        for (byte i = 0; i < len; i++) {
+          printf(" %02X", buf[i]);
+        }
+        for (byte i = len; i < 8; i++) {
+          printf("   ");
+        }
+        printf("  %s\n", state < 13 ? (const char *) twizyStateName[state] : "?");
+        break;
+    }
+  }
+
+  return 0;
+}
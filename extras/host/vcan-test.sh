@@ -0,0 +1,48 @@
+#!/bin/sh
+# Twizy Virtual BMS: SocketCAN test on vcan0, idle & under CPU load
+#
+# Sets up vcan0, runs SocketCanBMS against simulated CHARGER frames
+# (cangen) for the given time, once on an idle system and once with all
+# cores busy (stress-ng), and prints the last statistics line of each run
+# (tick jitter min/avg/max, missed ticks, frame & batch counts).
+#
+# Needs root (modprobe, ip link), the vcan kernel module, can-utils and
+# stress-ng (i.e. Debian/Ubuntu: apt install can-utils stress-ng).
+#
+# Usage: sudo ./vcan-test.sh [seconds [SocketCanBMS options]]   (default: 60)
+
+SECONDS_RUN=${1:-60}
+[ $# -gt 0 ] && shift
+OPTIONS="$*"
+cd "$(dirname "$0")" || exit 1
+
+g++ -std=c++11 -O2 -I../../src -o SocketCanBMS SocketCanBMS.cpp || exit 1
+
+modprobe vcan 2>/dev/null
+ip link show vcan0 >/dev/null 2>&1 || ip link add dev vcan0 type vcan || exit 1
+ip link set up vcan0 || exit 1
+
+run() {
+  ./SocketCanBMS $OPTIONS vcan0 > "vcan-test-$1.log" &
+  BMS=$!
+  sleep 1
+  # CHARGER: 0x423 "key on" & 0x597 "drive" every 100 ms
+  cangen vcan0 -g 100 -I 423 -L 8 -D 0300000000000000 &
+  GEN1=$!
+  cangen vcan0 -g 100 -I 597 -L 8 -D 00F400D00000003C &
+  GEN2=$!
+  sleep "$SECONDS_RUN"
+  kill $GEN1 $GEN2
+  kill -INT $BMS
+  wait $BMS
+  echo "$1: $(grep 'jitter' "vcan-test-$1.log" | tail -1)"
+}
+
+run idle
+
+stress-ng --cpu "$(nproc)" --io 2 --vm 1 --vm-bytes 128M --quiet &
+STRESS=$!
+sleep 2
+run stress
+kill $STRESS
+wait $STRESS 2>/dev/null
@@ -44,29 +44,49 @@
 #define TWIZY_TAG               "twizy."
 #endif
 
-#include <Arduino.h>
-#include <avr/pgmspace.h>
-
-#include <mcp_can.h>
-#include <mcp_can_dfs.h>
-
 #ifndef _TwizyVirtualBMS_config_h
 #warning "Fallback to default TwizyVirtualBMS_config.h -- you should copy this into your sketch folder"
 #include "TwizyVirtualBMS_config.h"
 #endif
 
-#ifndef TWIZY_USE_TIMER
-#define TWIZY_USE_TIMER 1
+
+// ==========================================================================
+// HARDWARE BACKEND
+// ==========================================================================
+// 
+// The library accesses the hardware only through these backend elements:
+//  - CAN controller: class TwizyCanDriver (MCP_CAN API & constants)
+//  - CAN clock: twizyTimerBegin(periodUs, isr, arg)
+//  - GPIO: pinMode(), digitalWrite(), twizyAttachInterrupt(irq, isr, arg, mode)
+//  - Serial port: Serial.print() / Serial.println()
+//  - Flash strings: PROGMEM, F(), __FlashStringHelper
+//  - ADC (TWIZY_ADC_CHANNELS > 0): twizyAdcBegin(pin, isr, arg),
+//    twizyAdcSelect(pin), twizyAdcRead()
+//  - Power down (TWIZY_SLEEP > 0): twizyPowerDown(irq),
+//    TwizyCanDriver::sleepWakeOnBus() / clearWake()
+// 
+// Backends:
+//  - Arduino (default): MCP2515 + TimerOne/FlexiTimer2/TimerThree
+//  - Host (TWIZY_HOST, default on non-Arduino builds): in-memory CAN bus
+//    and virtual clock for running the library on a PC, see extras/host/
+//  - SocketCAN (Linux): host backend bridged to a CAN interface, include
+//    TwizyVirtualBMS_socketcan.h after the library
+// 
+// Interrupt handlers are registered with an argument (the instance), so
+// any number of TwizyVirtualBMS instances can coexist (Arduino backend:
+// up to TWIZY_MAX_INSTANCES).
+// 
+
+typedef void (*TwizyISR)(void *arg);
+
+#if !defined(ARDUINO) && !defined(TWIZY_HOST)
+#define TWIZY_HOST
 #endif
 
-#if TWIZY_USE_TIMER == 1
-#include <TimerOne.h>
-#elif TWIZY_USE_TIMER == 2
-#include <FlexiTimer2.h>
-#elif TWIZY_USE_TIMER == 3
-#include <TimerThree.h>
+#ifdef TWIZY_HOST
+#include "TwizyVirtualBMS_host.h"
 #else
-#error "TWIZY_USE_TIMER invalid, please set to 1, 2 or 3!"
+#include "TwizyVirtualBMS_arduino.h"
 #endif
 
 // ==========================================================================
@@ -85,6 +105,106 @@
 #define TWIZY_SEND_INIT_FRAMES     1
 #endif
 
+#ifndef TWIZY_INFO_FRAME
+#define TWIZY_INFO_FRAME           1
+#endif
+
+#ifndef TWIZY_CAN_TXQUEUE_SIZE
+#define TWIZY_CAN_TXQUEUE_SIZE     8
+#endif
+
+#ifndef TWIZY_CAN_RX_RING
+#define TWIZY_CAN_RX_RING          0
+#endif
+
+#ifndef TWIZY_CAN_RX_HANDLERS
+#define TWIZY_CAN_RX_HANDLERS      4
+#endif
+
+#ifndef TWIZY_EVENT_QUEUE
+#define TWIZY_EVENT_QUEUE          4    // power of 2
+#endif
+
+#ifndef TWIZY_TICK_STATS
+#define TWIZY_TICK_STATS           0
+#endif
+
+#ifndef TWIZY_CAN_TRACE
+#define TWIZY_CAN_TRACE            0
+#endif
+
+#ifndef TWIZY_LOG_BUFFER
+#define TWIZY_LOG_BUFFER           0
+#endif
+
+#ifndef TWIZY_SOC_ESTIMATOR
+#define TWIZY_SOC_ESTIMATOR        0
+#endif
+
+#ifndef TWIZY_SOC_REST_QA
+#define TWIZY_SOC_REST_QA          8         // 2 A
+#endif
+
+#ifndef TWIZY_SOC_REST_TICKS
+#define TWIZY_SOC_REST_TICKS       90000UL   // 15 minutes
+#endif
+
+#ifndef TWIZY_ADC_CHANNELS
+#define TWIZY_ADC_CHANNELS         0
+#endif
+
+#ifndef TWIZY_ADC_OVERSAMPLE
+#define TWIZY_ADC_OVERSAMPLE       16
+#endif
+
+#ifndef TWIZY_ADC_RING
+#define TWIZY_ADC_RING             4
+#endif
+
+#if TWIZY_ADC_CHANNELS > 8
+  #error "TWIZY_ADC_CHANNELS: max 8 inputs"
+#endif
+
+#if TWIZY_ADC_CHANNELS > 0
+  #if (TWIZY_ADC_OVERSAMPLE & (TWIZY_ADC_OVERSAMPLE - 1)) || (TWIZY_ADC_OVERSAMPLE > 64)
+    #error "TWIZY_ADC_OVERSAMPLE must be a power of 2 (max 64)"
+  #endif
+  #if (TWIZY_ADC_RING & (TWIZY_ADC_RING - 1)) || (TWIZY_ADC_RING < 2)
+    #error "TWIZY_ADC_RING must be a power of 2 (min 2)"
+  #endif
+#endif
+
+#if (TWIZY_EVENT_QUEUE & (TWIZY_EVENT_QUEUE - 1)) || (TWIZY_EVENT_QUEUE > 128)
+  #error "TWIZY_EVENT_QUEUE must be a power of 2 (max 128)"
+#endif
+
+#if TWIZY_CAN_TRACE > 255
+  #error "TWIZY_CAN_TRACE: max 255 records"
+#endif
+
+#if TWIZY_LOG_BUFFER > 0
+  #if (TWIZY_LOG_BUFFER & (TWIZY_LOG_BUFFER - 1)) || (TWIZY_LOG_BUFFER < 32) || (TWIZY_LOG_BUFFER > 256)
+    #error "TWIZY_LOG_BUFFER must be a power of 2 (32 … 256)"
+  #endif
+#endif
+
+#ifndef TWIZY_SLEEP
+#define TWIZY_SLEEP                0
+#endif
+
+#if TWIZY_SLEEP > 0 && !defined(TWIZY_CAN_IRQ_PIN)
+  #error "TWIZY_SLEEP needs TWIZY_CAN_IRQ_PIN"
+#endif
+
+#if TWIZY_CAN_RX_RING > 0
+  #ifndef TWIZY_CAN_IRQ_PIN
+    #error "TWIZY_CAN_RX_RING needs TWIZY_CAN_IRQ_PIN"
+  #endif
+  #if (TWIZY_CAN_RX_RING & (TWIZY_CAN_RX_RING - 1)) || (TWIZY_CAN_RX_RING > 128)
+    #error "TWIZY_CAN_RX_RING must be a power of 2 (max 128)"
+  #endif
+#endif
+
 
 // ==========================================================================
 // TYPES AND CONSTANTS
@@ -155,6 +275,76 @@ const char twizyStateName[13][13] PROGMEM = {
   "StopTrickle"
 };
 
+// State machine events (posted by the frame handlers, processed by the ticker):
+enum TwizyEvent {
+  TwizyEvChargerOn = 0,   // 0x423: charger awake
+  TwizyEvChargerOff,      // 0x423: charger shut down
+  TwizyEvDrive,           // 0x597 mode C: drive requested
+  TwizyEvCharge,          // 0x597 mode B: charge requested
+  TwizyEvTrickle,         // 0x597 mode 9: trickle charge requested
+  TwizyEvStop,            // 0x597 mode D: stop requested
+  TwizyEvTick,            // every tick (not in Off & Error): automatic transitions
+};
+
+// State transition table: first row matching event & current state wins.
+// Transitions on TwizyEvTick need the confirmation of the CheckState callback.
+#define TWIZY_ANY_STATE     0xFF    // from: any state
+#define TWIZY_STAY          0xFF    // to: no transition
+struct TwizyTransition {
+  uint8_t event;
+  uint8_t from;
+  uint8_t to;
+};
+const TwizyTransition twizyTransitions[] PROGMEM = {
+  // CHARGER 0x423:
+  { TwizyEvChargerOn,   Off,              Init },
+  { TwizyEvChargerOff,  TWIZY_ANY_STATE,  Off },
+  // CHARGER 0x597 mode:
+  { TwizyEvDrive,       Driving,          TWIZY_STAY },
+  { TwizyEvDrive,       TWIZY_ANY_STATE,  StartDrive },
+  { TwizyEvCharge,      Charging,         TWIZY_STAY },
+  { TwizyEvCharge,      TWIZY_ANY_STATE,  StartCharge },
+  { TwizyEvTrickle,     Trickle,          TWIZY_STAY },
+  { TwizyEvTrickle,     TWIZY_ANY_STATE,  StartTrickle },
+  { TwizyEvStop,        Driving,          StopDrive },
+  { TwizyEvStop,        Charging,         StopCharge },
+  { TwizyEvStop,        Trickle,          StopTrickle },
+  // automatic:
+  { TwizyEvTick,        Init,             Ready },
+  { TwizyEvTick,        StopDrive,        Ready },
+  { TwizyEvTick,        StopCharge,       Ready },
+  { TwizyEvTick,        StopTrickle,      Ready },
+  { TwizyEvTick,        StartDrive,       Driving },
+  { TwizyEvTick,        StartCharge,      Charging },
+  { TwizyEvTick,        StartTrickle,     Trickle },
+};
+
+// Frame state bytes set on entering a state (TWIZY_KEEP = unchanged),
+// indexed by TwizyState. Actions beyond this are done by enterState().
+#define TWIZY_KEEP          0x100
+struct TwizyStateFrames {
+  uint16_t level155;      // 0x155 byte 0: charge current level
+  uint16_t state155;      // 0x155 byte 3
+  uint16_t state424;      // 0x424 byte 0
+  uint16_t state425;      // 0x425 byte 0
+};
+const TwizyStateFrames twizyStateFrames[13] PROGMEM = {
+  //  level155    state155    state424    state425
+  {   0xFF,       0x94,       0x00,       0x1D        },  // Off
+  {   0xFF,       0x94,       0x00,       0x1D        },  // Init
+  {   TWIZY_KEEP, 0x94,       TWIZY_KEEP, 0x24        },  // Error (0x424 |= 0x80)
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, 0x24        },  // Ready (level & 0x424 conditional)
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP  },  // StartDrive
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, 0x2A        },  // Driving
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP  },  // StopDrive
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP  },  // StartCharge
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, 0x0A        },  // Charging
+  {   TWIZY_KEEP, TWIZY_KEEP, 0x12,       TWIZY_KEEP  },  // StopCharge
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, 0x2C        },  // StartTrickle
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, 0x2A        },  // Trickle
+  {   TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP, TWIZY_KEEP  },  // StopTrickle
+};
+
 
 // Known error codes for setError():
 // Note: these can be used singularly or be ORed to set multiple indicators.
@@ -168,6 +358,164 @@ const char twizyStateName[13][13] PROGMEM = {
 #define TWIZY_SERV_STOP     0x00eeff00    // set SERV + STOP indicator + beep
 
 
+// Cell voltage statistics for setCellVoltages():
+struct TwizyCellStats {
+  uint16_t minMV;     // lowest cell voltage [mV]
+  uint16_t maxMV;     // highest cell voltage [mV]
+  uint16_t deltaMV;   // max - min [mV]
+  uint8_t minCell;    // cell number (1 .. 16) of lowest voltage
+  uint8_t maxCell;    // cell number (1 .. 16) of highest voltage
+};
+
+
+// Open circuit voltage table point (SOC estimator):
+struct TwizyOCVPoint {
+  uint16_t cellMV;    // cell rest voltage [mV], ascending
+  uint16_t socCP;     // SOC [1/100 %]
+};
+
+#if TWIZY_SOC_ESTIMATOR > 0
+// Default OCV curve, typical NMC / LiMn cell:
+const TwizyOCVPoint twizyDefaultOCV[] PROGMEM = {
+  { 3300,     0 }, { 3500,   500 }, { 3600,  1000 }, { 3650,  2000 },
+  { 3700,  3000 }, { 3750,  4000 }, { 3800,  5000 }, { 3870,  6000 },
+  { 3950,  7000 }, { 4020,  8000 }, { 4080,  9000 }, { 4150, 10000 }
+};
+#endif
+
+
+// Derating result (twizyDerate):
+struct TwizyDerateLimits {
+  uint16_t drive;     // drive power [W]
+  uint16_t recup;     // recuperation power [W]
+  uint8_t charge;     // charge current [A]
+};
+
+
+// Pack model aggregation of a cell / sensor group (TwizyPack):
+enum TwizyAggregate {
+  TwizyAggMin = 0,
+  TwizyAggMax,
+  TwizyAggMean
+};
+
+// Pack model statistics over all physical cells & sensors (TwizyPack):
+struct TwizyPackStats {
+  uint16_t minMV;     // lowest cell voltage [mV]
+  uint16_t maxMV;     // highest cell voltage [mV]
+  uint16_t meanMV;    // average cell voltage [mV]
+  uint32_t sumMV;     // sum of all cell voltages [mV]
+  uint16_t minCell;   // physical cell number (1 .. CELLS) of lowest voltage
+  uint16_t maxCell;   // physical cell number (1 .. CELLS) of highest voltage
+  int8_t minTemp;     // lowest sensor temperature [°C]
+  int8_t maxTemp;     // highest sensor temperature [°C]
+};
+
+
+// Tick timing statistics (TWIZY_TICK_STATS):
+enum TwizyTickPhase {
+  TwizyTickLatency = 0,   // timer interrupt → ticker() start (tick start jitter)
+  TwizyTickSend,          // state events received, sending the frames due
+  TwizyTickState,         // 3MW pulse cycle, state transitions, timeout
+  TwizyTickUser,          // user Ticker callback
+};
+#define TWIZY_TICK_PHASES   4
+const char twizyTickPhaseName[TWIZY_TICK_PHASES][9] PROGMEM = {
+  "- tLatcy",
+  "- tSend",
+  "- tState",
+  "- tUser"
+};
+#define TWIZY_TICK_BUCKETS  8   // histogram: < 128 µs, < 256 µs … < 8192 µs, more
+
+struct TwizyTickStats {
+  unsigned long ticks;                                  // ticks processed
+  unsigned int missed;                                  // ticks lost (ticker late)
+  unsigned int overruns;                                // ticker done after next tick due
+  unsigned long maxUs[TWIZY_TICK_PHASES];               // max time per phase [µs]
+  unsigned int hist[TWIZY_TICK_PHASES][TWIZY_TICK_BUCKETS]; // time histogram per phase
+};
+
+
+// CAN trace record (TWIZY_CAN_TRACE):
+struct TwizyTraceRecord {
+  uint32_t time;      // micros()
+  uint16_t idFlags;   // bits 0-10: CAN ID, bit 15: sent by BMS
+  uint8_t lenState;   // bits 0-3: data length, bits 4-7: TwizyState
+  uint8_t data[8];
+};
+#define TWIZY_TRACE_TX      0x8000
+
+// Binary trace dump format, see dumpTrace():
+#define TWIZY_TRACE_MAGIC   "TVBT"
+#define TWIZY_TRACE_VERSION 1
+
+
+// Log messages (TWIZY_DEBUG_LEVEL >= 1):
+// Columns: name, argument types, text (each '%' is replaced by the next argument)
+// Argument types (multi byte values little endian):
+//  B = byte, W = uint16, L = uint32, l = int32, X = uint16 printed in hex,
+//  S = TwizyState, P = TwizyTickPhase, F = frame (length byte + data),
+//  H = tick histogram (TWIZY_TICK_BUCKETS × uint16)
+// With TWIZY_LOG_BUFFER, messages are queued as binary records:
+//  TWIZY_LOG_SYNC, message, time (2 bytes, millis), arguments
+// Convert using extras/host/LogFormat. Append new messages at the end,
+// the record format depends on the message numbers.
+#define TWIZY_LOG_MESSAGES(L) \
+  L(CanWakeup,        "",     TWIZY_TAG "CAN WAKEUP") \
+  L(Pc3mwLow,         "",     TWIZY_TAG "PC: 3MW LOW") \
+  L(Pc155A,           "",     TWIZY_TAG "PC: 155_2 A") \
+  L(Pc3mwHigh,        "",     TWIZY_TAG "PC: 3MW HIGH") \
+  L(Pc1559,           "",     TWIZY_TAG "PC: 155_2 9") \
+  L(PcDone,           "",     TWIZY_TAG "PC: DONE") \
+  L(CanInactive,      "",     TWIZY_TAG "CAN INACTIVE → OFF") \
+  L(EnterState,       "S",    TWIZY_TAG "enterState: newState=%") \
+  L(Start3mw,         "",     TWIZY_TAG "3MW START") \
+  L(Sleep,            "",     TWIZY_TAG "sleep") \
+  L(WakeUp,           "",     TWIZY_TAG "wake up") \
+  L(LimitError,       "Wl",   TWIZY_TAG "ERROR line %: value % out of bounds") \
+  L(Dropped,          "W",    TWIZY_TAG "log: % records dropped") \
+  L(Info,             "",     "\n" TWIZY_TAG "debugInfo:") \
+  L(InfoState,        "S",    "- twizyState=%") \
+  L(InfoClock,        "W",    "- clockCnt=%") \
+  L(InfoTxQueue,      "B",    "- txQueueMax=%") \
+  L(InfoTxDrops,      "W",    "- txDrops=%") \
+  L(InfoRxOverflows,  "W",    "- rxOverflows=%") \
+  L(InfoSoc,          "WL",   "- socCP=% restTicks=%") \
+  L(InfoTrace,        "B",    "- trace=%") \
+  L(InfoTraceFrozen,  "B",    "- trace=% frozen") \
+  L(InfoTicks,        "LWW",  "- ticks=% missed=% overruns=%") \
+  L(InfoPhase,        "PLH",  "% max=%us hist=%") \
+  L(InfoFrame,        "XF",   "- id%:%") \
+  L(InfoEventDrops,   "W",    "- eventDrops=%")
+
+#define TWIZY_LOG_ENUM(name, args, text) TwizyLog##name,
+enum TwizyLogMessage {
+  TWIZY_LOG_MESSAGES(TWIZY_LOG_ENUM)
+  TwizyLogMessages
+};
+#undef TWIZY_LOG_ENUM
+
+#define TWIZY_LOG_TEXT(name, args, text) const char twizyLogText##name[] PROGMEM = text;
+TWIZY_LOG_MESSAGES(TWIZY_LOG_TEXT)
+#undef TWIZY_LOG_TEXT
+
+#define TWIZY_LOG_TEXT(name, args, text) twizyLogText##name,
+const char * const twizyLogText[TwizyLogMessages] PROGMEM = {
+  TWIZY_LOG_MESSAGES(TWIZY_LOG_TEXT)
+};
+#undef TWIZY_LOG_TEXT
+
+#define TWIZY_LOG_ARGS(name, args, text) args,
+const char twizyLogArgs[TwizyLogMessages][4] PROGMEM = {
+  TWIZY_LOG_MESSAGES(TWIZY_LOG_ARGS)
+};
+#undef TWIZY_LOG_ARGS
+
+#define TWIZY_LOG_SYNC      0x1E    // ASCII RS, not used in text output
+#define TWIZY_LOG_ARGS_MAX  (1 + 4 + 2 * TWIZY_TICK_BUCKETS)
+
+
 // User callbacks hooks:
 typedef void (*TwizyEnterStateCallback)(TwizyState currentState, TwizyState newState);
 typedef bool (*TwizyCheckStateCallback)(TwizyState currentState, TwizyState newState);
@@ -183,7 +531,22 @@ typedef void (*TwizyProcessCanMsgCallback)(unsigned long rxId, byte rxLen, byte
 #define FLASHSTRING     const __FlashStringHelper
 #define FS(x)           (__FlashStringHelper*)(x)
 
-#if TWIZY_DEBUG_LEVEL >= 1
+#if TWIZY_DEBUG_LEVEL >= 1 && TWIZY_LOG_BUFFER > 0
+  // Parameter boundary check with error log record (source line & value),
+  // CHECKLIMIT_BMS: for code outside the class, logging to <bms>:
+  #define CHECKLIMIT_BMS(bms, var, minval, maxval) \
+    if (var < minval || var > maxval) { \
+      bms logMsg(TwizyLogLimitError, (uint16_t) __LINE__, (int32_t) var); \
+      return false; \
+    }
+  #define CHECKLIMIT(var, minval, maxval) CHECKLIMIT_BMS(, var, minval, maxval)
+  // Upper bound only (unsigned parameters):
+  #define CHECKMAX(var, maxval) \
+    if (var > maxval) { \
+      logMsg(TwizyLogLimitError, (uint16_t) __LINE__, (int32_t) var); \
+      return false; \
+    }
+#elif TWIZY_DEBUG_LEVEL >= 1
   // Parameter boundary check with error output:
   #define CHECKLIMIT(var, minval, maxval) \
     if (var < minval || var > maxval) { \
@@ -194,31 +557,346 @@ typedef void (*TwizyProcessCanMsgCallback)(unsigned long rxId, byte rxLen, byte
       Serial.println(F(" out of bounds [" #minval "," #maxval "]")); \
       return false; \
     }
+  #define CHECKLIMIT_BMS(bms, var, minval, maxval) CHECKLIMIT(var, minval, maxval)
+  // Upper bound only (unsigned parameters):
+  #define CHECKMAX(var, maxval) \
+    if (var > maxval) { \
+      Serial.print(TWIZY_TAG); \
+      Serial.print(__func__); \
+      Serial.print(F(": ERROR " #var "=")); \
+      Serial.print(var); \
+      Serial.println(F(" out of bounds [0," #maxval "]")); \
+      return false; \
+    }
 #else
   // Parameter boundary check with quiet error:
   #define CHECKLIMIT(var, minval, maxval) \
     if (var < minval || var > maxval) { \
       return false; \
     }
+  #define CHECKLIMIT_BMS(bms, var, minval, maxval) CHECKLIMIT(var, minval, maxval)
+  // Upper bound only (unsigned parameters):
+  #define CHECKMAX(var, maxval) \
+    if (var > maxval) { \
+      return false; \
+    }
 #endif
 
 
 // -----------------------------------------------------
-// Interrupt handlers
+// Frame registry
+// 
+// One line per frame sent by the VirtualBMS. The frame buffers, the send
+// schedule, the init phase and the debug dump are generated from this
+// table, frames removed by the configuration are not compiled in.
+// 
+// Columns:
+//  - CAN ID, frame buffer (class member), length
+//  - period & phase in 10 ms clock ticks: the phases spread the frames
+//    evenly across the 10 ms slots, so every tick sends 0x155 plus at
+//    most one other frame (supported periods: 1, 10, 100, 300)
+//  - also send in state Error (0/1)
+//  - send condition: expression evaluated in the ticker, 1 = always
+//  - send init frame in state Init (0/1, TWIZY_SEND_INIT_FRAMES), init
+//    frame payload (flash memory)
+//  - initial frame payload
 // 
 
-volatile bool twizyCanMsgReceived = false;
+#if TWIZY_INFO_FRAME > 0
+  // 0x700: sent only if the BMS type has been set
+  #define TWIZY_FRAME_700(F) \
+  F(0x700, id700, 8, 100,  9, 1, ((id700[1] & 0xE0) != 0xE0), 0, (), \
+    (0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF))
+#else
+  #define TWIZY_FRAME_700(F)
+#endif
 
-#ifdef TWIZY_CAN_IRQ_PIN
-void twizyCanISR() {
-  twizyCanMsgReceived = true;
+#define TWIZY_FRAMES(F) \
+  F(0x155, id155, 8,   1,  0, 0, 1, 1, (0xFF, 0x97, 0xD0, 0x94, 0x00, 0x08, 0x00, 0x6F), \
+                                       (0x07, 0x97, 0xCA, 0x54, 0x52, 0x30, 0x00, 0x6F)) \
+  F(0x424, id424, 8,  10,  1, 0, 1, 1, (0x00, 0xFF, 0xFF, 0xFF, 0x7F, 0x7F, 0x00, 0x7F), \
+                                       (0x11, 0x40, 0x10, 0x20, 0x39, 0x63, 0x00, 0x3A)) \
+  F(0x425, id425, 8,  10,  2, 0, 1, 1, (0x1D, 0xFF, 0x4C, 0xFF, 0xFF, 0xFE, 0x01, 0xFF), \
+                                       (0x2A, 0x1F, 0x44, 0xFF, 0xFE, 0x42, 0x01, 0x20)) \
+  F(0x554, id554, 8, 100,  5, 0, 1, 1, (0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00), \
+                                       (0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x00)) \
+  F(0x556, id556, 8,  10,  3, 0, 1, 1, (0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFA), \
+                                       (0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x30, 0x9A)) \
+  F(0x557, id557, 8, 100,  6, 0, 1, 1, (0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0), \
+                                       (0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x30, 0x90)) \
+  F(0x55E, id55E, 8, 100,  7, 0, 1, 1, (0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00), \
+                                       (0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x0C, 0xF9)) \
+  F(0x55F, id55F, 8, 100,  8, 0, 1, 1, (0xFF, 0xFF, 0x73, 0x00, 0x00, 0xFF, 0xFF, 0xFF), \
+                                       (0xFF, 0xFF, 0x73, 0x00, 0x00, 0x21, 0xF2, 0x1F)) \
+  F(0x628, id628, 3,  10,  4, 0, 1, 1, (0x00, 0x00, 0x00), \
+                                       (0x00, 0x00, 0x00)) \
+  F(0x659, id659, 4, 300, 10, 0, 1, 1, (0xFF, 0xFF, 0xFF, 0xFF), \
+                                       (0xFF, 0xFF, 0xFF, 0xFF)) \
+  TWIZY_FRAME_700(F)
+
+// Registry helpers:
+#define TWIZY_UNPAREN(...)    __VA_ARGS__
+#define TWIZY_IF_0(...)
+#define TWIZY_IF_1(...)       __VA_ARGS__
+
+constexpr bool twizyTxSlotValid(unsigned int period, unsigned int phase) {
+  return (period == 1 || period == 10 || period == 100 || period == 300) && (phase < period);
 }
+
+#define TWIZY_FRAME_CHECK(id, buf, len, period, phase, error, cond, init, initData, data) \
+  static_assert(twizyTxSlotValid(period, phase), "Frame registry: invalid period/phase for " #id); \
+  static_assert(len >= 1 && len <= 8, "Frame registry: invalid length for " #id);
+TWIZY_FRAMES(TWIZY_FRAME_CHECK)
+#undef TWIZY_FRAME_CHECK
+
+// Init frames, sent by sendMsg_P():
+struct TwizyInitFrame {
+  uint16_t id;
+  uint8_t len;
+  uint8_t data[8];
+};
+
+#define TWIZY_FRAME_INIT(id, buf, len, period, phase, error, cond, init, initData, data) \
+  TWIZY_IF_##init({ id, len, { TWIZY_UNPAREN initData } },)
+const TwizyInitFrame twizyInitFrames[] PROGMEM = {
+  TWIZY_FRAMES(TWIZY_FRAME_INIT)
+};
+#undef TWIZY_FRAME_INIT
+
+
+// -----------------------------------------------------
+// Signal table
+// 
+// The Twizy object dictionary (see extras/Protocol.ods) of the frames
+// sent & read by the VirtualBMS. One line per signal, DBC style:
+//  - name (type TwizySig<name>), CAN ID, frame buffer
+//  - start bit & length: bits are numbered MSB first, bit 0 = MSB of
+//    byte 0, bit 63 = LSB of byte 7 (Twizy frames are big endian)
+//  - bias: raw = value + bias, the value is the integer unit used by
+//    the library (i.e. 1/4 A for the current)
+//  - scale & unit: physical value = value * scale, for decoders only
+// 
+
+#if TWIZY_INFO_FRAME > 0
+  #define TWIZY_SIGNALS_700(S) \
+  S(InfoState1,       0x700, id700,  0,  8,    0, 1,      "") \
+  S(InfoBmsType,      0x700, id700,  8,  3,    0, 1,      "") \
+  S(InfoError,        0x700, id700, 11,  5,    0, 1,      "") \
+  S(Cell15,           0x700, id700, 16, 12,    0, 0.005,  "V") \
+  S(Cell16,           0x700, id700, 28, 12,    0, 0.005,  "V") \
+  S(InfoBalancing,    0x700, id700, 40, 16,    0, 1,      "") \
+  S(InfoState2,       0x700, id700, 56,  8,    0, 1,      "")
+#else
+  #define TWIZY_SIGNALS_700(S)
 #endif
 
-volatile bool twizyClockTick = false;
+#define TWIZY_SIGNALS(S) \
+  S(ChargeLevel155,   0x155, id155,  0,  8,    0, 5,      "A") \
+  S(Handshake155,     0x155, id155,  8,  4,    0, 1,      "") \
+  S(Current155,       0x155, id155, 12, 12, 2000, 0.25,   "A") \
+  S(State155,         0x155, id155, 24,  8,    0, 1,      "") \
+  S(SOC155,           0x155, id155, 32, 16,    0, 0.0025, "%") \
+  S(State424,         0x424, id424,  0,  8,    0, 1,      "") \
+  S(RecupLimit424,    0x424, id424, 16,  8,    0, 500,    "W") \
+  S(DriveLimit424,    0x424, id424, 24,  8,    0, 500,    "W") \
+  S(TempMin424,       0x424, id424, 32,  8,   40, 1,      "degC") \
+  S(SOH424,           0x424, id424, 40,  8,    0, 1,      "%") \
+  S(TempMax424,       0x424, id424, 56,  8,   40, 1,      "degC") \
+  S(State425,         0x425, id425,  0,  8,    0, 1,      "") \
+  S(VoltLevel425b,    0x425, id425, 38,  9,    0, 1,      "") \
+  S(VoltLevel425,     0x425, id425, 48, 16,    0, 1,      "") \
+  S(ModuleTemp1,      0x554, id554,  0,  8,   40, 1,      "degC") \
+  S(ModuleTemp2,      0x554, id554,  8,  8,   40, 1,      "degC") \
+  S(ModuleTemp3,      0x554, id554, 16,  8,   40, 1,      "degC") \
+  S(ModuleTemp4,      0x554, id554, 24,  8,   40, 1,      "degC") \
+  S(ModuleTemp5,      0x554, id554, 32,  8,   40, 1,      "degC") \
+  S(ModuleTemp6,      0x554, id554, 40,  8,   40, 1,      "degC") \
+  S(ModuleTemp7,      0x554, id554, 48,  8,   40, 1,      "degC") \
+  S(ModuleTemp8,      0x554, id554, 56,  8,   40, 1,      "degC") \
+  S(Cell1,            0x556, id556,  0, 12,    0, 0.005,  "V") \
+  S(Cell2,            0x556, id556, 12, 12,    0, 0.005,  "V") \
+  S(Cell3,            0x556, id556, 24, 12,    0, 0.005,  "V") \
+  S(Cell4,            0x556, id556, 36, 12,    0, 0.005,  "V") \
+  S(Cell5,            0x556, id556, 48, 12,    0, 0.005,  "V") \
+  S(Cell6,            0x557, id557,  0, 12,    0, 0.005,  "V") \
+  S(Cell7,            0x557, id557, 12, 12,    0, 0.005,  "V") \
+  S(Cell8,            0x557, id557, 24, 12,    0, 0.005,  "V") \
+  S(Cell9,            0x557, id557, 36, 12,    0, 0.005,  "V") \
+  S(Cell10,           0x557, id557, 48, 12,    0, 0.005,  "V") \
+  S(Cell11,           0x55E, id55E,  0, 12,    0, 0.005,  "V") \
+  S(Cell12,           0x55E, id55E, 12, 12,    0, 0.005,  "V") \
+  S(Cell13,           0x55E, id55E, 24, 12,    0, 0.005,  "V") \
+  S(Cell14,           0x55E, id55E, 36, 12,    0, 0.005,  "V") \
+  S(Odometer55E,      0x55E, id55E, 48, 16,    0, 0.1,    "km") \
+  S(Voltage55F,       0x55F, id55F, 40, 12,    0, 0.1,    "V") \
+  S(Voltage55Fb,      0x55F, id55F, 52, 12,    0, 0.1,    "V") \
+  S(Error628,         0x628, id628,  0, 24,    0, 1,      "") \
+  TWIZY_SIGNALS_700(S) \
+  S(State423,         0x423, id423,  0,  8,    0, 1,      "") \
+  S(Plugged597,       0x597, id597,  2,  1,    0, 1,      "") \
+  S(KeySwitch597,     0x597, id597, 11,  1,    0, 1,      "") \
+  S(DCCurrent597,     0x597, id597, 16,  8,    0, 0.2,    "A") \
+  S(ChargerMode597,   0x597, id597, 24,  4,    0, 1,      "") \
+  S(ChargerTemp597,   0x597, id597, 56,  8,   40, 1,      "degC") \
+  S(Odometer599,      0x599, id599,  0, 32,    0, 0.01,   "km")
+
+
+// -----------------------------------------------------
+// Signal codec
+// 
+// TwizySignal<POS, LEN, BIAS> packs & unpacks a signal with all shifts
+// and masks resolved at compile time: bytes covered completely by the
+// signal are written directly, partially covered bytes are merged.
+// twizyPut<S1, S2, …>(frame, v1, v2, …) packs several signals of a frame
+// in one pass, bytes shared by them are then written without merging.
+// 
+
+template <int SIZE> struct TwizyUInt;
+template <> struct TwizyUInt<1> { typedef uint8_t type; };
+template <> struct TwizyUInt<2> { typedef uint16_t type; };
+template <> struct TwizyUInt<4> { typedef uint32_t type; };
+template <int SIZE> struct TwizyInt;
+template <> struct TwizyInt<2> { typedef int16_t type; };
+template <> struct TwizyInt<4> { typedef int32_t type; };
+
+// Value type: raw type if unbiased, else signed
+template <uint8_t LEN, bool BIASED> struct TwizySignalValue {
+  typedef typename TwizyUInt<(LEN > 16) ? 4 : (LEN > 8) ? 2 : 1>::type type;
+};
+template <uint8_t LEN> struct TwizySignalValue<LEN, true> {
+  typedef typename TwizyInt<(LEN > 15) ? 4 : 2>::type type;
+};
+
+// Constant shift: right if SHIFT >= 0, else left
+template <int SHIFT, bool RIGHT = (SHIFT >= 0)> struct TwizyShift {
+  template <typename T> static uint8_t toByte(T raw) { return raw >> SHIFT; }
+  template <typename T> static T fromByte(uint8_t bits) { return (T) bits << SHIFT; }
+};
+template <int SHIFT> struct TwizyShift<SHIFT, false> {
+  template <typename T> static uint8_t toByte(T raw) { return raw << -SHIFT; }
+  template <typename T> static T fromByte(uint8_t bits) { return bits >> -SHIFT; }
+};
+
+template <uint8_t POS, uint8_t LEN, long BIAS = 0>
+struct TwizySignal {
+  
+  static_assert(LEN >= 1 && LEN <= 32 && POS + LEN <= 64, "Signal exceeds 32 bits or 8 bytes");
+  
+  typedef typename TwizyUInt<(LEN > 16) ? 4 : (LEN > 8) ? 2 : 1>::type raw_t;
+  typedef typename TwizySignalValue<LEN, (BIAS != 0)>::type value_t;
+  
+  static constexpr long bias = BIAS;
+  static constexpr uint8_t first = POS / 8;
+  static constexpr uint8_t last = (POS + LEN - 1) / 8;
+  
+  // Right shift of the raw value giving byte i (negative = left shift):
+  static constexpr int shift(uint8_t i) {
+    return (i >= first && i <= last) ? (int) POS + LEN - 8 - 8 * i : 0;
+  }
+  
+  // Bits of byte i covered by the signal:
+  static constexpr uint8_t mask(uint8_t i) {
+    return (i < first || i > last) ? 0
+      : (uint8_t) ((0xFF >> (POS > 8 * i ? POS - 8 * i : 0))
+                 & (0xFF << (POS + LEN < 8 * i + 8 ? 8 * i + 8 - POS - LEN : 0)));
+  }
+  
+  // Bits of byte I from the raw value:
+  template <uint8_t I> static uint8_t toByte(raw_t raw) {
+    return TwizyShift<shift(I)>::toByte(raw) & mask(I);
+  }
+  
+  // Raw value bits from byte I:
+  template <uint8_t I> static raw_t fromByte(const uint8_t *frame) {
+    return TwizyShift<shift(I)>::template fromByte<raw_t>(frame[I] & mask(I));
+  }
+  
+  static void put(uint8_t *frame, value_t value);
+  static value_t get(const uint8_t *frame);
+};
+
+// Mask & bits of frame byte I over signals S…:
+template <uint8_t I, class... S> struct TwizySignalMask {
+  static constexpr uint8_t value = 0;
+};
+template <uint8_t I, class S, class... R> struct TwizySignalMask<I, S, R...> {
+  static constexpr uint8_t value = S::mask(I) | TwizySignalMask<I, R...>::value;
+};
 
-void twizyClockISR() {
-  twizyClockTick = true;
+template <uint8_t I> inline uint8_t twizySignalBits() {
+  return 0;
+}
+template <uint8_t I, class S, class... R>
+inline uint8_t twizySignalBits(typename S::raw_t raw, typename R::raw_t... rest) {
+  return S::template toByte<I>(raw) | twizySignalBits<I, R...>(rest...);
+}
+
+// Write frame bytes I … 7:
+template <uint8_t I, bool DONE, class... S> struct TwizySignalPut {
+  static void put(uint8_t *frame, typename S::raw_t... raw) {
+    constexpr uint8_t mask = TwizySignalMask<I, S...>::value;
+    if (mask == 0xFF) {
+      frame[I] = twizySignalBits<I, S...>(raw...);
+    }
+    else if (mask != 0) {
+      frame[I] = (frame[I] & ~mask) | twizySignalBits<I, S...>(raw...);
+    }
+    TwizySignalPut<I + 1, (I == 7), S...>::put(frame, raw...);
+  }
+};
+template <uint8_t I, class... S> struct TwizySignalPut<I, true, S...> {
+  static void put(uint8_t *frame, typename S::raw_t... raw) {}
+};
+
+// Read frame bytes I … LAST:
+template <class S, uint8_t I, bool DONE = (I > S::last)> struct TwizySignalGet {
+  static typename S::raw_t get(const uint8_t *frame) {
+    return S::template fromByte<I>(frame) | TwizySignalGet<S, I + 1>::get(frame);
+  }
+};
+template <class S, uint8_t I> struct TwizySignalGet<S, I, true> {
+  static typename S::raw_t get(const uint8_t *frame) {
+    return 0;
+  }
+};
+
+// Pack signals S… into a frame:
+template <class... S>
+inline void twizyPut(uint8_t *frame, typename S::value_t... value) {
+  TwizySignalPut<0, false, S...>::put(frame, (typename S::raw_t) (value + S::bias)...);
+}
+
+template <uint8_t POS, uint8_t LEN, long BIAS>
+inline void TwizySignal<POS, LEN, BIAS>::put(uint8_t *frame, value_t value) {
+  twizyPut<TwizySignal>(frame, value);
+}
+
+template <uint8_t POS, uint8_t LEN, long BIAS>
+inline typename TwizySignal<POS, LEN, BIAS>::value_t TwizySignal<POS, LEN, BIAS>::get(const uint8_t *frame) {
+  return (value_t) TwizySignalGet<TwizySignal, first>::get(frame) - BIAS;
+}
+
+#define TWIZY_SIGNAL_TYPE(name, id, buf, pos, len, bias, scale, unit) \
+  typedef TwizySignal<pos, len, bias> TwizySig##name;
+TWIZY_SIGNALS(TWIZY_SIGNAL_TYPE)
+#undef TWIZY_SIGNAL_TYPE
+
+
+// -----------------------------------------------------
+// Integer helpers
+// 
+// Unsigned division by constants using multiply & shift, avoiding the
+// AVR division library call. Exact in the documented argument ranges.
+// 
+
+inline unsigned int twizyDiv5(unsigned int x) {     // x: 0 .. 65535
+  return ((unsigned long) x * 52429UL) >> 18;
+}
+inline unsigned int twizyDiv70(unsigned long x) {   // x: 0 .. 69600
+  return (x * 59919UL) >> 22;
+}
+inline unsigned int twizyDiv100(unsigned long x) {  // x: 0 .. 69600
+  return ((x >> 2) * 5243UL) >> 17;
 }
 
 
@@ -235,7 +913,10 @@ public:
   // Public API
   // 
   
-  TwizyVirtualBMS();
+  // Pins default to the config; pass others to run multiple instances
+  // (Arduino: one MCP2515 each, see TWIZY_MAX_INSTANCES).
+  // irqPin is only used with TWIZY_CAN_IRQ_PIN, 0xFF = TWIZY_CAN_IRQ_PIN.
+  TwizyVirtualBMS(byte csPin = TWIZY_CAN_CS_PIN, byte ctlPin = TWIZY_3MW_CONTROL_PIN, byte irqPin = 0xFF);
   
   void begin();     // to be called in setup()
   void looper();    // to be called in loop()
@@ -251,10 +932,14 @@ public:
   bool setCurrent(float amps);
   bool setCurrentQA(long quarterAmps);
   bool setSOC(float soc);
+  bool setSOCCP(unsigned int centiPercent);
   bool setPowerLimits(unsigned int drive, unsigned int recup);
   bool setSOH(int soh);
   bool setCellVoltage(int cell, float volt);
+  bool setCellVoltageMV(int cell, unsigned int milliVolt);
+  bool setCellVoltages(const uint16_t *milliVolts, uint8_t count, TwizyCellStats *stats = NULL);
   bool setVoltage(float volt, bool deriveCells);
+  bool setVoltageMV(unsigned long milliVolt, bool deriveCells);
   bool setModuleTemperature(int module, int temp);
   bool setTemperature(int tempMin, int tempMax, bool deriveModules);
   bool setError(unsigned long error);
@@ -301,11 +986,124 @@ public:
   
   // CAN interface access:
   bool sendMsg(INT32U id, INT8U len, INT8U *buf);
-  void setCanFilter(byte filterNum, unsigned int canId);
+  bool sendMsg_P(INT32U id, INT8U len, const INT8U *buf);
+  bool onFrame(unsigned int canId, TwizyProcessCanMsgCallback fn);
+  bool setCanFilter(byte filterNum, unsigned int canId);
+  byte getTxQueueLength() {
+    return txQueueLen;
+  }
+  byte getTxQueueMax() {
+    return txQueueMax;
+  }
+  unsigned int getTxDrops() {
+    return txDrops;
+  }
+  unsigned long getRxTime() {
+    return rxTime;
+  }
+  unsigned int getRxOverflows() {
+    // 16 bit counter written by the CAN ISR: read atomically
+    noInterrupts();
+    unsigned int cnt = rxOverflows;
+    interrupts();
+    return cnt;
+  }
+  
+  // Interrupt entry points (registered by begin()):
+  static void clockISR(void *bms);
+  static void canISR(void *bms);
+  
+  #if TWIZY_CAN_TRACE > 0
+  // CAN trace access:
+  void traceStart() {
+    traceCount = 0;
+    traceFrozen = false;
+  }
+  void traceStop() {
+    traceFrozen = true;
+  }
+  bool isTraceFrozen() {
+    return traceFrozen;
+  }
+  byte getTraceCount() {
+    return traceCount;
+  }
+  void dumpTrace();
+  #endif
+  
+  #if TWIZY_SLEEP > 0
+  // Sleep mode:
+  bool isSleeping() {
+    return sleeping;
+  }
+  unsigned long getWakeLatency() {
+    return wakeLatency;
+  }
+  #endif
+  
+  #if TWIZY_ADC_CHANNELS > 0
+  // ADC acquisition:
+  bool adcBegin(const byte *pins, byte count);
+  unsigned int getAnalog(byte input) {
+    return adcRing[(adcHead - 1) & (TWIZY_ADC_RING - 1)][input];
+  }
+  unsigned int getAnalogMean(byte input);
+  unsigned int getAnalogScans() {
+    // 16 bit counter written by the ADC ISR: read atomically
+    noInterrupts();
+    unsigned int scans = adcScans;
+    interrupts();
+    return scans;
+  }
+  static void adcISR(void *bms);
+  #endif
+  
+  #if TWIZY_SOC_ESTIMATOR > 0
+  // SOC estimator:
+  bool setSOCCapacity(unsigned int ampHours);
+  bool setOCVTable(const TwizyOCVPoint *table, byte count);
+  unsigned int getSOCCP() {
+    return socLevel >> 2;
+  }
+  #endif
+  
+  #if TWIZY_TICK_STATS
+  // Tick timing access:
+  const TwizyTickStats &getTickStats() {
+    return tickStats;
+  }
+  void resetTickStats() {
+    memset(&tickStats, 0, sizeof(tickStats));
+  }
+  #endif
 
   // Debug utils:
   void dumpId(FLASHSTRING *name, int len, byte *buf);
   void debugInfo();
+  #if TWIZY_LOG_BUFFER > 0
+  void flushLog(bool wait = false);
+  #endif
+  #if TWIZY_DEBUG_LEVEL >= 1
+  // Log output (TWIZY_LOG_MESSAGES), arguments packed in table order & size:
+  void logRecord(TwizyLogMessage msg, const byte *args, byte len);
+  void logFrame(unsigned int id, byte len, const byte *buf);
+  byte *logPack(byte *p) {
+    return p;
+  }
+  template <typename T, typename... Args>
+  byte *logPack(byte *p, T value, Args... args) {
+    memcpy(p, &value, sizeof(T));
+    return logPack(p + sizeof(T), args...);
+  }
+  void logMsg(TwizyLogMessage msg) {
+    logRecord(msg, NULL, 0);
+  }
+  template <typename... Args>
+  void logMsg(TwizyLogMessage msg, Args... args) {
+    byte buf[TWIZY_LOG_ARGS_MAX];
+    logRecord(msg, buf, logPack(buf, args...) - buf);
+  }
+  #endif
   
 
 private:
@@ -314,57 +1112,186 @@ private:
   // Twizy CAN model
   // 
   
-  // BMS init frames:
-  byte id155_init[8] = { 0xFF, 0x97, 0xD0, 0x94, 0x00, 0x08, 0x00, 0x6F };
-  byte id424_init[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0x7F, 0x7F, 0x00, 0x7F };
-  byte id425_init[8] = { 0x1D, 0xFF, 0x4C, 0xFF, 0xFF, 0xFE, 0x01, 0xFF };
-  byte id554_init[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
-  byte id556_init[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFA };
-  byte id557_init[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 };
-  byte id55E_init[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00 };
-  byte id55F_init[8] = { 0xFF, 0xFF, 0x73, 0x00, 0x00, 0xFF, 0xFF, 0xFF };
-  byte id628_init[3] = { 0x00, 0x00, 0x00 };
-  byte id659_init[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
-  
-  // BMS (controlled by us):
-  byte id155[8] = { 0x07, 0x97, 0xCA, 0x54, 0x52, 0x30, 0x00, 0x6F };
-  byte id424[8] = { 0x11, 0x40, 0x10, 0x20, 0x39, 0x63, 0x00, 0x3A };
-  byte id425[8] = { 0x2A, 0x1F, 0x44, 0xFF, 0xFE, 0x42, 0x01, 0x20 };
-  byte id554[8] = { 0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x3A, 0x00 };
-  byte id556[8] = { 0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x30, 0x9A };
-  byte id557[8] = { 0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x30, 0x90 };
-  byte id55E[8] = { 0x30, 0x93, 0x09, 0x30, 0x93, 0x09, 0x0C, 0xF9 };
-  byte id55F[8] = { 0xFF, 0xFF, 0x73, 0x00, 0x00, 0x21, 0xF2, 0x1F };
-  byte id628[3] = { 0x00, 0x00, 0x00 };
-  byte id659[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
-  
-  // VirtualBMS extended frame (controlled by us):
-  byte id700[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-  
-  // CHARGER (read only):
-  byte id423[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  // BMS & VirtualBMS info frames (controlled by us):
+  #define TWIZY_FRAME_BUF(id, buf, len, period, phase, error, cond, init, initData, data) \
+    byte buf[len] = { TWIZY_UNPAREN data };
+  TWIZY_FRAMES(TWIZY_FRAME_BUF)
+  #undef TWIZY_FRAME_BUF
+  
+  // CHARGER (read only, only the bytes used are kept):
+  byte id423[1] = { 0x00 };
   byte id597[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
   
-  // DISPLAY (read only):
-  byte id599[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  // DISPLAY (read only, odometer):
+  byte id599[4] = { 0x00, 0x00, 0x00, 0x00 };
+  
+  #define TWIZY_SIGNAL_CHECK(name, id, buf, pos, len, bias, scale, unit) \
+    static_assert(pos + len <= 8 * sizeof(buf), "Signal " #name " exceeds frame buffer " #buf);
+  TWIZY_SIGNALS(TWIZY_SIGNAL_CHECK)
+  #undef TWIZY_SIGNAL_CHECK
+  
+  
+  // Native level packing:
+  void packSOC(unsigned int level);
+  void packCellVoltage(byte cell, unsigned int level);
+  void packCellVoltages(const unsigned int *level, byte count);
+  void packCells(byte *frame, const unsigned int *level, byte count);
+  void packVoltage(unsigned int level55F, unsigned int level425);
+  
+  #if TWIZY_SOC_ESTIMATOR > 0
+  // SOC estimator: coulomb counter in 1/4 A * ticks,
+  // OCV correction after TWIZY_SOC_REST_TICKS at rest
+  long socAcc = 0;                  // charge remainder below one level
+  long socUnit = 0;                 // charge per SOC level (1/400 %), 0 = off
+  unsigned int socLevel = 0;        // SOC level, 1/400 %
+  int socCurrentQA = 0;             // last setCurrentQA() value
+  int socStepLevels = 0;            // per tick: whole levels of socCurrentQA
+  int socStepAcc = 0;               // … and the remainder (same sign)
+  unsigned int socCellMV = 0;       // last pack voltage / 14, 0 = unknown
+  unsigned long socRestTicks = 0;
+  const TwizyOCVPoint *socOCV = twizyDefaultOCV;
+  byte socOCVCount = sizeof(twizyDefaultOCV) / sizeof(TwizyOCVPoint);
+  
+  void socTick();
+  void socUpdateStep();
+  unsigned int socLookupOCV(unsigned int cellMV);
+  #endif
   
   
   // -----------------------------------------------------
   // Twizy CAN interface
   // 
 
-  MCP_CAN twizyCAN;
-
-  unsigned int sendErrors = 0;
-  unsigned int sendRetries = 0;
+  TwizyCanDriver twizyCAN;
+  byte ctlPin;      // 3MW control pin
+  #ifdef TWIZY_CAN_IRQ_PIN
+  byte irqPin;      // CAN interrupt pin
+  #endif
+  
+  // TX queue: frames waiting for a free TX buffer,
+  // sorted by CAN ID = bus priority (FIFO for equal IDs)
+  struct TxMsg {
+    unsigned int id;
+    byte len;
+    byte buf[8];
+  };
+  TxMsg txQueue[TWIZY_CAN_TXQUEUE_SIZE];
+  byte txQueueLen = 0;
+  byte txQueueMax = 0;
+  unsigned int txDrops = 0;
+  
+  void flushTxQueue();
   
   // RX buffer:
   unsigned long rxId;
   byte rxLen;
   byte rxBuf[8];
+  unsigned long rxTime;
+  
+  #if TWIZY_CAN_RX_RING > 0
+  // RX ring: filled by the CAN interrupt, consumed by looper()
+  // (single producer / single consumer, free running indices)
+  struct RxMsg {
+    unsigned long time;
+    unsigned long id;
+    byte len;
+    byte buf[8];
+  };
+  RxMsg rxRing[TWIZY_CAN_RX_RING];
+  volatile byte rxHead = 0;   // written by ISR only
+  volatile byte rxTail = 0;   // written by looper only
+  
+  void fillRxRing();
+  #endif
+  
+  // Interrupt state:
+  volatile bool canMsgReceived = false;
+  volatile bool clockTick = false;
+  #if TWIZY_TICK_STATS
+  volatile unsigned long clockTickTime = 0;
+  volatile byte clockMissed = 0;
+  #endif
+  
+  volatile unsigned int rxOverflows = 0;
+  
+  // RX dispatch table: user handlers sorted by CAN ID
+  struct RxHandler {
+    unsigned int id;
+    TwizyProcessCanMsgCallback fn;
+  };
+  RxHandler rxHandlers[TWIZY_CAN_RX_HANDLERS];
+  byte rxHandlerCnt = 0;
+  bool canReady = false;
+  
+  // IDs set by setCanFilter() per filter slot, 0xFFFF = unused:
+  unsigned int canFilterIds[3] = { 0xFFFF, 0xFFFF, 0xFFFF };
+  
+  byte findHandler(unsigned int canId);
+  
+  void updateCanFilters();
+  
+  #if TWIZY_CAN_TRACE > 0
+  // CAN trace ring (oldest record at traceHead once full):
+  TwizyTraceRecord trace[TWIZY_CAN_TRACE];
+  byte traceHead = 0;
+  byte traceCount = 0;
+  bool traceFrozen = false;
+  
+  void traceFrame(unsigned long time, unsigned int id, byte len, const byte *buf, unsigned int flags) {
+    if (traceFrozen)
+      return;
+    TwizyTraceRecord &rec = trace[traceHead];
+    rec.time = time;
+    rec.idFlags = (id & 0x7FF) | flags;
+    rec.lenState = len | (twizyState << 4);
+    memcpy(rec.data, buf, len);
+    if (++traceHead == TWIZY_CAN_TRACE)
+      traceHead = 0;
+    if (traceCount < TWIZY_CAN_TRACE)
+      traceCount++;
+  }
+  #define TRACEFRAME(time, id, len, buf, flags) traceFrame(time, id, len, buf, flags)
+  #else
+  #define TRACEFRAME(time, id, len, buf, flags)
+  #endif
+  
+  #if TWIZY_LOG_BUFFER > 0
+  // Log ring, sent by flushLog() in looper() idle time:
+  byte logRing[TWIZY_LOG_BUFFER];
+  byte logHead = 0;
+  byte logTail = 0;
+  unsigned int logDrops = 0;
+  
+  void logPut(const byte *buf, byte len) {
+    while (len--) {
+      logRing[logHead] = *buf++;
+      logHead = (logHead + 1) & (TWIZY_LOG_BUFFER - 1);
+    }
+  }
+  #endif
+  
+  #if TWIZY_ADC_CHANNELS > 0
+  // ADC acquisition: results of complete scans over all inputs,
+  //  written by the ADC interrupt (slot adcHead), read by the ticker
+  //  (slot adcHead-1, not overwritten for TWIZY_ADC_RING-1 scans);
+  //  getAnalogMean() also reads slot adcHead, with interrupts disabled
+  byte adcPins[TWIZY_ADC_CHANNELS];
+  byte adcCount = 0;
+  byte adcMuxInput = 0;             // input selected for the next conversion
+  byte adcMuxCnt = 0;               // conversions started on adcMuxInput
+  byte adcConvInput = 0;            // input of the running conversion
+  byte adcSumInput = 0xFF;          // input accumulated, 0xFF = discard next sample
+  byte adcSumCnt = 0;
+  unsigned int adcSum = 0;
+  unsigned int adcRing[TWIZY_ADC_RING][TWIZY_ADC_CHANNELS];
+  volatile byte adcHead = 0;
+  volatile unsigned int adcScans = 0;
+  #endif
   
   // RX processing:
   void receiveCanMsgs();
+  void rxActivity();
+  void processCanMsg();
   void process423();
   void process597();
   void process599();
@@ -373,6 +1300,19 @@ private:
   byte rxTimeout = 0;
   #define CAN_RX_TIMEOUT 217 // x 10 = 2170 ms
   
+  #if TWIZY_SLEEP > 0
+  // Sleep mode: entered by looper() in state Off after CAN inactivity
+  bool sleepPending = false;
+  bool sleeping = false;
+  unsigned long wakeTime = 0;       // micros() at wake up, 0 = first 0x155 sent
+  unsigned long wakeLatency = 0;    // wake up → first 0x155 [us]
+  byte wakeTimeout = 0;             // ticks left for a frame after wake up
+  #define CAN_WAKE_TIMEOUT 50 // x 10 = 500 ms
+  
+  void sleep();
+  void wake();
+  #endif
+  
   
   // -----------------------------------------------------
   // Twizy state machine
@@ -383,6 +1323,25 @@ private:
   // 3MW pulse tick counter:
   byte counter3MW = 0;
   
+  // Event queue, filled by the frame handlers, processed by the ticker:
+  byte eventQueue[TWIZY_EVENT_QUEUE];
+  byte eventHead = 0;
+  byte eventTail = 0;
+  unsigned int eventDrops = 0;
+  
+  void postEvent(TwizyEvent event) {
+    byte count = eventHead - eventTail;
+    if (count && eventQueue[(byte)(eventHead - 1) & (TWIZY_EVENT_QUEUE - 1)] == event) {
+      return;   // same as last queued (repeated frame)
+    }
+    if (count >= TWIZY_EVENT_QUEUE) {
+      eventDrops++;
+      return;
+    }
+    eventQueue[eventHead++ & (TWIZY_EVENT_QUEUE - 1)] = event;
+  }
+  void handleEvent(TwizyEvent event);
+  
   
   // -----------------------------------------------------
   // Twizy ticker:
@@ -390,8 +1349,47 @@ private:
   
   unsigned int clockCnt = 0;
   
+  // TX schedule phase counters:
+  byte txTick10 = 0;          // 0 .. 9
+  byte txTick100 = 0;         // 0 .. 99
+  unsigned int txTick300 = 0; // 0 .. 299
+  
+  // Check if a TX schedule slot is due in this tick:
+  // (period & phase are constants, so this folds into a single compare)
+  bool txDue(unsigned int period, unsigned int phase) {
+    return (period == 1)
+      || (period == 10 && txTick10 == phase)
+      || (period == 100 && txTick100 == phase)
+      || (period == 300 && txTick300 == phase);
+  }
+  
   void ticker();
   
+  #if TWIZY_TICK_STATS
+  // Tick timing statistics:
+  TwizyTickStats tickStats = {};
+  unsigned long tickMarkTime;
+  byte tickMissedSeen = 0;
+  
+  void tickSample(byte phase, unsigned long us) {
+    if (us > tickStats.maxUs[phase])
+      tickStats.maxUs[phase] = us;
+    byte bucket = 0;
+    for (us >>= 7; us && bucket < TWIZY_TICK_BUCKETS-1; us >>= 1)
+      bucket++;
+    if (tickStats.hist[phase][bucket] != 0xFFFF)
+      tickStats.hist[phase][bucket]++;
+  }
+  void tickMark(byte phase) {
+    unsigned long now = micros();
+    tickSample(phase, now - tickMarkTime);
+    tickMarkTime = now;
+  }
+  #define TICKMARK(phase) tickMark(phase)
+  #else
+  #define TICKMARK(phase)
+  #endif
+  
   
   // -----------------------------------------------------
   // User callbacks hooks
@@ -410,8 +1408,11 @@ private:
 // API
 // 
 
-TwizyVirtualBMS::TwizyVirtualBMS()
-  : twizyCAN(TWIZY_CAN_CS_PIN) {
+TwizyVirtualBMS::TwizyVirtualBMS(byte csPin, byte ctlPin, byte irqPin)
+  : twizyCAN(csPin), ctlPin(ctlPin) {
+  #ifdef TWIZY_CAN_IRQ_PIN
+  this->irqPin = (irqPin == 0xFF) ? TWIZY_CAN_IRQ_PIN : irqPin;
+  #endif
 }
 
 void TwizyVirtualBMS::attachEnterState(TwizyEnterStateCallback fn) {
@@ -438,8 +1439,8 @@ void TwizyVirtualBMS::attachProcessCanMsg(TwizyProcessCanMsgCallback fn) {
 // Note: will enter state StopCharge if set to 0 during charge
 bool TwizyVirtualBMS::setChargeCurrent(int amps) {
   CHECKLIMIT(amps, 0, 35);
-  id155[0] = amps / 5;
-  if (twizyState == Charging && id155[0] == 0) {
+  TwizySigChargeLevel155::put(id155, amps / 5);
+  if (twizyState == Charging && TwizySigChargeLevel155::get(id155) == 0) {
     enterState(StopCharge);
   }
   return true;
@@ -449,19 +1450,19 @@ bool TwizyVirtualBMS::setChargeCurrent(int amps) {
 //  amps: -500 .. +500 (positive = charge, negative = discharge)
 bool TwizyVirtualBMS::setCurrent(float amps) {
   CHECKLIMIT(amps, -500.0, 500.0);
-  unsigned int level = 2000 + (amps * 4);
-  id155[1] = (id155[1] & 0xf0) | ((level & 0x0f00) >> 8);
-  id155[2] = level & 0x00ff;
-  return true;
+  // round towards the lower level like the offset level conversion:
+  return setCurrentQA((long)(2000 + amps * 4) - 2000);
 }
 
 // Set battery pack current level (native 1/4 A resolution)
 //  quarterAmps: -2000 .. +2000 (positive = charge, negative = discharge)
 bool TwizyVirtualBMS::setCurrentQA(long quarterAmps) {
   CHECKLIMIT(quarterAmps, -2000L, 2000L);
-  unsigned int level = 2000 + quarterAmps;
-  id155[1] = (id155[1] & 0xf0) | ((level & 0x0f00) >> 8);
-  id155[2] = level & 0x00ff;
+  TwizySigCurrent155::put(id155, quarterAmps);
+#if TWIZY_SOC_ESTIMATOR > 0
+  socCurrentQA = quarterAmps;
+  socUpdateStep();
+#endif
   return true;
 }
 
@@ -470,12 +1471,130 @@ bool TwizyVirtualBMS::setCurrentQA(long quarterAmps) {
 // Note: the charger will not start charging at SOC=100%
 bool TwizyVirtualBMS::setSOC(float soc) {
   CHECKLIMIT(soc, 0.0, 100.0);
-  unsigned int level = soc * 400;
-  id155[4] = level >> 8;
-  id155[5] = level & 0x00ff;
+  packSOC(soc * 400);
+#if TWIZY_SOC_ESTIMATOR > 0
+  socLevel = soc * 400;
+  socAcc = 0;
+#endif
+  return true;
+}
+
+// Set battery pack SOC (integer API)
+//  centiPercent: 0 .. 10000 (= 0.00 .. 100.00 %)
+bool TwizyVirtualBMS::setSOCCP(unsigned int centiPercent) {
+  CHECKMAX(centiPercent, 10000);
+  packSOC(centiPercent << 2);
+#if TWIZY_SOC_ESTIMATOR > 0
+  socLevel = centiPercent << 2;
+  socAcc = 0;
+#endif
   return true;
 }
 
+// SOC level: 1/400 %
+void TwizyVirtualBMS::packSOC(unsigned int level) {
+  TwizySigSOC155::put(id155, level);
+}
+
+#if TWIZY_SOC_ESTIMATOR > 0
+
+// Set usable battery capacity & enable the SOC estimator
+//  ampHours: 1 .. 1000 [Ah], 0 = estimator off
+// Note: set the start SOC by setSOC() / setSOCCP(), these also
+//  serve to correct the estimation from a better source at any time
+bool TwizyVirtualBMS::setSOCCapacity(unsigned int ampHours) {
+  CHECKLIMIT(ampHours, 0, 1000);
+  // capacity in 1/4 A * ticks / 40000 levels:
+  socUnit = (long) ampHours * 360000L / TWIZY_CAN_CLOCK_US;
+  socAcc = 0;
+  socUpdateStep();
+  socRestTicks = 0;
+  return true;
+}
+
+// Set open circuit voltage table (PROGMEM)
+//  table: count points, cellMV ascending
+//  count: 2 .. 255
+bool TwizyVirtualBMS::setOCVTable(const TwizyOCVPoint *table, byte count) {
+  CHECKLIMIT(count, 2, 255);
+  socOCV = table;
+  socOCVCount = count;
+  return true;
+}
+
+// OCV table lookup with linear interpolation, result in 1/100 %:
+unsigned int TwizyVirtualBMS::socLookupOCV(unsigned int cellMV) {
+  unsigned int mv0 = pgm_read_word(&socOCV[0].cellMV);
+  unsigned int soc0 = pgm_read_word(&socOCV[0].socCP);
+  if (cellMV <= mv0)
+    return soc0;
+  for (byte i = 1; i < socOCVCount; i++) {
+    unsigned int mv1 = pgm_read_word(&socOCV[i].cellMV);
+    unsigned int soc1 = pgm_read_word(&socOCV[i].socCP);
+    if (cellMV < mv1) {
+      return soc0 + (long)(cellMV - mv0) * (long)(soc1 - soc0) / (long)(mv1 - mv0);
+    }
+    mv0 = mv1;
+    soc0 = soc1;
+  }
+  return soc0;
+}
+
+// Split the current into whole SOC levels & remainder per tick, so the
+// tick needs no division and no loop (called when current or unit change):
+void TwizyVirtualBMS::socUpdateStep() {
+  if (socUnit == 0)
+    return;
+  unsigned int qa = (socCurrentQA < 0) ? -socCurrentQA : socCurrentQA;
+  int levels = qa / (unsigned long) socUnit;
+  int rest = qa % (unsigned long) socUnit;
+  socStepLevels = (socCurrentQA < 0) ? -levels : levels;
+  socStepAcc = (socCurrentQA < 0) ? -rest : rest;
+}
+
+// SOC estimator tick: integrate current, correct by OCV at rest
+void TwizyVirtualBMS::socTick() {
+  
+  if (socUnit == 0)
+    return;
+  
+  // Coulomb counting: add the precomputed step, the remainder carries
+  // over at most one level as |socAcc| and |socStepAcc| are < socUnit
+  int step = socStepLevels;
+  socAcc += socStepAcc;
+  if (socAcc >= socUnit) {
+    socAcc -= socUnit;
+    step++;
+  }
+  else if (socAcc <= -socUnit) {
+    socAcc += socUnit;
+    step--;
+  }
+  if (step) {
+    long level = (long) socLevel + step;
+    socLevel = (level < 0) ? 0 : (level > 40000) ? 40000 : level;
+    packSOC(socLevel);
+  }
+  
+  // OCV correction: after resting long enough for the cell voltages to
+  // settle, move the estimation halfway towards the OCV SOC:
+  if (socCurrentQA <= TWIZY_SOC_REST_QA && socCurrentQA >= -TWIZY_SOC_REST_QA) {
+    if (++socRestTicks >= TWIZY_SOC_REST_TICKS) {
+      socRestTicks = 0;
+      if (socCellMV) {
+        socLevel = ((unsigned long) socLevel + ((unsigned long) socLookupOCV(socCellMV) << 2)) >> 1;
+        socAcc = 0;
+        packSOC(socLevel);
+      }
+    }
+  }
+  else {
+    socRestTicks = 0;
+  }
+}
+
+#endif
+
 // Set SEVCON power limits
 //  drive: 0 .. 30000 [W]
 //  recup: 0 .. 30000 [W]
@@ -483,8 +1602,7 @@ bool TwizyVirtualBMS::setSOC(float soc) {
 bool TwizyVirtualBMS::setPowerLimits(unsigned int drive, unsigned int recup) {
   CHECKLIMIT(drive, 0, 30000);
   CHECKLIMIT(recup, 0, 30000);
-  id424[2] = recup / 500;
-  id424[3] = drive / 500;
+  twizyPut<TwizySigRecupLimit424, TwizySigDriveLimit424>(id424, recup / 500, drive / 500);
   return true;
 }
 
@@ -492,7 +1610,7 @@ bool TwizyVirtualBMS::setPowerLimits(unsigned int drive, unsigned int recup) {
 //  soh: 0 .. 100
 bool TwizyVirtualBMS::setSOH(int soh) {
   CHECKLIMIT(soh, 0, 100);
-  id424[5] = soh;
+  TwizySigSOH424::put(id424, soh);
   return true;
 }
 
@@ -502,6 +1620,22 @@ bool TwizyVirtualBMS::setSOH(int soh) {
 bool TwizyVirtualBMS::setCellVoltage(int cell, float volt) {
   CHECKLIMIT(cell, 1, 16);
   CHECKLIMIT(volt, 0.0, 5.0);
+  // same levels as the integer API:
+  return setCellVoltageMV(cell, volt * 1000 + 0.5);
+}
+
+// Set battery cell voltage level (integer API)
+//  cell: 1 .. 16
+//  milliVolt: 0 .. 5000
+bool TwizyVirtualBMS::setCellVoltageMV(int cell, unsigned int milliVolt) {
+  CHECKLIMIT(cell, 1, 16);
+  CHECKMAX(milliVolt, 5000);
+  packCellVoltage(cell, twizyDiv5(milliVolt));
+  return true;
+}
+
+// Cell voltage level: 1/200 V, 12 bit
+void TwizyVirtualBMS::packCellVoltage(byte cell, unsigned int level) {
   
   // cell voltages are packed 12 bit values
   // determine frame and position:
@@ -521,67 +1655,152 @@ bool TwizyVirtualBMS::setCellVoltage(int cell, float volt) {
     cell -= 11;
   }
   else {
+    #if TWIZY_INFO_FRAME > 0
     frame = id700+2; // [2]-[4] = cells 15+16
     cell -= 15;
+    #else
+    return; // cells 15+16 are only sent in the info frame
+    #endif
   }
   
-  int pos = cell * 1.5;
-  unsigned int level = volt * 200;
+  // cell pairs have the layout of cells 1 & 2 (3 bytes):
+  frame += (cell >> 1) * 3;
   
   if (cell & 1) {
     // odd cell number: pack right
-    frame[pos]   = (frame[pos] & 0xf0) | (level >> 8);
-    frame[pos+1] = level & 0x00ff;
+    TwizySigCell2::put(frame, level);
   }
   else {
     // even cell number: pack left
-    frame[pos]   = level >> 4;
-    frame[pos+1] = (frame[pos+1] & 0x0f) | ((level << 4) & 0xf0);
+    TwizySigCell1::put(frame, level);
+  }
+}
+
+// Set battery cell voltage levels 1 … count in one pass (integer API)
+//  milliVolts: array of cell voltages, 0 .. 5000 [mV] each
+//  count: 1 .. 16
+//  stats: optional, receives min/max/delta of the cells
+// Note: nothing is changed if any voltage is out of bounds
+bool TwizyVirtualBMS::setCellVoltages(const uint16_t *milliVolts, uint8_t count, TwizyCellStats *stats) {
+  CHECKLIMIT(count, 1, 16);
+  
+  unsigned int level[16];
+  uint16_t minMV = 0xFFFF, maxMV = 0;
+  uint8_t minCell = 0, maxCell = 0;
+  #if TWIZY_SOC_ESTIMATOR > 0
+  unsigned long sumMV = 0;
+  #endif
+  
+  // check & convert, collect statistics:
+  for (byte i=0; i<count; i++) {
+    uint16_t milliVolt = milliVolts[i];
+    CHECKLIMIT(milliVolt, 0, 5000);
+    if (milliVolt < minMV) {
+      minMV = milliVolt;
+      minCell = i;
+    }
+    if (milliVolt > maxMV) {
+      maxMV = milliVolt;
+      maxCell = i;
+    }
+    level[i] = twizyDiv5(milliVolt);
+    #if TWIZY_SOC_ESTIMATOR > 0
+    sumMV += milliVolt;
+    #endif
+  }
+  
+  packCellVoltages(level, count);
+  #if TWIZY_SOC_ESTIMATOR > 0
+  // OCV correction: mean cell voltage
+  socCellMV = sumMV / count;
+  #endif
+  
+  if (stats) {
+    stats->minMV = minMV;
+    stats->maxMV = maxMV;
+    stats->deltaMV = maxMV - minMV;
+    stats->minCell = minCell + 1;
+    stats->maxCell = maxCell + 1;
   }
   
   return true;
 }
 
+// Pack cell voltage levels 1 … count into their frames:
+void TwizyVirtualBMS::packCellVoltages(const unsigned int *level, byte count) {
+  packCells(id556, level, (count < 5) ? count : 5);
+  if (count > 5)
+    packCells(id557, level + 5, (count < 10) ? count - 5 : 5);
+  if (count > 10)
+    packCells(id55E, level + 10, (count < 14) ? count - 10 : 4);
+  #if TWIZY_INFO_FRAME > 0
+  if (count > 14)
+    packCells(id700 + 2, level + 14, count - 14); // [2]-[4] = cells 15+16
+  #endif
+}
+
+// Pack up to 5 cell voltage levels into a frame:
+// two cells = 3 bytes, a single last cell is packed left
+void TwizyVirtualBMS::packCells(byte *frame, const unsigned int *level, byte count) {
+  for (; count >= 2; count -= 2, level += 2, frame += 3) {
+    twizyPut<TwizySigCell1, TwizySigCell2>(frame, level[0], level[1]);
+  }
+  if (count) {
+    TwizySigCell1::put(frame, level[0]);
+  }
+}
+
 // Set battery pack voltage level
 //  volt: 19.3 … 69.6 (SEVCON G48 series voltage range)
 //  deriveCells: true = set all cell voltages to volt/14
 bool TwizyVirtualBMS::setVoltage(float volt, bool deriveCells) {
   CHECKLIMIT(volt, 19.3, 69.6);
-  
-  unsigned long level;
-  
-  // frame 55F: volt * 10, packed 2x:
-  level = volt * 10;
-  level |= level << 12;
-  id55F[5] = (level & 0x00ff0000) >> 16;
-  id55F[6] = (level & 0x0000ff00) >> 8;
-  id55F[7] = (level & 0x000000ff);
+  // same frames as the integer API:
+  return setVoltageMV(volt * 1000 + 0.5, deriveCells);
+}
+
+// Set battery pack voltage level (integer API)
+//  milliVolt: 19300 … 69600 (SEVCON G48 series voltage range)
+//  deriveCells: true = set all cell voltages to milliVolt/14
+bool TwizyVirtualBMS::setVoltageMV(unsigned long milliVolt, bool deriveCells) {
+  CHECKLIMIT(milliVolt, 19300, 69600);
   
   // frame 425: voltage scaling not 100% known yet, do approximation:
-  level = (volt - 13.051) * 6.981;
-  id425[6] = level >> 8;
-  id425[7] = level & 0x00ff;
-  level = 0xfc00 | (level << 1);
-  id425[4] = level >> 8;
-  id425[5] = level & 0x00ff;
+  //  (V - 13.051) * 6.981 ≈ (mV - 13051) * 7320 / 2^20
+  packVoltage(twizyDiv100(milliVolt), ((milliVolt - 13051) * 7320UL) >> 20);
+#if TWIZY_SOC_ESTIMATOR > 0
+  socCellMV = twizyDiv70(milliVolt) * 5;
+#endif
   
   if (deriveCells) {
-    float cellVolt = volt / 14.0;
-    for (int i=1; i<=14; i++) {
-      setCellVoltage(i, cellVolt);
+    unsigned int level[14];
+    level[0] = twizyDiv70(milliVolt); // = mV / 14 / 5
+    for (byte i=1; i<14; i++) {
+      level[i] = level[0];
     }
+    packCellVoltages(level, 14);
   }
   
   return true;
 }
 
+// Pack voltage levels: 55F = 1/10 V, 425 = approximation
+void TwizyVirtualBMS::packVoltage(unsigned int level55F, unsigned int level425) {
+  
+  // frame 55F: volt * 10, packed 2x:
+  twizyPut<TwizySigVoltage55F, TwizySigVoltage55Fb>(id55F, level55F, level55F);
+  
+  // frame 425:
+  twizyPut<TwizySigVoltLevel425b, TwizySigVoltLevel425>(id425, level425, level425);
+}
+
 // Set battery module temperature
 //  module: 1 .. 8
 //  temp: -40 .. 100 [°C]
 bool TwizyVirtualBMS::setModuleTemperature(int module, int temp) {
   CHECKLIMIT(module, 1, 8);
   CHECKLIMIT(temp, -40, 100);
-  id554[module-1] = 40 + temp;
+  TwizySigModuleTemp1::put(id554 + module - 1, temp); // all modules: layout of #1
   return true;
 }
 
@@ -594,8 +1813,7 @@ bool TwizyVirtualBMS::setTemperature(int tempMin, int tempMax, bool deriveModule
   CHECKLIMIT(tempMax, -40, 100);
   
   // set min/max temperatures:
-  id424[4] = 40 + tempMin;
-  id424[7] = 40 + tempMax;
+  twizyPut<TwizySigTempMin424, TwizySigTempMax424>(id424, tempMin, tempMax);
   
   // derive module temperatures:
   if (deriveModules) {
@@ -613,12 +1831,12 @@ bool TwizyVirtualBMS::setTemperature(int tempMin, int tempMax, bool deriveModule
 // See error code definitions.
 bool TwizyVirtualBMS::setError(unsigned long error) {
   CHECKLIMIT(error, 0x000000, 0xFFFFFF);
-  id628[0] = (error & 0xFF0000) >> 16;
-  id628[1] = (error & 0x00FF00) >> 8;
-  id628[2] = (error & 0x0000FF);
+  TwizySigError628::put(id628, error);
   return true;
 }
 
+#if TWIZY_INFO_FRAME > 0
+
 // Set informational BMS type
 //  bmsType: 0 .. 7 (see TwizyBmsType)
 // 0 = VirtualBMS
@@ -627,21 +1845,21 @@ bool TwizyVirtualBMS::setError(unsigned long error) {
 // 7 = undefined (disables info frame)
 bool TwizyVirtualBMS::setInfoBmsType(byte bmsType) {
   CHECKLIMIT(bmsType, 0, 7);
-  id700[1] = (id700[1] & 0x1F) | (bmsType << 5);
+  TwizySigInfoBmsType::put(id700, bmsType);
   return true;
 }
 
 // Set informational state 1
 //  state: 0x00 .. 0xFF (specific by BMS type)
 bool TwizyVirtualBMS::setInfoState1(byte state) {
-  id700[0] = state;
+  TwizySigInfoState1::put(id700, state);
   return true;
 }
 
 // Set informational state 2
 //  state: 0x00 .. 0xFF (specific by BMS type)
 bool TwizyVirtualBMS::setInfoState2(byte state) {
-  id700[7] = state;
+  TwizySigInfoState2::put(id700, state);
   return true;
 }
 
@@ -649,37 +1867,47 @@ bool TwizyVirtualBMS::setInfoState2(byte state) {
 //  errorCode: 0x00 .. 0x1F (specific by BMS type)
 bool TwizyVirtualBMS::setInfoError(byte errorCode) {
   CHECKLIMIT(errorCode, 0x00, 0x1F);
-  id700[1] = (id700[1] & 0xE0) | (errorCode);
+  TwizySigInfoError::put(id700, errorCode);
   return true;
 }
 
 // Set informational balancing status
 //  flags: 16 bits = 16 cells (#16 = MSB, #1 = LSB), 1 = balancing
 bool TwizyVirtualBMS::setInfoBalancing(unsigned int flags) {
-  id700[5] = (flags & 0xFF00) >> 8;
-  id700[6] = (flags & 0x00FF);
+  TwizySigInfoBalancing::put(id700, flags);
   return true;
 }
 
 
+#else
+
+// Info frame removed (TWIZY_INFO_FRAME 0):
+bool TwizyVirtualBMS::setInfoBmsType(byte bmsType) { return false; }
+bool TwizyVirtualBMS::setInfoState1(byte state) { return false; }
+bool TwizyVirtualBMS::setInfoState2(byte state) { return false; }
+bool TwizyVirtualBMS::setInfoError(byte errorCode) { return false; }
+bool TwizyVirtualBMS::setInfoBalancing(unsigned int flags) { return false; }
+
+#endif // TWIZY_INFO_FRAME
+
 // Get charger temperature
 int TwizyVirtualBMS::getChargerTemperature() {
-  return (int) id597[7] - 40;
+  return TwizySigChargerTemp597::get(id597);
 }
 
 // Get DC converter current
 float TwizyVirtualBMS::getDCConverterCurrent() {
-  return (float) id597[2] / 5;
+  return (float) TwizySigDCCurrent597::get(id597) / 5;
 }
 
 // Get plugin status
 bool TwizyVirtualBMS::isPluggedIn() {
-  return ((id597[0] & 0x20) != 0);
+  return TwizySigPlugged597::get(id597);
 }
 
 // Get key switch status
 bool TwizyVirtualBMS::isSwitchedOn() {
-  return ((id597[1] & 0x10) != 0);
+  return TwizySigKeySwitch597::get(id597);
 }
 
 
@@ -688,100 +1916,379 @@ bool TwizyVirtualBMS::isSwitchedOn() {
 // 
 
 
-// Set free CAN filters:
+// Register CAN frame handler:
+//  canId: 11 bit CAN ID i.e. 0x196
+//  fn: called on reception of canId (NULL = pass to ProcessCanMsg callback only)
+// Registering an ID again replaces its handler.
+// The CAN controller filters are updated to pass all registered IDs.
+bool TwizyVirtualBMS::onFrame(unsigned int canId, TwizyProcessCanMsgCallback fn) {
+  CHECKMAX(canId, 0x7FF);
+  
+  byte pos = findHandler(canId);
+  if (pos < rxHandlerCnt && rxHandlers[pos].id == canId) {
+    rxHandlers[pos].fn = fn;
+    return true;
+  }
+  if (rxHandlerCnt == TWIZY_CAN_RX_HANDLERS) {
+    return false;
+  }
+  
+  // insert:
+  for (byte i = rxHandlerCnt; i > pos; i--) {
+    rxHandlers[i] = rxHandlers[i-1];
+  }
+  rxHandlers[pos].id = canId;
+  rxHandlers[pos].fn = fn;
+  rxHandlerCnt++;
+  
+  if (canReady) {
+    updateCanFilters();
+  }
+  return true;
+}
+
+// Position of canId in the handler table (or of the next higher ID):
+byte TwizyVirtualBMS::findHandler(unsigned int canId) {
+  byte pos = 0;
+  while (pos < rxHandlerCnt && rxHandlers[pos].id < canId) {
+    pos++;
+  }
+  return pos;
+}
+
+
+// Set free CAN filters (deprecated, use onFrame()):
 //  filterNum: 1…3
 //  canId: 11 bit CAN ID i.e. 0x196
-void TwizyVirtualBMS::setCanFilter(byte filterNum, unsigned int canId) {
+// Like the former MCP2515 filters, each filterNum holds one ID: setting it
+// again replaces the previous ID (unless registered by onFrame() with a
+// handler or held by another filterNum).
+bool TwizyVirtualBMS::setCanFilter(byte filterNum, unsigned int canId) {
   CHECKLIMIT(filterNum, 1, 3);
-  twizyCAN.init_Filt(2+filterNum, 0, (unsigned long)canId << 16);
+  CHECKMAX(canId, 0x7FF);
+  
+  unsigned int &slot = canFilterIds[filterNum - 1];
+  if (slot == canId) {
+    return true;
+  }
+  
+  // drop the previous ID first, so the new one fits into a full table:
+  byte pos = findHandler(slot);
+  if (pos < rxHandlerCnt && rxHandlers[pos].id == slot && rxHandlers[pos].fn == NULL
+      && canFilterIds[filterNum % 3] != slot && canFilterIds[(filterNum + 1) % 3] != slot) {
+    rxHandlerCnt--;
+    for (byte i = pos; i < rxHandlerCnt; i++) {
+      rxHandlers[i] = rxHandlers[i+1];
+    }
+    if (canReady) {
+      updateCanFilters();
+    }
+  }
+  slot = 0xFFFF;
+  
+  // add the new ID (keeping a handler registered by onFrame()):
+  pos = findHandler(canId);
+  if (!(pos < rxHandlerCnt && rxHandlers[pos].id == canId) && !onFrame(canId, NULL)) {
+    return false;
+  }
+  slot = canId;
+  return true;
 }
 
 
-#define SAVEMSG(dst) for(int i = 0; i<rxLen; i++) { dst[i] = rxBuf[i]; }
+// Program MCP2515 acceptance filters 2…5 (mask 1) for DISPLAY 599 + user IDs.
+// Up to three user IDs get exact filters. For more, the mask is widened bit
+// by bit until the IDs fall into four filter groups; frames passing the
+// hardware filter without a handler are then dropped by the dispatcher.
+void TwizyVirtualBMS::updateCanFilters() {
+  unsigned int ids[TWIZY_CAN_RX_HANDLERS + 1];
+  byte cnt = 0;
+  
+  ids[cnt++] = 0x599;
+  for (byte i = 0; i < rxHandlerCnt; i++) {
+    unsigned int id = rxHandlers[i].id;
+    if (id != 0x423 && id != 0x597 && id != 0x599) {
+      ids[cnt++] = id;
+    }
+  }
+  
+  unsigned int mask = 0x7FF;
+  unsigned int filt[4];
+  byte filtCnt;
+  for (;;) {
+    // collect distinct filter values for mask:
+    filtCnt = 0;
+    byte i;
+    for (i = 0; i < cnt; i++) {
+      unsigned int val = ids[i] & mask;
+      byte j = 0;
+      while (j < filtCnt && filt[j] != val) {
+        j++;
+      }
+      if (j == filtCnt) {
+        if (filtCnt == 4) {
+          break;
+        }
+        filt[filtCnt++] = val;
+      }
+    }
+    if (i == cnt) {
+      break;
+    }
+    // too many groups: drop lowest mask bit, retry
+    mask &= mask - 1;
+  }
+  
+  twizyCAN.init_Mask(1, 0, (unsigned long)mask << 16);
+  for (byte i = 0; i < 4; i++) {
+    // unused filters repeat DISPLAY 599:
+    twizyCAN.init_Filt(2 + i, 0, (unsigned long)(i < filtCnt ? filt[i] : filt[0]) << 16);
+  }
+}
+
+
+#define SAVEMSG(dst) for(byte i = 0; i<rxLen && i<sizeof(dst); i++) { dst[i] = rxBuf[i]; }
 
 // Read and process Twizy CAN messages:
 void TwizyVirtualBMS::receiveCanMsgs() {
   
+  #if TWIZY_CAN_RX_RING > 0
+  
+  while (rxTail != rxHead) {
+    // copy & release ring slot:
+    RxMsg &msg = rxRing[rxTail & (TWIZY_CAN_RX_RING - 1)];
+    rxTime = msg.time;
+    rxId = msg.id;
+    rxLen = msg.len;
+    memcpy(rxBuf, msg.buf, 8);
+    rxTail++;
+    rxActivity();
+    processCanMsg();
+  }
+  
+  #else
+  
+  while (twizyCAN.readMsgBuf(&rxId, &rxLen, rxBuf) == CAN_OK) {
+    rxTime = micros();
+    rxActivity();
+    processCanMsg();
+  }
+  
+  #endif
+}
+
+
+// Frame received: restart CAN inactivity timeout
+void TwizyVirtualBMS::rxActivity() {
+  
   // CAN wakeup?
   if (rxTimeout == 0) {
     // yes → 3MW ON, 155_2 → 9x:
-    digitalWrite(TWIZY_3MW_CONTROL_PIN, 1);
-    id155[1] = 0x90 | (id155[1] & 0x0F);
+    digitalWrite(ctlPin, 1);
+    TwizySigHandshake155::put(id155, 0x9);
     #if TWIZY_DEBUG_LEVEL >= 1
-      Serial.println(F(TWIZY_TAG "CAN WAKEUP"));
+      logMsg(TwizyLogCanWakeup);
     #endif
   }
-
+  
   rxTimeout = CAN_RX_TIMEOUT + 1;
+  #if TWIZY_SLEEP > 0
+  wakeTimeout = 0;
+  #endif
+}
+
+
+// Process received CAN message:
+void TwizyVirtualBMS::processCanMsg() {
   
-  while (twizyCAN.readMsgBuf(&rxId, &rxLen, rxBuf) == CAN_OK) {
-    
-    if (rxId == 0x423) {
+  TRACEFRAME(rxTime, rxId, rxLen, rxBuf, 0);
+  
+  switch (rxId) {
+    case 0x423:
       SAVEMSG(id423);
       process423();
-    }
-    else if (rxId == 0x597) {
+      break;
+    case 0x597:
       SAVEMSG(id597);
       process597();
-    }
-    else if (rxId == 0x599) {
+      break;
+    case 0x599:
       SAVEMSG(id599);
       process599();
+      break;
+  }
+  
+  // User frame handler (binary search):
+  byte lo = 0, hi = rxHandlerCnt;
+  while (lo < hi) {
+    byte mid = (lo + hi) >> 1;
+    if (rxHandlers[mid].id < rxId) {
+      lo = mid + 1;
     }
-    
-    // User space callback:
-    if (bmsProcessCanMsg) {
-      (*bmsProcessCanMsg)(rxId, rxLen, rxBuf);
+    else {
+      hi = mid;
+    }
+  }
+  if (lo < rxHandlerCnt && rxHandlers[lo].id == rxId && rxHandlers[lo].fn) {
+    (*rxHandlers[lo].fn)(rxId, rxLen, rxBuf);
+  }
+  
+  // User space callback:
+  if (bmsProcessCanMsg) {
+    (*bmsProcessCanMsg)(rxId, rxLen, rxBuf);
+  }
+}
+
+
+#if TWIZY_CAN_RX_RING > 0
+
+// Drain CAN controller into RX ring (called by ISR):
+void TwizyVirtualBMS::fillRxRing() {
+  RxMsg overflow;
+  for (;;) {
+    byte head = rxHead;
+    bool full = ((byte)(head - rxTail) >= TWIZY_CAN_RX_RING);
+    RxMsg &msg = full ? overflow : rxRing[head & (TWIZY_CAN_RX_RING - 1)];
+    if (twizyCAN.readMsgBuf(&msg.id, &msg.len, msg.buf) != CAN_OK) {
+      break;
+    }
+    if (full) {
+      rxOverflows++;
+    }
+    else {
+      msg.time = micros();
+      rxHead = head + 1;
+    }
+  }
+}
+
+#endif
+
+
+// -----------------------------------------------------
+// Interrupt handlers
+// 
+
+// CAN clock tick:
+void TwizyVirtualBMS::clockISR(void *bms) {
+  TwizyVirtualBMS *self = (TwizyVirtualBMS *) bms;
+  #if TWIZY_TICK_STATS
+  if (self->clockTick)
+    self->clockMissed++;
+  else
+    self->clockTickTime = micros();
+  #endif
+  self->clockTick = true;
+}
+
+// CAN controller interrupt (TWIZY_CAN_IRQ_PIN):
+void TwizyVirtualBMS::canISR(void *bms) {
+  TwizyVirtualBMS *self = (TwizyVirtualBMS *) bms;
+  #if TWIZY_CAN_RX_RING > 0
+  self->fillRxRing();
+  #else
+  self->canMsgReceived = true;
+  #endif
+}
+
+
+#if TWIZY_ADC_CHANNELS > 0
+
+// Start ADC acquisition
+//  pins: analog input pins (A0 …), count: 1 .. TWIZY_ADC_CHANNELS
+// The inputs are converted in turn, TWIZY_ADC_OVERSAMPLE + 1 conversions
+// each (the first after switching is discarded to let the sample & hold
+// settle), so each input gets a result every (OVERSAMPLE + 1) * count
+// conversions, i.e. 16 + 1 samples * 5 inputs at 9600/s: ~110 results/s.
+bool TwizyVirtualBMS::adcBegin(const byte *pins, byte count) {
+  CHECKLIMIT(count, 1, TWIZY_ADC_CHANNELS);
+  memcpy(adcPins, pins, count);
+  memset(adcRing, 0, sizeof(adcRing));
+  adcCount = count;
+  adcMuxInput = adcConvInput = 0;
+  adcMuxCnt = 1;
+  adcSumInput = 0xFF;
+  if (!twizyAdcBegin(adcPins[0], adcISR, this)) {
+    Serial.println(F(TWIZY_TAG "adcBegin: ERROR ADC in use"));
+    return false;
+  }
+  return true;
+}
+
+// Mean of the last TWIZY_ADC_RING results: slot adcHead holds either the
+// newest result or the one TWIZY_ADC_RING scans old, both complete, but
+// the ISR may write it at any time, so each value is copied atomically.
+unsigned int TwizyVirtualBMS::getAnalogMean(byte input) {
+  unsigned long sum = 0;
+  for (byte i = 0; i < TWIZY_ADC_RING; i++) {
+    noInterrupts();
+    unsigned int value = adcRing[i][input];
+    interrupts();
+    sum += value;
+  }
+  return sum / TWIZY_ADC_RING;
+}
+
+// ADC conversion complete: the next conversion has already been started
+// on adcMuxInput, select the input for the one after it, then accumulate
+// the result. Results are scaled to 16 bit (analogRead() * 64), the
+// decimation of 4^n samples adds n bits of resolution given enough noise.
+void TwizyVirtualBMS::adcISR(void *bms) {
+  TwizyVirtualBMS *self = (TwizyVirtualBMS *) bms;
+  unsigned int value = twizyAdcRead();
+  byte input = self->adcConvInput;
+  
+  self->adcConvInput = self->adcMuxInput;
+  if (++self->adcMuxCnt == TWIZY_ADC_OVERSAMPLE + 1) {
+    self->adcMuxCnt = 0;
+    if (++self->adcMuxInput == self->adcCount)
+      self->adcMuxInput = 0;
+    twizyAdcSelect(self->adcPins[self->adcMuxInput]);
+  }
+  
+  if (input != self->adcSumInput) {
+    // first sample after switching: discard
+    self->adcSumInput = input;
+    self->adcSumCnt = 0;
+    self->adcSum = 0;
+    return;
+  }
+  self->adcSum += value;
+  if (++self->adcSumCnt == TWIZY_ADC_OVERSAMPLE) {
+    byte head = self->adcHead;
+    self->adcRing[head][input] = self->adcSum * (64 / TWIZY_ADC_OVERSAMPLE);
+    self->adcSumInput = 0xFF;
+    if (input == self->adcCount - 1) {
+      self->adcHead = (head + 1) & (TWIZY_ADC_RING - 1);
+      self->adcScans++;
     }
   }
 }
 
+#endif
+
 
 // Process CHARGER frame 423:
 void TwizyVirtualBMS::process423() {
-  if (twizyState == Off && id423[0] != 0) {
-    enterState(Init);
-  }
-  else if (twizyState != Off && id423[0] == 0) {
-    enterState(Off);
-  }
+  byte state = TwizySigState423::get(id423);
+  postEvent(state != 0 ? TwizyEvChargerOn : TwizyEvChargerOff);
 }
 
 
 // Process CHARGER frame 597:
 void TwizyVirtualBMS::process597() {
   byte address = id597[1] & 0xE5;
-  byte chgmode = id597[3] & 0xF0;
+  byte chgmode = TwizySigChargerMode597::get(id597);
   
   if (address != 0xE4) {
     return; // charger does not talk to us
   }
   
-  if (chgmode == 0xC0) {
-    if (twizyState != Driving) {
-      enterState(StartDrive);
-    }
-  }
-  else if (chgmode == 0xB0) {
-    if (twizyState != Charging) {
-      enterState(StartCharge);
-    }
-  }
-  else if (chgmode == 0x90) {
-    if (twizyState != Trickle) {
-      enterState(StartTrickle);
-    }
-  }
-  else if (chgmode == 0xD0) {
-    if (twizyState == Driving) {
-      enterState(StopDrive);
-    }
-    else if (twizyState == Charging) {
-      enterState(StopCharge);
-    }
-    else if (twizyState == Trickle) {
-      enterState(StopTrickle);
-    }
+  switch (chgmode) {
+    case 0xC: postEvent(TwizyEvDrive); break;
+    case 0xB: postEvent(TwizyEvCharge); break;
+    case 0x9: postEvent(TwizyEvTrickle); break;
+    case 0xD: postEvent(TwizyEvStop); break;
   }
 }
 
@@ -790,13 +2297,8 @@ void TwizyVirtualBMS::process597() {
 void TwizyVirtualBMS::process599() {
 
   // copy odometer to BMS frame 55E
-  unsigned long odo = ((unsigned long)id599[0] << 24)
-                    | ((unsigned long)id599[1] << 16)
-                    | ((unsigned long)id599[2] << 8)
-                    | (id599[3]);
-  odo /= 10;
-  id55E[6] = odo >> 8;
-  id55E[7] = odo & 0x00ff;
+  unsigned long odo = TwizySigOdometer599::get(id599);
+  TwizySigOdometer55E::put(id55E, odo / 10);
 }
 
 
@@ -806,29 +2308,89 @@ void TwizyVirtualBMS::process599() {
 
 bool TwizyVirtualBMS::sendMsg(INT32U id, INT8U len, INT8U *buf) {
   
+  CHECKLIMIT(len, 0, 8);
+  
+  #if TWIZY_SLEEP > 0
+  if (wakeTime && id == 0x155) {
+    wakeLatency = micros() - wakeTime;
+    wakeTime = 0;
+  }
+  #endif
+  
   #if TWIZY_CAN_SEND == 1
   
-  for (int tries=3; tries>0; tries--) {
-    if (twizyCAN.sendMsgBuf(id, 0, len, buf) != CAN_GETTXBFTIMEOUT) {
-      // CAN_OK = frame has been sent
-      // CAN_SENDMSGTIMEOUT = we made it into a send buffer
-      //  → no need to repeat the send:
+  bool waiting = (txQueueLen > 0);
+  
+  if (!waiting) {
+    // no frames waiting, try to send directly:
+    if (twizyCAN.trySendMsgBuf(id, 0, len, buf) == CAN_OK) {
+      TRACEFRAME(micros(), id, len, buf, TWIZY_TRACE_TX);
       return true;
     }
-    sendRetries++;
   }
   
-  #endif //TWIZY_CAN_SEND
+  // queue full? → drop the frame with the lowest priority:
+  if (txQueueLen == TWIZY_CAN_TXQUEUE_SIZE) {
+    txDrops++;
+    if (id >= txQueue[txQueueLen-1].id) {
+      return false;
+    }
+    txQueueLen--;
+  }
+  
+  // insert by priority:
+  byte pos = txQueueLen;
+  while (pos > 0 && txQueue[pos-1].id > id) {
+    txQueue[pos] = txQueue[pos-1];
+    pos--;
+  }
+  txQueue[pos].id = id;
+  txQueue[pos].len = len;
+  memcpy(txQueue[pos].buf, buf, len);
+  
+  if (++txQueueLen > txQueueMax) {
+    txQueueMax = txQueueLen;
+  }
   
-  sendErrors++;
+  if (waiting) {
+    // TX buffers may have been freed since the last flush:
+    flushTxQueue();
+  }
+  
+  return true;
+  
+  #else
+  
+  txDrops++;
   return false;
+  
+  #endif //TWIZY_CAN_SEND
+}
+
+
+// Send a CAN message from flash memory (PROGMEM):
+bool TwizyVirtualBMS::sendMsg_P(INT32U id, INT8U len, const INT8U *buf) {
+  
+  CHECKLIMIT(len, 0, 8);
+  
+  byte data[8];
+  memcpy_P(data, buf, len);
+  return sendMsg(id, len, data);
+}
 
-  // Note: MCP_CAN.sendMsgBuf() is not optimized for throughput.
-  // Despite having three send buffers in the MCP, it will wait
-  // for the send to finish and return an error on timeout.
-  // The timeout is 50 MCP register reads via SPI.
-  // It could be worth replacing MCP_CAN.sendMsgBuf() to utilize
-  // asynchronous writes.
+
+// Move queued frames into free TX buffers:
+void TwizyVirtualBMS::flushTxQueue() {
+  byte sent = 0;
+  while (sent < txQueueLen &&
+         twizyCAN.trySendMsgBuf(txQueue[sent].id, 0, txQueue[sent].len, txQueue[sent].buf) == CAN_OK) {
+    TRACEFRAME(micros(), txQueue[sent].id, txQueue[sent].len, txQueue[sent].buf, TWIZY_TRACE_TX);
+    sent++;
+  }
+  if (sent) {
+    txQueueLen -= sent;
+    memmove(txQueue, txQueue + sent, txQueueLen * sizeof(TxMsg));
+  }
 }
 
 
@@ -838,6 +2400,15 @@ bool TwizyVirtualBMS::sendMsg(INT32U id, INT8U len, INT8U *buf) {
 
 void TwizyVirtualBMS::ticker() {
   
+  // State transitions requested by the frames received:
+  while (eventTail != eventHead) {
+    handleEvent((TwizyEvent) eventQueue[eventTail++ & (TWIZY_EVENT_QUEUE - 1)]);
+  }
+  
+#if TWIZY_SOC_ESTIMATOR > 0
+  socTick();
+#endif
+  
   // Note: currently we turn off all CAN sends in state Error,
   //  as that reliably lets the SEVCON and charger switch off.
   //  It may be an option to only turn off ID 554 (or all 55x)
@@ -846,59 +2417,29 @@ void TwizyVirtualBMS::ticker() {
   
   if ((twizyState != Off) && (twizyState != Error)) {
     
-    bool ms100 = (clockCnt % 10 == 0);
-    bool ms1000 = (clockCnt % 100 == 0);
-    bool ms3000 = (clockCnt % 300 == 0);
-    bool ms10000 = (clockCnt % 1000 == 0);
-    
-    
     //
     // Send CAN messages
     //
     
     if ((TWIZY_SEND_INIT_FRAMES == 1) && (twizyState == Init)) {
-      // Send static init frames:
-      sendMsg(0x155, sizeof(id155_init), id155_init);
-      sendMsg(0x424, sizeof(id424_init), id424_init);
-      sendMsg(0x425, sizeof(id425_init), id425_init);
-      sendMsg(0x554, sizeof(id554_init), id554_init);
-      sendMsg(0x556, sizeof(id556_init), id556_init);
-      sendMsg(0x557, sizeof(id557_init), id557_init);
-      sendMsg(0x55E, sizeof(id55E_init), id55E_init);
-      sendMsg(0x55F, sizeof(id55F_init), id55F_init);
-      sendMsg(0x628, sizeof(id628_init), id628_init);
-      sendMsg(0x659, sizeof(id659_init), id659_init);
+      // Send static init frames from flash:
+      for (byte i = 0; i < sizeof(twizyInitFrames) / sizeof(twizyInitFrames[0]); i++) {
+        const TwizyInitFrame *frame = &twizyInitFrames[i];
+        sendMsg_P(pgm_read_word(&frame->id), pgm_read_byte(&frame->len), frame->data);
+      }
     }
     else {
-      // Send live frames:
-      sendMsg(0x155, sizeof(id155), id155);
-      if (ms100) {
-        sendMsg(0x424, sizeof(id424), id424);
-        sendMsg(0x425, sizeof(id425), id425);
-      }
-      if (ms1000) {
-        sendMsg(0x554, sizeof(id554), id554);
-      }
-      if (ms100) {
-        sendMsg(0x556, sizeof(id556), id556);
-      }
-      if (ms1000) {
-        sendMsg(0x557, sizeof(id557), id557);
-        sendMsg(0x55E, sizeof(id55E), id55E);
-        sendMsg(0x55F, sizeof(id55F), id55F);
-      }
-      if (ms100) {
-        sendMsg(0x628, sizeof(id628), id628);
-      }
-      if (ms3000) {
-        sendMsg(0x659, sizeof(id659), id659);
-      }
-      // send frame 0x700 only if BMS type has been set:
-      if (ms1000 && (id700[1] & 0xE0) != 0xE0) {
-        sendMsg(0x700, sizeof(id700), id700);
-      }
+      // Send live frames due in this tick:
+      #define TWIZY_TX_LIVE(id, buf, len, period, phase, error, cond, init, initData, data) \
+        if (txDue(period, phase) && (cond)) { \
+          sendMsg(id, len, buf); \
+        }
+      TWIZY_FRAMES(TWIZY_TX_LIVE)
+      #undef TWIZY_TX_LIVE
     }
     
+    TICKMARK(TwizyTickSend);
+    
     
     //
     // Create 3MW / id155 pulse cycle
@@ -910,38 +2451,38 @@ void TwizyVirtualBMS::ticker() {
       
       // 3MW pulse start:
       if (counter3MW == TWIZY_3MW_PULSE_LOW) {
-        digitalWrite(TWIZY_3MW_CONTROL_PIN, 0);
+        digitalWrite(ctlPin, 0);
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "PC: 3MW LOW"));
+          logMsg(TwizyLogPc3mwLow);
         #endif
       }
       // 155_2 → A:
       if (counter3MW == TWIZY_3MW_PULSE_155_A) {
-        id155[1] = 0xA0 | (id155[1] & 0x0F);
+        TwizySigHandshake155::put(id155, 0xA);
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "PC: 155_2 A"));
+          logMsg(TwizyLogPc155A);
         #endif
       }
       // 3MW pulse end:
       if (counter3MW == TWIZY_3MW_PULSE_HIGH) {
-        digitalWrite(TWIZY_3MW_CONTROL_PIN, 1);
+        digitalWrite(ctlPin, 1);
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "PC: 3MW HIGH"));
+          logMsg(TwizyLogPc3mwHigh);
         #endif
       }
       // 155_2 → 9:
       if (counter3MW == TWIZY_3MW_PULSE_155_9) {
-        id155[1] = 0x90 | (id155[1] & 0x0F);
+        TwizySigHandshake155::put(id155, 0x9);
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "PC: 155_2 9"));
+          logMsg(TwizyLogPc1559);
         #endif
       }
       
       // Finish:
       if (counter3MW == 0) {
-        id155[3] = 0x54;
+        TwizySigState155::put(id155, 0x54);
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "PC: DONE"));
+          logMsg(TwizyLogPcDone);
         #endif
       }
     }
@@ -951,40 +2492,7 @@ void TwizyVirtualBMS::ticker() {
     // Check for state transition
     //
     
-    switch (twizyState) {
-      
-      // Transition to Ready?
-      case Init:
-      case StopDrive:
-      case StopCharge:
-      case StopTrickle:
-        if (!bmsCheckState || (*bmsCheckState)(twizyState, Ready)) {
-          enterState(Ready);
-        }
-        break;
-        
-      // Transition to Driving?
-      case StartDrive:
-        if (!bmsCheckState || (*bmsCheckState)(twizyState, Driving)) {
-          enterState(Driving);
-        }
-        break;
-        
-      // Transition to Charging?
-      case StartCharge:
-        if (!bmsCheckState || (*bmsCheckState)(twizyState, Charging)) {
-          enterState(Charging);
-        }
-        break;
-        
-      // Transition to Trickle?
-      case StartTrickle:
-        if (!bmsCheckState || (*bmsCheckState)(twizyState, Trickle)) {
-          enterState(Trickle);
-        }
-        break;
-        
-    }
+    handleEvent(TwizyEvTick);
     
     
     //
@@ -992,7 +2500,7 @@ void TwizyVirtualBMS::ticker() {
     //
     
     #if TWIZY_DEBUG_LEVEL >= 1
-    if (ms10000) {
+    if (clockCnt == 0 || clockCnt == 1000 || clockCnt == 2000) {
       debugInfo();
     }
     #endif
@@ -1002,17 +2510,20 @@ void TwizyVirtualBMS::ticker() {
   
   else if (twizyState == Error) {
     
-    bool ms1000 = (clockCnt % 100 == 0);
-    bool ms10000 = (clockCnt % 1000 == 0);
+    // Send frames enabled in state Error:
+    #define TWIZY_TX_ERROR(id, buf, len, period, phase, error, cond, init, initData, data) \
+      TWIZY_IF_##error( \
+        if (txDue(period, phase) && (cond)) { \
+          sendMsg(id, len, buf); \
+        })
+    TWIZY_FRAMES(TWIZY_TX_ERROR)
+    #undef TWIZY_TX_ERROR
     
-    // send frame 0x700 only if BMS type has been set:
-    if (ms1000 && (id700[1] & 0xE0) != 0xE0) {
-      sendMsg(0x700, sizeof(id700), id700);
-    }
+    TICKMARK(TwizyTickSend);
     
     // Debug info every 10 seconds
     #if TWIZY_DEBUG_LEVEL >= 1
-    if (ms10000) {
+    if (clockCnt == 0 || clockCnt == 1000 || clockCnt == 2000) {
       debugInfo();
     }
     #endif
@@ -1027,12 +2538,24 @@ void TwizyVirtualBMS::ticker() {
   if ((rxTimeout > 0) && (--rxTimeout == 0)) {
     // yes, switch off:
     enterState(Off);
-    digitalWrite(TWIZY_3MW_CONTROL_PIN, 0);
+    digitalWrite(ctlPin, 0);
     #if TWIZY_DEBUG_LEVEL >= 1
-      Serial.println(F(TWIZY_TAG "CAN INACTIVE → OFF"));
+      logMsg(TwizyLogCanInactive);
     #endif
-    // TODO: enter sleep mode here
+    #if TWIZY_SLEEP > 0
+    sleepPending = true;
+    #endif
+  }
+  
+  #if TWIZY_SLEEP > 0
+  // No frame accepted after wake up (bus glitch, foreign frame)?
+  if ((wakeTimeout > 0) && (--wakeTimeout == 0)) {
+    // yes, back to sleep:
+    sleepPending = true;
   }
+  #endif
+  
+  TICKMARK(TwizyTickState);
   
   
   //
@@ -1042,14 +2565,23 @@ void TwizyVirtualBMS::ticker() {
   if (bmsTicker) {
     (*bmsTicker)(clockCnt);
   }
+  
+  TICKMARK(TwizyTickUser);
 
   
   //
-  // Cyclic clock counter
+  // Cyclic clock & TX schedule counters
   //
   
   if (++clockCnt == 3000)
     clockCnt = 0;
+  
+  if (++txTick10 == 10)
+    txTick10 = 0;
+  if (++txTick100 == 100)
+    txTick100 = 0;
+  if (++txTick300 == 300)
+    txTick300 = 0;
 }
 
 
@@ -1068,50 +2600,194 @@ void TwizyVirtualBMS::dumpId(FLASHSTRING *name, int len, byte *buf) {
   Serial.println();
 }
 
+#if TWIZY_CAN_TRACE > 0
+// Write CAN trace to the serial port in binary form, oldest record first.
+// Format: "TVBT", version, record count, 0, records:
+//  time (4 bytes), idFlags (2 bytes), lenState, data (len bytes)
+// Multi byte values are little endian. Convert using extras/host/TraceConvert.
+void TwizyVirtualBMS::dumpTrace() {
+  byte header[7] = { 'T', 'V', 'B', 'T', TWIZY_TRACE_VERSION, traceCount, 0 };
+  Serial.write(header, sizeof(header));
+  byte pos = (traceCount < TWIZY_CAN_TRACE) ? 0 : traceHead;
+  for (byte n = 0; n < traceCount; n++) {
+    const TwizyTraceRecord &rec = trace[pos];
+    byte head[7] = {
+      (byte) rec.time, (byte)(rec.time >> 8), (byte)(rec.time >> 16), (byte)(rec.time >> 24),
+      (byte) rec.idFlags, (byte)(rec.idFlags >> 8),
+      rec.lenState };
+    Serial.write(head, sizeof(head));
+    Serial.write(rec.data, rec.lenState & 0x0F);
+    if (++pos == TWIZY_CAN_TRACE)
+      pos = 0;
+  }
+}
+#endif
+
+#if TWIZY_DEBUG_LEVEL >= 1
+
+// Print log message <msg> with packed arguments <args> as a text line
+// (also used by extras/host/LogFormat to convert binary log records):
+void twizyLogPrint(byte msg, const byte *args) {
+  const char *text = (const char *) pgm_read_ptr(&twizyLogText[msg]);
+  const char *type = twizyLogArgs[msg];
+  char c;
+  while ((c = pgm_read_byte(text++))) {
+    if (c != '%') {
+      Serial.print(c);
+      continue;
+    }
+    char t = pgm_read_byte(type++);
+    switch (t) {
+      case 'B':
+        Serial.print(args[0]);
+        args += 1;
+        break;
+      case 'W':
+        Serial.print((unsigned int)(args[0] | (args[1] << 8)));
+        args += 2;
+        break;
+      case 'X':
+        Serial.print((unsigned int)(args[0] | (args[1] << 8)), HEX);
+        args += 2;
+        break;
+      case 'L':
+      case 'l': {
+        uint32_t val = args[0] | ((uint32_t) args[1] << 8) | ((uint32_t) args[2] << 16) | ((uint32_t) args[3] << 24);
+        if (t == 'l')
+          Serial.print((long)(int32_t) val);
+        else
+          Serial.print((unsigned long) val);
+        args += 4;
+        break;
+      }
+      case 'S':
+        Serial.print(FS(twizyStateName[args[0]]));
+        args += 1;
+        break;
+      case 'P':
+        Serial.print(FS(twizyTickPhaseName[args[0]]));
+        args += 1;
+        break;
+      case 'F':
+        for (byte i = 1; i <= args[0]; i++) {
+          Serial.print(args[i] < 0x10 ? F(" 0") : F(" "));
+          Serial.print(args[i], HEX);
+        }
+        args += 1 + args[0];
+        break;
+      case 'H':
+        for (byte i = 0; i < TWIZY_TICK_BUCKETS; i++, args += 2) {
+          Serial.print(' ');
+          Serial.print((unsigned int)(args[0] | (args[1] << 8)));
+        }
+        break;
+    }
+  }
+  Serial.println();
+}
+
+// Output log message: print now, or queue as a binary record
+// (dropped if the log buffer is full, counted in the next record)
+void TwizyVirtualBMS::logRecord(TwizyLogMessage msg, const byte *args, byte len) {
+  #if TWIZY_LOG_BUFFER > 0
+  byte need = 4 + len + (logDrops ? 6 : 0);
+  if ((byte)((logTail - logHead - 1) & (TWIZY_LOG_BUFFER - 1)) < need) {
+    logDrops++;
+    return;
+  }
+  uint16_t time = millis();
+  if (logDrops) {
+    byte drop[6] = { TWIZY_LOG_SYNC, TwizyLogDropped, (byte) time, (byte)(time >> 8),
+      (byte) logDrops, (byte)(logDrops >> 8) };
+    logPut(drop, sizeof(drop));
+    logDrops = 0;
+  }
+  byte head[4] = { TWIZY_LOG_SYNC, (byte) msg, (byte) time, (byte)(time >> 8) };
+  logPut(head, sizeof(head));
+  logPut(args, len);
+  #else
+  twizyLogPrint(msg, args);
+  #endif
+}
+
+void TwizyVirtualBMS::logFrame(unsigned int id, byte len, const byte *buf) {
+  byte args[TWIZY_LOG_ARGS_MAX];
+  byte *p = logPack(args, (uint16_t) id, len);
+  memcpy(p, buf, len);
+  logRecord(TwizyLogInfoFrame, args, p + len - args);
+}
+
+#endif
+
+#if TWIZY_LOG_BUFFER > 0
+// Send queued log records as far as the serial TX buffer takes them
+// (wait = true: send all, blocking)
+void TwizyVirtualBMS::flushLog(bool wait) {
+  int room = wait ? TWIZY_LOG_BUFFER : Serial.availableForWrite();
+  while (room-- > 0 && logTail != logHead) {
+    Serial.write(logRing[logTail]);
+    logTail = (logTail + 1) & (TWIZY_LOG_BUFFER - 1);
+  }
+}
+#endif
+
 void TwizyVirtualBMS::debugInfo() {
 
   #if TWIZY_DEBUG_LEVEL >= 1
 
-  Serial.println(F("\n" TWIZY_TAG "debugInfo:"));
-  
-  Serial.print(F("- twizyState="));
-  Serial.println(stateName());
+  logMsg(TwizyLogInfo);
+  logMsg(TwizyLogInfoState, (byte) twizyState);
+  logMsg(TwizyLogInfoClock, (uint16_t) clockCnt);
+  logMsg(TwizyLogInfoTxQueue, (byte) txQueueMax);
   
-  Serial.print(F("- clockCnt="));
-  Serial.println(clockCnt);
+  if (txDrops) {
+    logMsg(TwizyLogInfoTxDrops, (uint16_t) txDrops);
+  }
+  unsigned int overflows = getRxOverflows();
+  if (overflows) {
+    logMsg(TwizyLogInfoRxOverflows, (uint16_t) overflows);
+  }
+  if (eventDrops) {
+    logMsg(TwizyLogInfoEventDrops, (uint16_t) eventDrops);
+  }
   
-  if (sendRetries) {
-    Serial.print(F("- sendRetries="));
-    Serial.println(sendRetries);
-    sendRetries = 0;
+  #if TWIZY_SOC_ESTIMATOR > 0
+  if (socUnit) {
+    logMsg(TwizyLogInfoSoc, (uint16_t)(socLevel >> 2), (uint32_t) socRestTicks);
   }
-  if (sendErrors) {
-    Serial.print(F("- sendErrors="));
-    Serial.println(sendErrors);
-    sendErrors = 0;
+  #endif
+  
+  #if TWIZY_CAN_TRACE > 0
+  logMsg(traceFrozen ? TwizyLogInfoTraceFrozen : TwizyLogInfoTrace, (byte) traceCount);
+  #endif
+  
+  #if TWIZY_TICK_STATS
+  logMsg(TwizyLogInfoTicks, (uint32_t) tickStats.ticks,
+    (uint16_t) tickStats.missed, (uint16_t) tickStats.overruns);
+  for (byte phase = 0; phase < TWIZY_TICK_PHASES; phase++) {
+    byte args[TWIZY_LOG_ARGS_MAX];
+    byte *p = logPack(args, phase, (uint32_t) tickStats.maxUs[phase]);
+    for (byte i = 0; i < TWIZY_TICK_BUCKETS; i++) {
+      p = logPack(p, (uint16_t) tickStats.hist[phase][i]);
+    }
+    logRecord(TwizyLogInfoPhase, args, p - args);
   }
+  #endif
 
   #endif
 
   #if TWIZY_DEBUG_LEVEL >= 2
   
   // CHARGER & DISPLAY:
-  dumpId(F("id423"), sizeof(id423), id423);
-  dumpId(F("id597"), sizeof(id597), id597);
-  dumpId(F("id599"), sizeof(id599), id599);
+  logFrame(0x423, sizeof(id423), id423);
+  logFrame(0x597, sizeof(id597), id597);
+  logFrame(0x599, sizeof(id599), id599);
   
   // BMS:
-  dumpId(F("id155"), sizeof(id155), id155);
-  dumpId(F("id424"), sizeof(id424), id424);
-  dumpId(F("id425"), sizeof(id425), id425);
-  dumpId(F("id554"), sizeof(id554), id554);
-  dumpId(F("id556"), sizeof(id556), id556);
-  dumpId(F("id557"), sizeof(id557), id557);
-  dumpId(F("id55E"), sizeof(id55E), id55E);
-  dumpId(F("id55F"), sizeof(id55F), id55F);
-  dumpId(F("id628"), sizeof(id628), id628);
-  dumpId(F("id659"), sizeof(id659), id659);
-  dumpId(F("id700"), sizeof(id700), id700);
+  #define TWIZY_FRAME_DUMP(id, buf, len, period, phase, error, cond, init, initData, data) \
+    logFrame(id, len, buf);
+  TWIZY_FRAMES(TWIZY_FRAME_DUMP)
+  #undef TWIZY_FRAME_DUMP
   
   #endif
   
@@ -1122,6 +2798,24 @@ void TwizyVirtualBMS::debugInfo() {
 // Twizy state transitions:
 //
 
+// Look up & do the transition for <event> in the current state:
+void TwizyVirtualBMS::handleEvent(TwizyEvent event) {
+  for (byte i = 0; i < sizeof(twizyTransitions) / sizeof(twizyTransitions[0]); i++) {
+    const TwizyTransition *t = &twizyTransitions[i];
+    byte from = pgm_read_byte(&t->from);
+    if (pgm_read_byte(&t->event) != event || (from != twizyState && from != TWIZY_ANY_STATE)) {
+      continue;
+    }
+    byte to = pgm_read_byte(&t->to);
+    if (to != TWIZY_STAY
+        && (event != TwizyEvTick || !bmsCheckState || (*bmsCheckState)(twizyState, (TwizyState) to))) {
+      enterState((TwizyState) to);
+    }
+    return;
+  }
+}
+
+
 void TwizyVirtualBMS::enterState(TwizyState newState) {
   
   if (twizyState == newState) {
@@ -1129,76 +2823,66 @@ void TwizyVirtualBMS::enterState(TwizyState newState) {
   }
   
   #if TWIZY_DEBUG_LEVEL >= 1
-  Serial.print(F(TWIZY_TAG "enterState: newState="));
-  Serial.println(stateName(newState));
+  logMsg(TwizyLogEnterState, (byte) newState);
   #endif
   
+  // Frame state bytes:
+  const TwizyStateFrames *frames = &twizyStateFrames[newState];
+  uint16_t val;
+  if ((val = pgm_read_word(&frames->level155)) != TWIZY_KEEP)
+    TwizySigChargeLevel155::put(id155, val);
+  if ((val = pgm_read_word(&frames->state155)) != TWIZY_KEEP)
+    TwizySigState155::put(id155, val);
+  if ((val = pgm_read_word(&frames->state424)) != TWIZY_KEEP)
+    TwizySigState424::put(id424, val);
+  if ((val = pgm_read_word(&frames->state425)) != TWIZY_KEEP)
+    TwizySigState425::put(id425, val);
+  
+  // Actions:
   switch (newState) {
     
     case Off:
-      id155[0] = 0xFF;
-      id155[3] = 0x94;
-      id424[0] = 0x00;
-      id425[0] = 0x1D;
       counter3MW = 0;
       break;
     
     case Init:
-      id155[0] = 0xFF;
-      id155[3] = 0x94;
-      id424[0] = 0x00;
-      id425[0] = 0x1D;
       clockCnt = 0;
+      txTick10 = txTick100 = txTick300 = 0;
       break;
       
     case Error:
       // Note: these updates are just for consistency, will currently
       //  not be sent as Error turns off sending (may change)
-      id155[3] = 0x94;
-      id424[0] |= 0x80;
-      id425[0] = 0x24;
-      digitalWrite(TWIZY_3MW_CONTROL_PIN, 0);
+      TwizySigState424::put(id424, TwizySigState424::get(id424) | 0x80);
+      digitalWrite(ctlPin, 0);
       counter3MW = 0;
+      #if TWIZY_CAN_TRACE > 0
+      // keep the frames leading to the error:
+      traceFrozen = true;
+      #endif
       break;
       
     case Ready:
       // restore minimum charge current level after stop/init:
-      if (id155[0] == 0 || id155[0] == 0xFF) {
-        id155[0] = 1;
+      val = TwizySigChargeLevel155::get(id155);
+      if (val == 0 || val == 0xFF) {
+        TwizySigChargeLevel155::put(id155, 1);
       }
       // keep stop charge request if set:
-      if (id424[0] != 0x12) {
-        id424[0] = 0x11;
+      if (TwizySigState424::get(id424) != 0x12) {
+        TwizySigState424::put(id424, 0x11);
       }
-      id425[0] = 0x24;
       // if switching on...
       if (twizyState == Init) {
         // ...start 3MW pulse cycle:
         counter3MW = TWIZY_3MW_PULSE_START + 1;
         #if TWIZY_DEBUG_LEVEL >= 1
-          Serial.println(F(TWIZY_TAG "3MW START"));
+          logMsg(TwizyLogStart3mw);
         #endif
       }
       break;
       
-    case Driving:
-      id425[0] = 0x2A;
-      break;
-      
-    case Charging:
-      id425[0] = 0x0A;
-      break;
-      
-    case StopCharge:
-      id424[0] = 0x12;
-      break;
-      
-    case StartTrickle:
-      id425[0] = 0x2C;
-      break;
-      
-    case Trickle:
-      id425[0] = 0x2A;
+    default:
       break;
   }
   
@@ -1235,15 +2919,16 @@ void TwizyVirtualBMS::begin() {
   twizyCAN.init_Filt(0, 0, 0x04230000); // CHARGER: 423
   twizyCAN.init_Filt(1, 0, 0x05970000); // CHARGER: 597
   
-  twizyCAN.init_Mask(1, 0, 0x07FF0000);
-  twizyCAN.init_Filt(2, 0, 0x05990000); // DISPLAY: 599
-  twizyCAN.init_Filt(3, 0, 0x00000000); // usable by setCanFilter(1)
-  twizyCAN.init_Filt(4, 0, 0x00000000); // usable by setCanFilter(2)
-  twizyCAN.init_Filt(5, 0, 0x00000000); // usable by setCanFilter(3)
+  updateCanFilters();                   // DISPLAY: 599 + onFrame() IDs
+  canReady = true;
   
   #ifdef TWIZY_CAN_IRQ_PIN
-  pinMode(TWIZY_CAN_IRQ_PIN, INPUT);
-  attachInterrupt(digitalPinToInterrupt(TWIZY_CAN_IRQ_PIN), twizyCanISR, FALLING);
+  pinMode(irqPin, INPUT);
+  // block the CAN interrupt during SPI transactions:
+  twizyCAN.usingInterrupt(digitalPinToInterrupt(irqPin));
+  if (!twizyAttachInterrupt(digitalPinToInterrupt(irqPin), canISR, this, FALLING)) {
+    Serial.println(F(TWIZY_TAG "begin: ERROR no free interrupt slot (TWIZY_MAX_INSTANCES)"));
+  }
   #endif
   
   twizyCAN.setMode(MCP_NORMAL);
@@ -1253,30 +2938,17 @@ void TwizyVirtualBMS::begin() {
   // Init Twizy state machine & clock
   //
   
-  pinMode(TWIZY_3MW_CONTROL_PIN, OUTPUT);
+  pinMode(ctlPin, OUTPUT);
   
   enterState(Off);
   
-  #if TWIZY_USE_TIMER == 1
-  
-  // Use Timer1 (16 bit):
-  Timer1.initialize(TWIZY_CAN_CLOCK_US);
-  Timer1.attachInterrupt(twizyClockISR);
-
-  #elif TWIZY_USE_TIMER == 2
-  
-  // Use Timer2 (8 bit): derive count from resolution:
-  FlexiTimer2::set(TWIZY_CAN_CLOCK_US / (1000000UL / TWIZY_TIMER2_RESOLUTION),
-                    1.0 / TWIZY_TIMER2_RESOLUTION,
-                    twizyClockISR);
-  FlexiTimer2::start();
-  
-  #else
-  
-  // Use Timer3 (16 bit):
-  Timer3.initialize(TWIZY_CAN_CLOCK_US);
-  Timer3.attachInterrupt(twizyClockISR);
+  if (!twizyTimerBegin(TWIZY_CAN_CLOCK_US, clockISR, this)) {
+    Serial.println(F(TWIZY_TAG "begin: ERROR no free timer slot (TWIZY_MAX_INSTANCES)"));
+  }
   
+  #if TWIZY_SLEEP > 0
+  // sleep until the car wakes up:
+  sleepPending = true;
   #endif
   
   Serial.println(F(TWIZY_TAG "begin: done"));
@@ -1289,17 +2961,40 @@ void TwizyVirtualBMS::begin() {
 //
 
 void TwizyVirtualBMS::looper() {
+  
+  #if TWIZY_SLEEP > 0
+  // Asleep: the MCP2515 pulls the IRQ pin low on bus activity
+  // (Arduino: power down ends there, host: idle until then)
+  if (sleeping) {
+    if (digitalRead(irqPin) == HIGH) {
+      return;
+    }
+    wake();
+  }
+  #endif
+  
+  //
+  // Send queued Twizy CAN messages
+  //
+  
+  if (txQueueLen) {
+    flushTxQueue();
+  }
+  
   //
   // Receive Twizy CAN messages
   //
   
-  #ifndef TWIZY_CAN_IRQ_PIN
+  #if TWIZY_CAN_RX_RING > 0
+  // RX ring filled by IRQ:
+  canMsgReceived = (rxHead != rxTail);
+  #elif !defined(TWIZY_CAN_IRQ_PIN)
   // No IRQ, we need to poll:
-  twizyCanMsgReceived = (twizyCAN.checkReceive() == CAN_MSGAVAIL);
+  canMsgReceived = (twizyCAN.checkReceive() == CAN_MSGAVAIL);
   #endif
   
-  if (twizyCanMsgReceived) {
-    twizyCanMsgReceived = false;
+  if (canMsgReceived) {
+    canMsgReceived = false;
     receiveCanMsgs();
   }
   
@@ -1307,10 +3002,349 @@ void TwizyVirtualBMS::looper() {
   // Twizy ticker (send CAN messages, check for state transitions)
   //
   
-  if (twizyClockTick) {
-    twizyClockTick = false;
+  if (clockTick) {
+    #if TWIZY_TICK_STATS
+    // read tick time before clearing the flag (ISR won't touch it until then):
+    unsigned long tickTime = clockTickTime;
+    clockTick = false;
+    byte missed = clockMissed;
+    tickStats.missed += (byte)(missed - tickMissedSeen);
+    tickMissedSeen = missed;
+    tickStats.ticks++;
+    tickMarkTime = tickTime;
+    TICKMARK(TwizyTickLatency);
+    ticker();
+    if (tickMarkTime - tickTime > TWIZY_CAN_CLOCK_US)
+      tickStats.overruns++;
+    #else
+    clockTick = false;
     ticker();
+    #endif
+  }
+  
+  //
+  // Idle: send queued log records
+  //
+  
+  #if TWIZY_LOG_BUFFER > 0
+  if (!clockTick) {
+    flushLog();
+  }
+  #endif
+  
+  #if TWIZY_SLEEP > 0
+  if (sleepPending && txQueueLen == 0) {
+    sleepPending = false;
+    if (twizyState == Off) {
+      sleep();
+    }
+  }
+  #endif
+}
+
+
+#if TWIZY_SLEEP > 0
+
+// Enter sleep mode: MCP2515 sleeps until CAN bus activity,
+// MCU powers down until the MCP2515 wake up interrupt
+void TwizyVirtualBMS::sleep() {
+  #if TWIZY_DEBUG_LEVEL >= 1
+    logMsg(TwizyLogSleep);
+  #endif
+  #if TWIZY_LOG_BUFFER > 0
+  flushLog(true);
+  #endif
+  twizyCAN.sleepWakeOnBus();
+  sleeping = true;
+  wakeTime = 0;
+  twizyPowerDown(digitalPinToInterrupt(irqPin));
+}
+
+// Wake up: the MCP2515 is in Listen-only mode now, the frame causing the
+// wake up is lost, so the next CHARGER frame (100 ms later) starts Init.
+// Without a frame passing the filters within CAN_WAKE_TIMEOUT (i.e. a bus
+// glitch or foreign traffic), looper() powers down again.
+void TwizyVirtualBMS::wake() {
+  sleeping = false;
+  wakeTime = micros() | 1;
+  wakeTimeout = CAN_WAKE_TIMEOUT;
+  twizyCAN.clearWake();
+  twizyCAN.setMode(MCP_NORMAL);
+  twizyAttachInterrupt(digitalPinToInterrupt(irqPin), canISR, this, FALLING);
+  clockTick = false;
+  // frames may have arrived before the handler was reattached:
+  #if TWIZY_CAN_RX_RING > 0
+  noInterrupts();
+  fillRxRing();
+  interrupts();
+  #else
+  canMsgReceived = true;
+  #endif
+  #if TWIZY_DEBUG_LEVEL >= 1
+    logMsg(TwizyLogWakeUp);
+  #endif
+}
+
+#endif
+
+
+// -----------------------------------------------------
+// Pack model: N physical cells & temperature sensors
+//  aggregated to the Twizy cells 1 … REPORT_CELLS (max 16) and
+//  modules 1 … MODULES (max 8). Cells & sensors are mapped in contiguous
+//  groups of (almost) equal size, each group reported as its min, max or
+//  mean (cellAgg / tempAgg). Data is kept as plain arrays (structure of
+//  arrays), each group is reduced in one pass.
+// 
+// Usage:
+//   TwizyPack<96, 24> pack;            // i.e. 96 cells → 14 Twizy cells
+//   pack.cellMV[i] = …;                // fill in your measurements
+//   pack.temp[i] = …;
+//   pack.publish(twizy);               // → 0x556/557/55E/700, 0x554, 0x424
+// 
+
+template <uint16_t CELLS, uint8_t SENSORS, uint8_t REPORT_CELLS = 14, uint8_t MODULES = 7>
+class TwizyPack {
+
+  static_assert(CELLS >= REPORT_CELLS, "TwizyPack: CELLS < REPORT_CELLS");
+  static_assert(REPORT_CELLS >= 1 && REPORT_CELLS <= 16, "TwizyPack: REPORT_CELLS must be 1 … 16");
+  static_assert(SENSORS >= MODULES, "TwizyPack: SENSORS < MODULES");
+  static_assert(MODULES >= 1 && MODULES <= 8, "TwizyPack: MODULES must be 1 … 8");
+
+public:
+
+  uint16_t cellMV[CELLS];                 // cell voltages [mV]
+  int8_t temp[SENSORS];                   // sensor temperatures [°C]
+  uint8_t balancing[(CELLS + 7) / 8];     // balancing flags, bit (i & 7) of byte (i >> 3)
+
+  TwizyAggregate cellAgg;
+  TwizyAggregate tempAgg;
+
+  TwizyPack(TwizyAggregate cellAgg = TwizyAggMin, TwizyAggregate tempAgg = TwizyAggMax)
+    : cellAgg(cellAgg), tempAgg(tempAgg) {
+    memset(cellMV, 0, sizeof(cellMV));
+    memset(temp, 0, sizeof(temp));
+    memset(balancing, 0, sizeof(balancing));
+  }
+
+  // Physical cells / sensors of a group:
+  static uint16_t cellStart(uint8_t group) {
+    return (uint32_t) group * CELLS / REPORT_CELLS;
+  }
+  static uint8_t sensorStart(uint8_t group) {
+    return (uint16_t) group * SENSORS / MODULES;
+  }
+
+  // Aggregate & publish into the VirtualBMS frames:
+  //  cells → setCellVoltages(), balancing → setInfoBalancing(),
+  //  sensors → setModuleTemperature() & setTemperature()
+  // Returns false if any aggregated value is out of bounds (nothing changed).
+  bool publish(TwizyVirtualBMS &bms, TwizyPackStats *stats = NULL) {
+
+    uint16_t level[REPORT_CELLS];
+    uint16_t minMV = 0xFFFF, maxMV = 0;
+    uint32_t sumMV = 0;
+    unsigned int balance = 0;
+
+    for (uint8_t g = 0; g < REPORT_CELLS; g++) {
+      uint16_t first = cellStart(g), last = cellStart(g + 1);
+      // one pass: min, max & sum (vectorizable reductions)
+      uint16_t gMin = 0xFFFF, gMax = 0;
+      uint32_t gSum = 0;
+      for (uint16_t i = first; i < last; i++) {
+        uint16_t mv = cellMV[i];
+        gMin = (mv < gMin) ? mv : gMin;
+        gMax = (mv > gMax) ? mv : gMax;
+        gSum += mv;
+      }
+      level[g] = (cellAgg == TwizyAggMin) ? gMin
+               : (cellAgg == TwizyAggMax) ? gMax
+               : (uint16_t)(gSum / (last - first));
+      minMV = (gMin < minMV) ? gMin : minMV;
+      maxMV = (gMax > maxMV) ? gMax : maxMV;
+      sumMV += gSum;
+      if (anyBalancing(first, last)) {
+        balance |= 1U << g;
+      }
+    }
+
+    int8_t module[MODULES];
+    int minTemp = 127, maxTemp = -128;
+
+    for (uint8_t g = 0; g < MODULES; g++) {
+      uint8_t first = sensorStart(g), last = sensorStart(g + 1);
+      int8_t gMin = 127, gMax = -128;
+      int16_t gSum = 0;
+      for (uint8_t i = first; i < last; i++) {
+        int8_t t = temp[i];
+        gMin = (t < gMin) ? t : gMin;
+        gMax = (t > gMax) ? t : gMax;
+        gSum += t;
+      }
+      module[g] = (tempAgg == TwizyAggMin) ? gMin
+                : (tempAgg == TwizyAggMax) ? gMax
+                : (int8_t)(gSum / (int16_t)(last - first));
+      minTemp = (gMin < minTemp) ? gMin : minTemp;
+      maxTemp = (gMax > maxTemp) ? gMax : maxTemp;
+    }
+
+    // validate before changing anything:
+    CHECKLIMIT_BMS(bms., maxMV, 0, 5000);
+    CHECKLIMIT_BMS(bms., minTemp, -40, 100);
+    CHECKLIMIT_BMS(bms., maxTemp, -40, 100);
+
+    bms.setCellVoltages(level, REPORT_CELLS);
+    bms.setInfoBalancing(balance);
+    for (uint8_t g = 0; g < MODULES; g++) {
+      bms.setModuleTemperature(g + 1, module[g]);
+    }
+    bms.setTemperature(minTemp, maxTemp, false);
+
+    if (stats) {
+      stats->minMV = minMV;
+      stats->maxMV = maxMV;
+      stats->sumMV = sumMV;
+      stats->meanMV = sumMV / CELLS;
+      stats->minCell = find(minMV) + 1;
+      stats->maxCell = find(maxMV) + 1;
+      stats->minTemp = minTemp;
+      stats->maxTemp = maxTemp;
+    }
+
+    return true;
+  }
+
+private:
+
+  bool anyBalancing(uint16_t first, uint16_t last) const {
+    for (uint16_t i = first; i < last; i++) {
+      if (balancing[i >> 3] & (1 << (i & 7))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint16_t find(uint16_t mv) const {
+    uint16_t i = 0;
+    while (i < CELLS - 1 && cellMV[i] != mv) {
+      i++;
+    }
+    return i;
+  }
+
+};
+
+
+
+// -----------------------------------------------------
+// Derating: drive & recuperation power and charge current limits from
+//  piecewise linear maps over SOC × temperature, kept in PROGMEM and
+//  interpolated bilinearly in integer math. Cost: one scan per axis,
+//  two divisions and twelve table reads, independent of the values.
+// 
+// Usage:
+//   const TwizyDerateMap<4, 3> derateMap PROGMEM = {
+//     { 0, 2000, 9500, 10000 },          // SOC axis [1/100 %], ascending
+//     { 0, 20, 45 },                     // temperature axis [°C], ascending
+//     { { … }, { … }, { … } },           // drive [W]: one SOC row per temperature
+//     { { … }, { … }, { … } },           // recup [W]
+//     { { … }, { … }, { … } }            // charge [A]
+//   };
+//   twizyDerate(twizy, derateMap, socCP, temp);   // → setPowerLimits() & setChargeCurrent()
+// Values outside the axis ranges are clamped to the first / last point.
+// 
+
+template <uint8_t SOC_POINTS, uint8_t TEMP_POINTS>
+struct TwizyDerateMap {
+  uint16_t socCP[SOC_POINTS];                 // SOC axis [1/100 %]
+  int8_t temp[TEMP_POINTS];                   // temperature axis [°C]
+  uint16_t drive[TEMP_POINTS][SOC_POINTS];    // drive power [W]
+  uint16_t recup[TEMP_POINTS][SOC_POINTS];    // recuperation power [W]
+  uint8_t charge[TEMP_POINTS][SOC_POINTS];    // charge current [A]
+};
+
+inline int twizyReadAxis(const uint16_t *p) {
+  return pgm_read_word(p);
+}
+inline int twizyReadAxis(const int8_t *p) {
+  return (int8_t) pgm_read_byte(p);
+}
+
+// Axis lookup: segment index i (axis[i] <= x < axis[i+1]) and the
+//  position of x in the segment in 1/256 (frac)
+template <typename T>
+uint8_t twizyDerateAxis(const T *axis, uint8_t count, long x, uint8_t &frac) {
+  long a0 = twizyReadAxis(&axis[0]);
+  frac = 0;
+  if (x <= a0)
+    return 0;
+  for (uint8_t i = 0; i < count - 1; i++) {
+    long a1 = twizyReadAxis(&axis[i + 1]);
+    if (x < a1) {
+      frac = ((unsigned long)(x - a0) << 8) / (unsigned long)(a1 - a0);
+      return i;
+    }
+    a0 = a1;
   }
+  return count - 1;
+}
+
+// Interpolate v0…v1 by frac/256: map values are uint16_t (0…65535),
+//  so take them as long (an int difference overflows on AVR)
+inline long twizyLerp(long v0, long v1, uint8_t frac) {
+  return v0 + (((v1 - v0) * frac) >> 8);
+}
+
+// Evaluate the map at socCP [1/100 %] and temp [°C]:
+template <uint8_t SOC_POINTS, uint8_t TEMP_POINTS>
+void twizyDerateEval(const TwizyDerateMap<SOC_POINTS, TEMP_POINTS> &map,
+    unsigned int socCP, int temp, TwizyDerateLimits &limits) {
+
+  static_assert(SOC_POINTS >= 1 && TEMP_POINTS >= 1, "TwizyDerateMap: empty axis");
+
+  uint8_t fs, ft;
+  uint8_t s0 = twizyDerateAxis(map.socCP, SOC_POINTS, socCP, fs);
+  uint8_t t0 = twizyDerateAxis(map.temp, TEMP_POINTS, temp, ft);
+  uint8_t s1 = (s0 < SOC_POINTS - 1) ? s0 + 1 : s0;
+  uint8_t t1 = (t0 < TEMP_POINTS - 1) ? t0 + 1 : t0;
+
+  limits.drive = twizyLerp(
+    twizyLerp(pgm_read_word(&map.drive[t0][s0]), pgm_read_word(&map.drive[t0][s1]), fs),
+    twizyLerp(pgm_read_word(&map.drive[t1][s0]), pgm_read_word(&map.drive[t1][s1]), fs), ft);
+  limits.recup = twizyLerp(
+    twizyLerp(pgm_read_word(&map.recup[t0][s0]), pgm_read_word(&map.recup[t0][s1]), fs),
+    twizyLerp(pgm_read_word(&map.recup[t1][s0]), pgm_read_word(&map.recup[t1][s1]), fs), ft);
+  limits.charge = twizyLerp(
+    twizyLerp(pgm_read_byte(&map.charge[t0][s0]), pgm_read_byte(&map.charge[t0][s1]), fs),
+    twizyLerp(pgm_read_byte(&map.charge[t1][s0]), pgm_read_byte(&map.charge[t1][s1]), fs), ft);
+}
+
+// Evaluate the map & set the VirtualBMS limits:
+//  shift: additional derating of all limits by 2^shift (1 = half, 2 = quarter),
+//    i.e. on cell voltage deviation warnings
+//  limits: optional pointer receiving the limits set
+// Returns false if a map value is out of the setter bounds (limits unchanged).
+template <uint8_t SOC_POINTS, uint8_t TEMP_POINTS>
+bool twizyDerate(TwizyVirtualBMS &bms, const TwizyDerateMap<SOC_POINTS, TEMP_POINTS> &map,
+    unsigned int socCP, int temp, byte shift = 0, TwizyDerateLimits *limits = NULL) {
+
+  TwizyDerateLimits l;
+  twizyDerateEval(map, socCP, temp, l);
+  l.drive >>= shift;
+  l.recup >>= shift;
+  l.charge >>= shift;
+
+  CHECKLIMIT_BMS(bms., l.drive, 0, 30000);
+  CHECKLIMIT_BMS(bms., l.recup, 0, 30000);
+  CHECKLIMIT_BMS(bms., l.charge, 0, 35);
+  bms.setPowerLimits(l.drive, l.recup);
+  bms.setChargeCurrent(l.charge);
+
+  if (limits) {
+    *limits = l;
+  }
+  return true;
 }
 
 
@@ -0,0 +1,422 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Arduino backend
+ * ==========================================================================
+ *
+ * Standard hardware backend:
+ *  - CAN controller: MCP2515 via MCP_CAN library
+ *  - CAN clock: TimerOne / FlexiTimer2 / TimerThree (TWIZY_USE_TIMER)
+ *  - GPIO, serial port & flash strings: Arduino core
+ *  - ADC acquisition (TWIZY_ADC_CHANNELS): AVR ADC in free running mode
+ *  - Power down (TWIZY_SLEEP): AVR sleep mode, wake up by CAN interrupt pin
+ *
+ * See TwizyVirtualBMS.h for the backend interface description.
+ *
+ */
+
+#ifndef _TwizyVirtualBMS_arduino_h
+#define _TwizyVirtualBMS_arduino_h
+
+#include <Arduino.h>
+#include <avr/pgmspace.h>
+
+#include <SPI.h>
+#include <mcp_can.h>
+#include <mcp_can_dfs.h>
+
+#ifndef TWIZY_USE_TIMER
+#define TWIZY_USE_TIMER 1
+#endif
+
+#if TWIZY_USE_TIMER == 1
+#include <TimerOne.h>
+#elif TWIZY_USE_TIMER == 2
+#include <FlexiTimer2.h>
+#elif TWIZY_USE_TIMER == 3
+#include <TimerThree.h>
+#else
+#error "TWIZY_USE_TIMER invalid, please set to 1, 2 or 3!"
+#endif
+
+#ifndef TWIZY_MAX_INSTANCES
+#define TWIZY_MAX_INSTANCES 1
+#endif
+
+#if TWIZY_MAX_INSTANCES < 1 || TWIZY_MAX_INSTANCES > 4
+#error "TWIZY_MAX_INSTANCES invalid, please set to 1 … 4!"
+#endif
+
+#if TWIZY_SLEEP > 0
+#include <avr/sleep.h>
+#if TWIZY_MAX_INSTANCES > 1
+#error "TWIZY_SLEEP: power down needs all instances Off, use TWIZY_MAX_INSTANCES 1"
+#endif
+#endif
+
+
+// -----------------------------------------------------
+// Interrupt registration
+//  The Arduino core & timer libraries only take argument-less ISRs,
+//  so each instance gets a slot & the hardware ISR dispatches to it.
+//
+
+struct TwizyISRSlot {
+  TwizyISR isr;
+  void *arg;
+};
+
+
+// -----------------------------------------------------
+// CAN controller
+//
+
+// MCP2515 SPI instructions:
+#define TWIZY_MCP_LOAD_TX0      0x40    // + 2 * buffer number
+#define TWIZY_MCP_RTS           0x80    // | 1 << buffer number
+#define TWIZY_MCP_READ_STATUS   0xA0
+
+// MCP2515 READ STATUS bits:
+#define TWIZY_MCP_STAT_TXREQ0   0x04
+#define TWIZY_MCP_STAT_TXREQ1   0x10
+#define TWIZY_MCP_STAT_TXREQ2   0x40
+
+// MCP2515 TX buffer control (TXBnCTRL = 0x30 + 0x10 * buffer number):
+#define TWIZY_MCP_TXB0CTRL      0x30
+#define TWIZY_MCP_TXP_MASK      0x03
+
+// MCP2515 registers & bits for sleep mode:
+#define TWIZY_MCP_BIT_MODIFY    0x05
+#define TWIZY_MCP_CANCTRL       0x0F
+#define TWIZY_MCP_CANINTE       0x2B
+#define TWIZY_MCP_CANINTF       0x2C
+#define TWIZY_MCP_REQOP_MASK    0xE0
+#define TWIZY_MCP_REQOP_SLEEP   0x20
+#define TWIZY_MCP_WAKI          0x40    // CANINTE.WAKIE / CANINTF.WAKIF
+
+class TwizyCanDriver : public MCP_CAN {
+
+public:
+
+  TwizyCanDriver(INT8U csPin)
+    : MCP_CAN(csPin), csPin(csPin) {
+  }
+
+  // Non-blocking send: load the frame into a free TX buffer and
+  // request transmission without waiting for completion.
+  // Returns CAN_OK or CAN_GETTXBFTIMEOUT if all three TX buffers are busy.
+  // Note: MCP_CAN.sendMsgBuf() only uses the next free buffer and then
+  //  polls for the transmission to finish.
+  // Pending buffers are sent by TXP priority, on equal TXP the highest
+  // buffer number goes first. To keep the order of the calls (= TX queue
+  // order) each buffer gets a lower TXP than all pending buffers, starting
+  // at 3 when none is pending. If the lowest pending TXP is 0 already,
+  // the frame has to wait for the buffers to drain.
+  INT8U trySendMsgBuf(INT32U id, INT8U ext, INT8U len, const INT8U *buf) {
+    
+    SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+    
+    // find free TX buffer & lowest pending priority:
+    digitalWrite(csPin, LOW);
+    SPI.transfer(TWIZY_MCP_READ_STATUS);
+    byte status = SPI.transfer(0);
+    digitalWrite(csPin, HIGH);
+    
+    static const byte txreq[3] = {
+      TWIZY_MCP_STAT_TXREQ0, TWIZY_MCP_STAT_TXREQ1, TWIZY_MCP_STAT_TXREQ2 };
+    byte txb = 3, prio = 4;
+    for (byte b = 0; b < 3; b++) {
+      if (status & txreq[b]) {
+        if (txPrio[b] < prio)
+          prio = txPrio[b];
+      }
+      else if (txb == 3) {
+        txb = b;
+      }
+    }
+    if (txb == 3 || prio == 0) {
+      SPI.endTransaction();
+      return CAN_GETTXBFTIMEOUT;
+    }
+    txPrio[txb] = --prio;
+    
+    // set TX priority:
+    digitalWrite(csPin, LOW);
+    SPI.transfer(TWIZY_MCP_BIT_MODIFY);
+    SPI.transfer(TWIZY_MCP_TXB0CTRL + 0x10 * txb);
+    SPI.transfer(TWIZY_MCP_TXP_MASK);
+    SPI.transfer(prio);
+    digitalWrite(csPin, HIGH);
+    
+    // load TX buffer (SIDH, SIDL, EID8, EID0, DLC, data):
+    digitalWrite(csPin, LOW);
+    SPI.transfer(TWIZY_MCP_LOAD_TX0 + 2 * txb);
+    if (ext) {
+      SPI.transfer(id >> 21);
+      SPI.transfer(((id >> 13) & 0xE0) | 0x08 | ((id >> 16) & 0x03));
+      SPI.transfer(id >> 8);
+      SPI.transfer(id);
+    }
+    else {
+      SPI.transfer(id >> 3);
+      SPI.transfer((id & 0x07) << 5);
+      SPI.transfer(0);
+      SPI.transfer(0);
+    }
+    SPI.transfer(len & 0x0F);
+    for (byte i = 0; i < len; i++) {
+      SPI.transfer(buf[i]);
+    }
+    digitalWrite(csPin, HIGH);
+    
+    // request to send:
+    digitalWrite(csPin, LOW);
+    SPI.transfer(TWIZY_MCP_RTS | (1 << txb));
+    digitalWrite(csPin, HIGH);
+    
+    SPI.endTransaction();
+    return CAN_OK;
+  }
+
+  // Block CAN interrupt during SPI transactions:
+  void usingInterrupt(byte irq) {
+    SPI.usingInterrupt(irq);
+  }
+
+  // Enter sleep mode, wake up on bus activity: the MCP2515 then sets
+  // WAKIF (INT pin low) and continues in Listen-only mode. The frame
+  // causing the wake up is lost.
+  void sleepWakeOnBus() {
+    modifyRegister(TWIZY_MCP_CANINTF, TWIZY_MCP_WAKI, 0);
+    modifyRegister(TWIZY_MCP_CANINTE, TWIZY_MCP_WAKI, TWIZY_MCP_WAKI);
+    modifyRegister(TWIZY_MCP_CANCTRL, TWIZY_MCP_REQOP_MASK, TWIZY_MCP_REQOP_SLEEP);
+  }
+
+  // Clear & disable the wake up interrupt (then return to normal mode):
+  void clearWake() {
+    modifyRegister(TWIZY_MCP_CANINTE, TWIZY_MCP_WAKI, 0);
+    modifyRegister(TWIZY_MCP_CANINTF, TWIZY_MCP_WAKI, 0);
+  }
+
+private:
+
+  INT8U csPin;
+  byte txPrio[3] = { 0, 0, 0 };   // TXP last set per TX buffer
+
+  void modifyRegister(byte addr, byte mask, byte data) {
+    SPI.beginTransaction(SPISettings(10000000, MSBFIRST, SPI_MODE0));
+    digitalWrite(csPin, LOW);
+    SPI.transfer(TWIZY_MCP_BIT_MODIFY);
+    SPI.transfer(addr);
+    SPI.transfer(mask);
+    SPI.transfer(data);
+    digitalWrite(csPin, HIGH);
+    SPI.endTransaction();
+  }
+
+};
+
+
+// -----------------------------------------------------
+// CAN interrupt pin
+//
+
+TwizyISRSlot twizyPinSlots[TWIZY_MAX_INSTANCES];
+
+template <byte N>
+void twizyPinISR() {
+  (*twizyPinSlots[N].isr)(twizyPinSlots[N].arg);
+}
+
+void (* const twizyPinISRs[TWIZY_MAX_INSTANCES])() = {
+  twizyPinISR<0>,
+  #if TWIZY_MAX_INSTANCES > 1
+  twizyPinISR<1>,
+  #endif
+  #if TWIZY_MAX_INSTANCES > 2
+  twizyPinISR<2>,
+  #endif
+  #if TWIZY_MAX_INSTANCES > 3
+  twizyPinISR<3>,
+  #endif
+};
+
+// Returns false if all TWIZY_MAX_INSTANCES slots are in use:
+bool twizyAttachInterrupt(byte irq, TwizyISR isr, void *arg, int mode) {
+  for (byte i = 0; i < TWIZY_MAX_INSTANCES; i++) {
+    if (twizyPinSlots[i].isr == NULL || twizyPinSlots[i].arg == arg) {
+      twizyPinSlots[i].isr = isr;
+      twizyPinSlots[i].arg = arg;
+      attachInterrupt(irq, twizyPinISRs[i], mode);
+      return true;
+    }
+  }
+  return false;
+}
+
+
+// -----------------------------------------------------
+// CAN clock
+//  One hardware timer for all instances, the period is set by the first.
+//
+
+TwizyISRSlot twizyTimerSlots[TWIZY_MAX_INSTANCES];
+volatile byte twizyTimerSlotCnt = 0;
+
+void twizyTimerISR() {
+  for (byte i = 0; i < twizyTimerSlotCnt; i++) {
+    (*twizyTimerSlots[i].isr)(twizyTimerSlots[i].arg);
+  }
+}
+
+// Returns false if all TWIZY_MAX_INSTANCES slots are in use:
+bool twizyTimerBegin(unsigned long periodUs, TwizyISR isr, void *arg) {
+
+  byte slot;
+  for (slot = 0; slot < twizyTimerSlotCnt; slot++) {
+    if (twizyTimerSlots[slot].arg == arg)
+      break;
+  }
+  if (slot == TWIZY_MAX_INSTANCES) {
+    return false;
+  }
+
+  noInterrupts();
+  twizyTimerSlots[slot].isr = isr;
+  twizyTimerSlots[slot].arg = arg;
+  if (slot < twizyTimerSlotCnt) {
+    interrupts();
+    return true;
+  }
+  twizyTimerSlotCnt = slot + 1;
+  interrupts();
+  if (slot > 0) {
+    return true;
+  }
+
+  #if TWIZY_USE_TIMER == 1
+
+  // Use Timer1 (16 bit):
+  Timer1.initialize(periodUs);
+  Timer1.attachInterrupt(twizyTimerISR);
+
+  #elif TWIZY_USE_TIMER == 2
+
+  // Use Timer2 (8 bit): derive count from resolution:
+  FlexiTimer2::set(periodUs / (1000000UL / TWIZY_TIMER2_RESOLUTION),
+                    1.0 / TWIZY_TIMER2_RESOLUTION,
+                    twizyTimerISR);
+  FlexiTimer2::start();
+
+  #else
+
+  // Use Timer3 (16 bit):
+  Timer3.initialize(periodUs);
+  Timer3.attachInterrupt(twizyTimerISR);
+
+  #endif
+
+  return true;
+}
+
+
+// -----------------------------------------------------
+// ADC acquisition
+//  Free running conversions at ADC clock / 13 (16 MHz / 128 → ~9600/s),
+//  one interrupt per result. The input mux is latched at each conversion
+//  start, i.e. a channel selected in the interrupt applies to the
+//  conversion after the one already running.
+//  Note: analogRead() must not be used while running.
+//
+
+#if TWIZY_ADC_CHANNELS > 0
+
+TwizyISRSlot twizyAdcSlot;
+
+ISR(ADC_vect) {
+  (*twizyAdcSlot.isr)(twizyAdcSlot.arg);
+}
+
+// Select the input for the next conversion started (pin: A0 … or 0 …):
+inline void twizyAdcSelect(byte pin) {
+  if (pin >= A0)
+    pin -= A0;
+  #if defined(analogPinToChannel)
+  pin = analogPinToChannel(pin);
+  #endif
+  #if defined(MUX5)
+  ADCSRB = (ADCSRB & ~(1 << MUX5)) | (((pin >> 3) & 0x01) << MUX5);
+  #endif
+  ADMUX = (DEFAULT << 6) | (pin & 0x07);    // reference: analogReference(DEFAULT)
+}
+
+inline unsigned int twizyAdcRead() {
+  return ADC;
+}
+
+// Start conversions on pin, isr called with arg for each result.
+// Returns false if the ADC is already in use by another instance.
+bool twizyAdcBegin(byte pin, TwizyISR isr, void *arg) {
+  if (twizyAdcSlot.isr && twizyAdcSlot.arg != arg) {
+    return false;
+  }
+  noInterrupts();
+  twizyAdcSlot.isr = isr;
+  twizyAdcSlot.arg = arg;
+  twizyAdcSelect(pin);
+  ADCSRB &= ~((1 << ADTS2) | (1 << ADTS1) | (1 << ADTS0));    // trigger: free running
+  ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE)
+         | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);         // prescaler 128
+  interrupts();
+  return true;
+}
+
+#endif // TWIZY_ADC_CHANNELS
+
+
+// -----------------------------------------------------
+// Power down
+//  INT0/INT1 edges can't wake the AVR from power down, so the CAN pin
+//  interrupt is level triggered during the sleep. The wake up handler
+//  detaches itself, the library then reattaches its CAN interrupt.
+//  All timers stop, millis() & micros() pause during the sleep.
+//
+
+#if TWIZY_SLEEP > 0
+
+volatile byte twizyWakeIrq;
+
+void twizyWakeISR() {
+  detachInterrupt(twizyWakeIrq);
+}
+
+// Sleep until the (active low) interrupt pin irq is low:
+void twizyPowerDown(byte irq) {
+
+  Serial.flush();
+
+  #if TWIZY_ADC_CHANNELS > 0
+  byte adcsra = ADCSRA;
+  ADCSRA = 0;
+  #endif
+
+  twizyWakeIrq = irq;
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  noInterrupts();
+  attachInterrupt(irq, twizyWakeISR, LOW);
+  sleep_enable();
+  #if defined(sleep_bod_disable)
+  sleep_bod_disable();
+  #endif
+  interrupts();     // the next instruction is executed before any interrupt
+  sleep_cpu();
+  sleep_disable();
+
+  #if TWIZY_ADC_CHANNELS > 0
+  ADCSRA = adcsra | (1 << ADSC);
+  #endif
+}
+
+#endif // TWIZY_SLEEP
+
+
+#endif // _TwizyVirtualBMS_arduino_h
@@ -13,13 +13,51 @@
 // Level 2 = log CAN frame dumps (10 second interval)
 #define TWIZY_DEBUG_LEVEL         1
 
+// Log buffer size in bytes (power of 2, 32 … 256, 0 = off): log messages
+// are queued as binary records & sent by looper() while idle instead of
+// printed in the 10 ms tick. Convert using extras/host/LogFormat.
+// Level 2 frame dumps need 256 bytes.
+#define TWIZY_LOG_BUFFER          0
+
 // Set to 0 to disable CAN transmissions for testing:
 #define TWIZY_CAN_SEND            1
 
+// VirtualBMS info frame 0x700 (BMS type, states, cells 15 & 16), only sent
+// once a BMS type has been set. Set to 0 to remove it if you don't use it.
+#define TWIZY_INFO_FRAME          1
+
+// Set to 1 to measure the 10 ms tick timing (jitter, phase durations, missed
+// ticks), see getTickStats(). Costs ~90 bytes RAM and some µs per tick.
+#define TWIZY_TICK_STATS          0
+
+// CAN trace: number of frames (TX & RX) to keep in RAM (15 bytes each,
+// max 255, 0 = off). Recording stops on entering state Error, see dumpTrace().
+#define TWIZY_CAN_TRACE           0
+
+// Set to 1 to let the VirtualBMS estimate the SOC by integrating the current
+// set by setCurrentQA() every tick, corrected by the open circuit voltage at
+// rest. Enable by setSOCCapacity(), see API.md. Costs ~20 bytes RAM.
+#define TWIZY_SOC_ESTIMATOR       0
+
+// ADC acquisition: number of analog inputs sampled in the background by the
+// ADC interrupt (0 = off, max 8), see adcBegin(). analogRead() must not be
+// used then. Each result averages TWIZY_ADC_OVERSAMPLE samples (1 … 64,
+// power of 2), the last TWIZY_ADC_RING results (power of 2) are kept.
+#define TWIZY_ADC_CHANNELS        0
+#define TWIZY_ADC_OVERSAMPLE      16
+#define TWIZY_ADC_RING            4
+
 // CAN send timing is normally 10 ms (10.000 us).
 // You may need to lower this if your Arduino is too slow.
 #define TWIZY_CAN_CLOCK_US        10000
 
+// CAN TX queue size: frames waiting for a free MCP2515 TX buffer.
+// Frames are sent by priority (CAN ID), the lowest priority is dropped on overflow.
+#define TWIZY_CAN_TXQUEUE_SIZE    8
+
+// CAN RX dispatch table size: max number of IDs registered by onFrame()
+#define TWIZY_CAN_RX_HANDLERS     4
+
 // VirtualBMS can use Timer1 (16 bit), Timer2 (8 bit) or Timer3 (16bit)
 // Select Timer2/3 if you need Timer1 for e.g. AltSoftSerial
 #define TWIZY_USE_TIMER           1
@@ -29,6 +67,10 @@
 // Use lowest resolution possible to minimize side effects on AltSoftSerial
 #define TWIZY_TIMER2_RESOLUTION   1000
 
+// Arduino: number of TwizyVirtualBMS instances (1 … 4, one MCP2515 each),
+// sets the interrupt dispatch slots (the CAN clock timer is shared).
+#define TWIZY_MAX_INSTANCES       1
+
 // Set your MCP clock frequency here:
 #define TWIZY_CAN_MCP_FREQ        MCP_16MHZ
 
@@ -38,6 +80,14 @@
 // Uncomment if you've connected the CAN module's IRQ pin:
 //#define TWIZY_CAN_IRQ_PIN       2
 
+// With IRQ pin: RX ring size (power of 2, 0 = off). The CAN interrupt
+// then reads & timestamps frames immediately, looper() processes them.
+//#define TWIZY_CAN_RX_RING       8
+
+// With IRQ pin: set to 1 to power down the Arduino & the MCP2515 on CAN
+// inactivity, wake up by CAN bus activity (see API.md).
+#define TWIZY_SLEEP               0
+
 // Set your 3MW (ECU_OK) control pin here:
 #define TWIZY_3MW_CONTROL_PIN     3
 
@@ -0,0 +1,685 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Host backend
+ * ==========================================================================
+ *
+ * Arduino core & MCP_CAN compatible shims to build and run the VirtualBMS
+ * on a PC (g++ / clang, C++11):
+ *  - CAN controller: in-memory CAN bus connecting any number of nodes
+ *  - CAN clock: virtual microsecond clock, advanced by the host program
+ *  - GPIO: pin states & pin interrupts kept in memory
+ *  - ADC: analog input levels set by the host program, free running
+ *    conversions in virtual time (TWIZY_ADC_CHANNELS)
+ *  - Serial port: output to stdout (or any FILE*, NULL = mute)
+ *  - Flash strings: PROGMEM mapped to RAM
+ *
+ * The library code compiles unchanged on top of this, so the hot paths
+ * can be run under a profiler and protocol sequences can be scripted.
+ *
+ * Usage: see extras/host/README.md
+ *
+ */
+
+#ifndef _TwizyVirtualBMS_host_h
+#define _TwizyVirtualBMS_host_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <vector>
+
+
+// -----------------------------------------------------
+// Arduino core types & constants
+//
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define LOW             0
+#define HIGH            1
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+
+#define CHANGE          1
+#define FALLING         2
+#define RISING          3
+
+// Analog pins (Arduino Uno numbering):
+#define A0              14
+#define A1              15
+#define A2              16
+#define A3              17
+#define A4              18
+#define A5              19
+#define A6              20
+#define A7              21
+
+#define DEC             10
+#define HEX             16
+#define OCT             8
+#define BIN             2
+
+
+// -----------------------------------------------------
+// Flash strings
+//
+
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define F(s)                    (reinterpret_cast<const __FlashStringHelper *>(s))
+
+#define pgm_read_byte(addr)     (*(const uint8_t *)(addr))
+#define pgm_read_word(addr)     (*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)    (*(const uint32_t *)(addr))
+#define pgm_read_ptr(addr)      (*(void * const *)(addr))
+#define memcpy_P                memcpy
+#define strlen_P                strlen
+
+class __FlashStringHelper;
+
+
+// -----------------------------------------------------
+// Host context: virtual clock & GPIO
+//
+
+#ifndef TWIZY_HOST_PINS
+#define TWIZY_HOST_PINS         32
+#endif
+
+struct TwizyHostCanBus;
+
+struct TwizyHostISR {
+  TwizyISR isr;
+  void *arg;
+};
+
+// One context per simulated board: switch twizyHost to run several
+// VirtualBMS instances on separate clocks, pins & buses.
+struct TwizyHostContext {
+
+  // Virtual clock [us]:
+  unsigned long long clockUs = 0;
+
+  // CAN clock timer (shared period, one ISR per registration):
+  unsigned long timerPeriod = 0;
+  unsigned long long timerNext = 0;
+  std::vector<TwizyHostISR> timerISRs;
+
+  // GPIO:
+  byte pinModes[TWIZY_HOST_PINS] = {};
+  byte pinStates[TWIZY_HOST_PINS] = {};
+  byte pinIrqModes[TWIZY_HOST_PINS] = {};
+  TwizyHostISR pinIrqs[TWIZY_HOST_PINS] = {};
+
+  // CAN bus for drivers started in this context (NULL = twizyHostCanBus):
+  TwizyHostCanBus *canBus = NULL;
+
+  // ADC: input levels per pin (0 … 1023) & noise amplitude (± LSB),
+  //  free running conversions every adcPeriod µs once started
+  unsigned int adcValues[TWIZY_HOST_PINS] = {};
+  unsigned int adcNoise = 0;
+  unsigned long adcPeriod = 104;
+  unsigned long long adcNext = 0;
+  byte adcMux = 0;          // selected input
+  byte adcConvMux = 0;      // input of the running conversion
+  unsigned int adcResult = 0;
+  unsigned long adcRandom = 1;
+  TwizyHostISR adcISR = {};
+
+  // Power down: timers & ADC stop until the wake pin goes low
+  bool sleeping = false;
+  byte wakeIrq = 0xFF;
+  unsigned long long sleepStart = 0;
+  unsigned long long sleepUs = 0;       // total time asleep
+  unsigned long sleepCount = 0;
+};
+
+TwizyHostContext twizyHostDefaultContext;
+
+// Current context, per thread: threads may step separate contexts in parallel
+thread_local TwizyHostContext *twizyHost = &twizyHostDefaultContext;
+
+
+// ADC conversion complete: latch the result, start the next conversion
+// on the selected input, then call the interrupt handler:
+void twizyHostAdcConvert() {
+  TwizyHostContext &h = *twizyHost;
+  long value = h.adcValues[h.adcConvMux];
+  if (h.adcNoise) {
+    h.adcRandom = h.adcRandom * 1103515245UL + 12345UL;
+    value += (long)((h.adcRandom >> 16) % (2 * h.adcNoise + 1)) - (long) h.adcNoise;
+  }
+  h.adcResult = (value < 0) ? 0 : (value > 1023) ? 1023 : value;
+  h.adcConvMux = h.adcMux;
+  (*h.adcISR.isr)(h.adcISR.arg);
+}
+
+// Advance virtual clock, run timer & ADC interrupts due in time order:
+void twizyHostAdvance(unsigned long us) {
+  unsigned long long target = twizyHost->clockUs + us;
+  for (;;) {
+    TwizyHostContext &h = *twizyHost;
+    bool timer = !h.sleeping && !h.timerISRs.empty() && h.timerNext <= target;
+    bool adc = !h.sleeping && h.adcISR.isr && h.adcNext <= target;
+    if (timer && (!adc || h.timerNext <= h.adcNext)) {
+      h.clockUs = h.timerNext;
+      h.timerNext += h.timerPeriod;
+      for (size_t i = 0; i < h.timerISRs.size(); i++) {
+        (*h.timerISRs[i].isr)(h.timerISRs[i].arg);
+      }
+    }
+    else if (adc) {
+      h.clockUs = h.adcNext;
+      h.adcNext += h.adcPeriod;
+      twizyHostAdcConvert();
+    }
+    else {
+      break;
+    }
+  }
+  twizyHost->clockUs = target;
+}
+
+// ADC backend, see TwizyVirtualBMS_arduino.h:
+void twizyAdcSelect(byte pin) {
+  twizyHost->adcMux = (pin < TWIZY_HOST_PINS) ? pin : 0;
+}
+
+unsigned int twizyAdcRead() {
+  return twizyHost->adcResult;
+}
+
+bool twizyAdcBegin(byte pin, TwizyISR isr, void *arg) {
+  TwizyHostContext &h = *twizyHost;
+  if (h.adcISR.isr && h.adcISR.arg != arg) {
+    return false;
+  }
+  h.adcISR.isr = isr;
+  h.adcISR.arg = arg;
+  twizyAdcSelect(pin);
+  h.adcConvMux = h.adcMux;
+  h.adcNext = h.clockUs + h.adcPeriod;
+  return true;
+}
+
+// Set an analog input level (0 … 1023):
+void twizyHostSetAnalog(byte pin, unsigned int value) {
+  if (pin < TWIZY_HOST_PINS) {
+    twizyHost->adcValues[pin] = value;
+  }
+}
+
+int analogRead(byte pin) {
+  return (pin < TWIZY_HOST_PINS) ? twizyHost->adcValues[pin] : 0;
+}
+
+unsigned long micros() {
+  return (unsigned long) twizyHost->clockUs;
+}
+
+unsigned long millis() {
+  return (unsigned long) (twizyHost->clockUs / 1000);
+}
+
+void delay(unsigned long ms) {
+  twizyHostAdvance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  twizyHostAdvance(us);
+}
+
+void noInterrupts() {}
+void interrupts() {}
+
+void pinMode(byte pin, byte mode) {
+  if (pin < TWIZY_HOST_PINS) {
+    twizyHost->pinModes[pin] = mode;
+    if (mode == INPUT_PULLUP) {
+      twizyHost->pinStates[pin] = HIGH;
+    }
+  }
+}
+
+int digitalRead(byte pin) {
+  return (pin < TWIZY_HOST_PINS) ? twizyHost->pinStates[pin] : LOW;
+}
+
+void digitalWrite(byte pin, byte val) {
+  if (pin >= TWIZY_HOST_PINS) {
+    return;
+  }
+  byte old = twizyHost->pinStates[pin];
+  val = val ? HIGH : LOW;
+  twizyHost->pinStates[pin] = val;
+  // wake up from power down (level triggered), the timers resume
+  // counting where they stopped:
+  TwizyHostContext &h = *twizyHost;
+  if (h.sleeping && pin == h.wakeIrq && val == LOW) {
+    unsigned long long slept = h.clockUs - h.sleepStart;
+    h.sleeping = false;
+    h.sleepUs += slept;
+    h.timerNext += slept;
+    h.adcNext += slept;
+  }
+  // pin interrupt:
+  TwizyHostISR irq = twizyHost->pinIrqs[pin];
+  byte mode = twizyHost->pinIrqModes[pin];
+  if (irq.isr && old != val) {
+    if (mode == CHANGE || (mode == FALLING && val == LOW) || (mode == RISING && val == HIGH)) {
+      (*irq.isr)(irq.arg);
+    }
+  }
+}
+
+#define digitalPinToInterrupt(pin)  (pin)
+
+bool twizyAttachInterrupt(byte irq, TwizyISR isr, void *arg, int mode) {
+  if (irq >= TWIZY_HOST_PINS) {
+    return false;
+  }
+  twizyHost->pinIrqs[irq].isr = isr;
+  twizyHost->pinIrqs[irq].arg = arg;
+  twizyHost->pinIrqModes[irq] = mode;
+  return true;
+}
+
+// Power down until the (active low) interrupt pin irq is low.
+// Returns immediately: the host program keeps calling looper(), which
+// stays idle while asleep; timer & ADC interrupts are suspended.
+void twizyPowerDown(byte irq) {
+  TwizyHostContext &h = *twizyHost;
+  if (irq < TWIZY_HOST_PINS && h.pinStates[irq] == LOW) {
+    return;
+  }
+  h.sleeping = true;
+  h.wakeIrq = irq;
+  h.sleepStart = h.clockUs;
+  h.sleepCount++;
+}
+
+// Arduino API: argument-less handler
+void twizyCallISR(void *isr) {
+  (*(void (*)()) isr)();
+}
+void attachInterrupt(byte irq, void (*isr)(), int mode) {
+  twizyAttachInterrupt(irq, twizyCallISR, (void *) isr, mode);
+}
+
+void detachInterrupt(byte irq) {
+  if (irq < TWIZY_HOST_PINS) {
+    twizyHost->pinIrqs[irq].isr = NULL;
+  }
+}
+
+
+// -----------------------------------------------------
+// Serial port
+//
+
+class TwizyHostSerial {
+public:
+  FILE *out = stdout;
+
+  void begin(unsigned long baud) {}
+  operator bool() { return true; }
+
+  int availableForWrite() {
+    return 63;    // AVR HardwareSerial: TX buffer size - 1
+  }
+
+  size_t write(byte c) {
+    if (out) fputc(c, out);
+    return 1;
+  }
+  size_t write(const byte *buf, size_t len) {
+    if (out) fwrite(buf, 1, len, out);
+    return len;
+  }
+
+  size_t print(const char *s) {
+    return out ? fprintf(out, "%s", s) : 0;
+  }
+  size_t print(const __FlashStringHelper *s) {
+    return print(reinterpret_cast<const char *>(s));
+  }
+  size_t print(char c) {
+    return write((byte) c);
+  }
+  size_t print(unsigned long n, int base = DEC) {
+    char buf[8 * sizeof(long) + 1];
+    char *p = &buf[sizeof(buf) - 1];
+    *p = 0;
+    if (base < 2) base = DEC;
+    do {
+      byte digit = n % base;
+      *--p = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+      n /= base;
+    } while (n);
+    return print(p);
+  }
+  size_t print(long n, int base = DEC) {
+    if (base == DEC && n < 0) {
+      return print('-') + print((unsigned long) -n, base);
+    }
+    return print((unsigned long) n, base);
+  }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(int n, int base = DEC)           { return print((long) n, base); }
+  size_t print(unsigned int n, int base = DEC)  { return print((unsigned long) n, base); }
+  size_t print(double n, int digits = 2) {
+    return out ? fprintf(out, "%.*f", digits, n) : 0;
+  }
+
+  size_t println() {
+    return print("\r\n");
+  }
+  template <typename T>
+  size_t println(T val) {
+    return print(val) + println();
+  }
+  template <typename T>
+  size_t println(T val, int fmt) {
+    return print(val, fmt) + println();
+  }
+};
+
+TwizyHostSerial Serial;
+
+
+// -----------------------------------------------------
+// CAN controller: MCP_CAN compatible in-memory node
+//
+
+#ifndef INT8U
+#define INT8U   byte
+#endif
+#ifndef INT32U
+#define INT32U  unsigned long
+#endif
+
+#define CAN_OK              (0)
+#define CAN_FAILINIT        (1)
+#define CAN_FAILTX          (2)
+#define CAN_MSGAVAIL        (3)
+#define CAN_NOMSG           (4)
+#define CAN_CTRLERROR       (5)
+#define CAN_GETTXBFTIMEOUT  (6)
+#define CAN_SENDMSGTIMEOUT  (7)
+#define CAN_FAIL            (0xff)
+
+#define MCP_STDEXT          0
+#define MCP_STD             1
+#define MCP_EXT             2
+#define MCP_ANY             3
+
+#define MCP_NORMAL          0x00
+#define MCP_SLEEP           0x20
+#define MCP_LOOPBACK        0x40
+#define MCP_LISTENONLY      0x60
+
+#define MCP_20MHZ           0
+#define MCP_16MHZ           1
+#define MCP_8MHZ            2
+
+#define CAN_500KBPS         15
+
+
+struct TwizyHostCanFrame {
+  unsigned long long time;        // virtual clock [us]
+  unsigned long id;
+  byte len;
+  byte buf[8];
+};
+
+class TwizyCanDriver;
+
+class TwizyHostCanBus {
+public:
+  std::vector<TwizyCanDriver *> nodes;
+
+  // Bus monitor: called for every frame on the bus (sender NULL = injected)
+  std::function<void(const TwizyHostCanFrame &frame, const TwizyCanDriver *sender)> monitor;
+  
+  // Gateway: called for frames sent by nodes, to forward them to an
+  // external bus (see TwizyVirtualBMS_socketcan.h)
+  std::function<void(const TwizyHostCanFrame &frame)> gateway;
+
+  unsigned long frameCount = 0;
+
+  // Bus load simulation:
+  unsigned long bitrate = 500000;
+  unsigned long long busyUntil = 0;
+
+  // Reserve bus time for a frame, returns end of transmission [us]:
+  // (standard frame: 47 + 8 * len bits + ~20% stuff bits)
+  unsigned long long occupy(byte len) {
+    unsigned long long start = std::max(busyUntil, twizyHost->clockUs);
+    busyUntil = start + (47 + 8 * len) * 1200000ULL / bitrate;
+    return busyUntil;
+  }
+
+  void attach(TwizyCanDriver *node) {
+    if (std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+      nodes.push_back(node);
+  }
+  void detach(TwizyCanDriver *node) {
+    nodes.erase(std::remove(nodes.begin(), nodes.end(), node), nodes.end());
+  }
+
+  void transmit(const TwizyCanDriver *sender, unsigned long id, byte len, const byte *buf);
+
+  // Send a frame from outside any node (i.e. simulated Twizy components):
+  void inject(unsigned long id, byte len, const byte *buf) {
+    transmit(NULL, id, len, buf);
+  }
+};
+
+TwizyHostCanBus twizyHostCanBus;
+
+
+class TwizyCanDriver {
+public:
+
+  TwizyCanDriver(INT8U csPin)
+    : csPin(csPin) {
+  }
+  ~TwizyCanDriver() {
+    if (bus) bus->detach(this);
+  }
+
+  INT8U begin(INT8U idmodeset, INT8U speedset, INT8U clockset) {
+    if (!bus) bus = twizyHost->canBus ? twizyHost->canBus : &twizyHostCanBus;
+    bus->attach(this);
+    memset(masks, 0, sizeof(masks));
+    memset(filters, 0, sizeof(filters));
+    rx.clear();
+    mode = MCP_LOOPBACK; // MCP_CAN leaves the controller in loopback mode
+    return CAN_OK;
+  }
+
+  INT8U init_Mask(INT8U num, INT8U ext, INT32U ulData) {
+    if (num > 1) return CAN_FAIL;
+    masks[num] = ulData;
+    return CAN_OK;
+  }
+
+  INT8U init_Filt(INT8U num, INT8U ext, INT32U ulData) {
+    if (num > 5) return CAN_FAIL;
+    filters[num] = ulData;
+    return CAN_OK;
+  }
+
+  INT8U setMode(INT8U opMode) {
+    mode = opMode;
+    return CAN_OK;
+  }
+
+  INT8U sendMsgBuf(INT32U id, INT8U ext, INT8U len, INT8U *buf) {
+    return trySendMsgBuf(id, ext, len, buf);
+  }
+
+  // Non-blocking send: occupies one of the three TX buffers
+  // for the frame's transmission time on the bus
+  INT8U trySendMsgBuf(INT32U id, INT8U ext, INT8U len, const INT8U *buf) {
+    if (!bus || mode != MCP_NORMAL) {
+      return CAN_GETTXBFTIMEOUT;
+    }
+    unsigned long long now = twizyHost->clockUs;
+    for (byte txb = 0; txb < 3; txb++) {
+      if (txBusyUntil[txb] <= now) {
+        txBusyUntil[txb] = bus->occupy(len);
+        bus->transmit(this, id, len, buf);
+        return CAN_OK;
+      }
+    }
+    return CAN_GETTXBFTIMEOUT;
+  }
+
+  INT8U readMsgBuf(INT32U *id, INT8U *len, INT8U *buf) {
+    if (rx.empty()) {
+      return CAN_NOMSG;
+    }
+    const TwizyHostCanFrame &frame = rx.front();
+    *id = frame.id;
+    *len = frame.len;
+    memcpy(buf, frame.buf, frame.len);
+    rx.pop_front();
+    updateIrq();
+    return CAN_OK;
+  }
+
+  INT8U checkReceive() {
+    return rx.empty() ? CAN_NOMSG : CAN_MSGAVAIL;
+  }
+
+  // MCP2515 acceptance check (standard frames, filter format ID << 16):
+  // RXB0 = mask 0 + filters 0-1, RXB1 = mask 1 + filters 2-5
+  bool accepts(unsigned long id) {
+    INT32U f = (id & 0x7FF) << 16;
+    for (byte i = 0; i < 6; i++) {
+      INT32U mask = masks[(i < 2) ? 0 : 1];
+      if ((f & mask) == (filters[i] & mask))
+        return true;
+    }
+    return false;
+  }
+
+  // Bus delivery:
+  void deliver(const TwizyHostCanFrame &frame) {
+    if (mode == MCP_SLEEP && wakeEnabled) {
+      // wake up into Listen-only mode, the frame is lost:
+      mode = MCP_LISTENONLY;
+      wakeFlag = true;
+      updateIrq();
+      return;
+    }
+    if (mode != MCP_NORMAL && mode != MCP_LISTENONLY)
+      return;
+    if (!accepts(frame.id))
+      return;
+    if (rx.size() >= rxCapacity) {
+      rxOverflows++;
+      return;
+    }
+    rx.push_back(frame);
+    updateIrq();
+  }
+
+  // Emulate INT line (active low while RX buffers are full) on pin irq:
+  void usingInterrupt(byte irq) {
+    irqPin = irq;
+    digitalWrite(irqPin, HIGH);
+    updateIrq();
+  }
+  void updateIrq() {
+    if (irqPin < TWIZY_HOST_PINS) {
+      digitalWrite(irqPin, (rx.empty() && !wakeFlag) ? HIGH : LOW);
+    }
+  }
+
+  // Sleep mode with wake up on bus activity, see TwizyVirtualBMS_arduino.h:
+  void sleepWakeOnBus() {
+    wakeFlag = false;
+    wakeEnabled = true;
+    mode = MCP_SLEEP;
+  }
+  void clearWake() {
+    wakeFlag = false;
+    wakeEnabled = false;
+    updateIrq();
+  }
+
+  // Host extensions:
+  TwizyHostCanBus *bus = NULL;        // custom bus, default: context bus
+  size_t rxCapacity = 2;              // MCP2515: two RX buffers
+  byte irqPin = 0xFF;                 // INT line emulation, see usingInterrupt()
+  unsigned long rxOverflows = 0;
+  bool wakeEnabled = false;           // CANINTE.WAKIE
+  bool wakeFlag = false;              // CANINTF.WAKIF
+
+  INT8U csPin;
+  INT8U mode = MCP_LOOPBACK;
+  unsigned long long txBusyUntil[3] = {};
+  INT32U masks[2] = {};
+  INT32U filters[6] = {};
+  std::deque<TwizyHostCanFrame> rx;
+};
+
+
+void TwizyHostCanBus::transmit(const TwizyCanDriver *sender, unsigned long id, byte len, const byte *buf) {
+  TwizyHostCanFrame frame;
+  frame.time = twizyHost->clockUs;
+  frame.id = id;
+  frame.len = (len > 8) ? 8 : len;
+  memcpy(frame.buf, buf, frame.len);
+  frameCount++;
+  if (monitor) {
+    monitor(frame, sender);
+  }
+  if (gateway && sender) {
+    gateway(frame);
+  }
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i] != sender) {
+      nodes[i]->deliver(frame);
+    }
+  }
+}
+
+
+// -----------------------------------------------------
+// CAN clock
+//
+
+// All timers of a context share the first period; begin() for an arg
+// already registered replaces its ISR.
+bool twizyTimerBegin(unsigned long periodUs, TwizyISR isr, void *arg) {
+  std::vector<TwizyHostISR> &isrs = twizyHost->timerISRs;
+  for (size_t i = 0; i < isrs.size(); i++) {
+    if (isrs[i].arg == arg) {
+      isrs[i].isr = isr;
+      return true;
+    }
+  }
+  if (isrs.empty()) {
+    twizyHost->timerPeriod = periodUs;
+    twizyHost->timerNext = twizyHost->clockUs + periodUs;
+  }
+  else if (periodUs != twizyHost->timerPeriod) {
+    return false;
+  }
+  isrs.push_back({ isr, arg });
+  return true;
+}
+
+
+#endif // _TwizyVirtualBMS_host_h
@@ -0,0 +1,474 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: Charger & SEVCON models (host)
+ * ==========================================================================
+ *
+ * Behavioral stand-ins for the Twizy components talking to the BMS, for
+ * closed-loop charge & drive cycles on the host backend:
+ *  - TwizyHostCharger: sends 0x423 & 0x597 every 100 ms following the
+ *    charger handshake (see extras/Protocol.ods, "Init-Drv" … "End-Trc"),
+ *    reacts to 0x155 / 0x424 / 0x425 of the BMS, drives the mode bits
+ *    (0xC0 drive, 0xB0 charge, 0x90 trickle, 0xD0 stop), plug & key flags
+ *    and delivers the charge current level requested in 0x155 (limited by
+ *    maxCurrent)
+ *  - TwizyHostSevcon: drive controller, enabled in BMS drive mode with the
+ *    3MW (ECU_OK) line high, follows a power demand limited by the drive /
+ *    recuperation limits in 0x424 & the key switch, takes the pack voltage
+ *    from 0x55F
+ *
+ * Both models read the BMS frames from the bus monitor (chained to an
+ * existing monitor) and are stepped by calling loop() along with the
+ * VirtualBMS looper(). The battery current to feed back into the BMS
+ * (setCurrentQA()) is the sum of the models' getCurrentQA().
+ *
+ * Usage:
+ *   #include "TwizyVirtualBMS_config.h"
+ *   #include "TwizyVirtualBMS.h"
+ *   #include "TwizyVirtualBMS_models.h"
+ *
+ *   TwizyHostCharger charger;
+ *   TwizyHostSevcon sevcon;
+ *   …
+ *   twizy.begin();
+ *   charger.attach();
+ *   sevcon.attach();
+ *   charger.key = true;
+ *   sevcon.demand = 5000;
+ *   …
+ *   twizyHostAdvance(10000);
+ *   charger.loop();
+ *   sevcon.loop();
+ *   twizy.looper();
+ *
+ * See extras/host/CycleTest.cpp for a complete program.
+ *
+ */
+
+#ifndef _TwizyVirtualBMS_models_h
+#define _TwizyVirtualBMS_models_h
+
+#ifndef TWIZY_HOST
+#error "TwizyVirtualBMS_models.h needs the host backend (TWIZY_HOST)"
+#endif
+
+
+// -----------------------------------------------------
+// BMS frame view (as received from the bus)
+//
+
+struct TwizyHostBmsFrames {
+  byte id155[8] = {};
+  byte id424[8] = {};
+  byte id425[8] = {};
+  byte id55F[8] = {};
+
+  void receive(const TwizyHostCanFrame &frame) {
+    switch (frame.id) {
+      case 0x155: memcpy(id155, frame.buf, 8); break;
+      case 0x424: memcpy(id424, frame.buf, 8); break;
+      case 0x425: memcpy(id425, frame.buf, 8); break;
+      case 0x55F: memcpy(id55F, frame.buf, 8); break;
+    }
+  }
+
+  // Decoded signals:
+  byte chargeLevel() const {        // 155_0: charge current level (5 A), 0xFF = not ready
+    return id155[0];
+  }
+  bool isReady() const {            // 155_3: 0x54 = 3MW pulse cycle done
+    return id155[3] == 0x54;
+  }
+  byte state424() const {           // 424_0: 0x11 ready, 0x12 stop charge request
+    return id424[0];
+  }
+  byte mode425() const {            // 425_0: 0x1D init, 0x24 ready, 0x2A drive, 0x0A charge, 0x2C trickle
+    return id425[0];
+  }
+  unsigned int driveLimit() const { // 424_3 [W]
+    return id424[3] * 500U;
+  }
+  unsigned int recupLimit() const { // 424_2 [W]
+    return id424[2] * 500U;
+  }
+  unsigned int voltageDV() const {  // 55F_5…7: pack voltage [1/10 V]
+    return ((id55F[6] & 0x0F) << 8) | id55F[7];
+  }
+};
+
+
+// Chain a receiver to the bus monitor (frames sent by bus nodes only):
+template <typename T>
+void twizyHostListen(TwizyHostCanBus *bus, T *model) {
+  std::function<void(const TwizyHostCanFrame&, const TwizyCanDriver*)> previous = bus->monitor;
+  bus->monitor = [model, previous](const TwizyHostCanFrame &frame, const TwizyCanDriver *sender) {
+    if (previous) {
+      previous(frame, sender);
+    }
+    if (sender) {
+      model->bms.receive(frame);
+    }
+  };
+}
+
+
+// -----------------------------------------------------
+// Charger model
+//
+
+enum TwizyHostChargerPhase {
+  ChgOff,             // CAN silent
+  ChgWakeup,          // 423_0 = 03, waiting for BMS ready & 3MW cycle
+  ChgReady,           // decide: drive / charge / trickle / shutdown
+  ChgStartDrive,      // start drive request
+  ChgDriving,         // drive mode, supplying 12V
+  ChgStopDrive,       // stop drive request
+  ChgStartCharge,     // start charge request
+  ChgCharging,        // charging with the requested current level
+  ChgStopCharge,      // stop charge request
+  ChgStartTrickle,    // start trickle (12V) charge request
+  ChgTrickle,         // trickle charge
+  ChgStopTrickle,     // stop trickle request
+  ChgShutdown,        // 597 off, then 423_0 = 00
+};
+
+const char twizyHostChargerPhaseName[13][13] = {
+  "Off", "Wakeup", "Ready", "StartDrive", "Driving", "StopDrive",
+  "StartCharge", "Charging", "StopCharge", "StartTrickle", "Trickle",
+  "StopTrickle", "Shutdown"
+};
+
+class TwizyHostCharger {
+
+public:
+
+  // Inputs:
+  bool plugged = false;               // power cord plugged in
+  bool key = false;                   // key switch on
+  bool trickle = true;                // do a 12V trickle charge after charging
+  unsigned long trickleSec = 600;     // … duration [s]
+  int maxCurrent = 32;                // charger hardware limit at battery [A]
+  int temperature = 25;               // charger temperature [°C]
+
+  // BMS frames received:
+  TwizyHostBmsFrames bms;
+
+  // Statistics:
+  unsigned long cycles = 0;           // 100 ms cycles while awake
+  unsigned long charges = 0;          // charge sessions completed
+  unsigned long timeouts = 0;         // handshake steps not answered within 10 s
+
+  void attach(TwizyHostCanBus *hostBus = NULL) {
+    bus = hostBus ? hostBus : (twizyHost->canBus ? twizyHost->canBus : &twizyHostCanBus);
+    twizyHostListen(bus, this);
+  }
+
+  TwizyHostChargerPhase getPhase() const {
+    return phase;
+  }
+  const char *phaseName() const {
+    return twizyHostChargerPhaseName[phase];
+  }
+
+  // Current delivered into the battery [1/4 A]:
+  long getCurrentQA() const {
+    return currentQA;
+  }
+
+  // Charge delivered [Ah]:
+  double getChargedAh() const {
+    return chargeSum / 144000.0;
+  }
+
+  // Step: runs the 100 ms charger cycle when due
+  void loop() {
+    unsigned long long now = twizyHost->clockUs;
+    if (now < next) {
+      return;
+    }
+    next = now + 100000;
+    cycle(now);
+  }
+
+private:
+
+  TwizyHostCanBus *bus = NULL;
+  TwizyHostChargerPhase phase = ChgOff;
+  unsigned long long next = 0;
+  unsigned long long phaseStart = 0;
+  long currentQA = 0;
+  unsigned long long chargeSum = 0;   // [1/4 A * 100 ms]
+  bool chargeDone = false;
+  bool trickleDone = false;
+  bool offSent = false;
+
+  void enterPhase(TwizyHostChargerPhase newPhase, unsigned long long now) {
+    phase = newPhase;
+    phaseStart = now;
+  }
+
+  // Wait for the BMS to answer a handshake step, count timeouts:
+  bool waitFor(bool answered, unsigned long long now) {
+    if (answered) {
+      return true;
+    }
+    if (now - phaseStart > 10000000) {
+      timeouts++;
+      enterPhase(ChgShutdown, now);
+    }
+    return false;
+  }
+
+  void cycle(unsigned long long now) {
+
+    if (!plugged) {
+      chargeDone = trickleDone = false;
+    }
+
+    byte addr = 0xE0;                 // 597_1: bits 0x04 = talking to BMS, 0x10 = key
+    byte mode = 0xA1;                 // 597_3: mode nibble + 1 = ready / 2 = wait
+    currentQA = 0;
+
+    switch (phase) {
+
+      case ChgOff:
+        if (!key && !(plugged && (!chargeDone || (trickle && !trickleDone)))) {
+          return;
+        }
+        offSent = false;
+        enterPhase(ChgWakeup, now);
+        // fall through
+
+      case ChgWakeup:
+        mode = 0xA2;
+        if (bms.mode425() == 0x24 && bms.isReady()) {
+          enterPhase(ChgReady, now);
+        }
+        else {
+          waitFor(false, now);
+        }
+        break;
+
+      case ChgReady:
+        if (plugged && (bms.chargeLevel() == 0 || bms.state424() == 0x12)) {
+          // BMS doesn't want to be charged:
+          chargeDone = true;
+        }
+        if (key) {
+          enterPhase(ChgStartDrive, now);
+        }
+        else if (plugged && !chargeDone) {
+          enterPhase(ChgStartCharge, now);
+        }
+        else if (plugged && trickle && !trickleDone) {
+          enterPhase(ChgStartTrickle, now);
+        }
+        else {
+          enterPhase(ChgShutdown, now);
+        }
+        break;
+
+      case ChgStartDrive:
+        addr = 0xE4; mode = 0xC1;
+        if (waitFor(bms.mode425() == 0x2A, now)) {
+          enterPhase(ChgDriving, now);
+        }
+        break;
+
+      case ChgDriving:
+        addr = 0x85; mode = 0x41;
+        if (!key) {
+          enterPhase(ChgStopDrive, now);
+        }
+        break;
+
+      case ChgStopDrive:
+        addr = 0xE4; mode = 0xD1;
+        if (waitFor(bms.mode425() == 0x24, now)) {
+          enterPhase(ChgReady, now);
+        }
+        break;
+
+      case ChgStartCharge:
+        addr = 0xE4; mode = 0xB1;
+        if (waitFor(bms.mode425() == 0x0A, now)) {
+          enterPhase(ChgCharging, now);
+        }
+        break;
+
+      case ChgCharging:
+        addr = 0xA4; mode = 0xB1;
+        if (!plugged || key || bms.state424() == 0x12 || bms.chargeLevel() == 0 || bms.mode425() != 0x0A) {
+          // BMS stop request / unplugged:
+          chargeDone = true;
+          charges++;
+          enterPhase(ChgStopCharge, now);
+        }
+        else {
+          int amps = std::min((int)bms.chargeLevel() * 5, maxCurrent);
+          currentQA = amps * 4;
+          chargeSum += currentQA;
+        }
+        break;
+
+      case ChgStopCharge:
+        addr = 0xE4; mode = 0xD1;
+        if (waitFor(bms.mode425() == 0x24, now)) {
+          enterPhase(ChgReady, now);
+        }
+        break;
+
+      case ChgStartTrickle:
+        addr = 0xE4; mode = 0x91;
+        if (waitFor(bms.mode425() == 0x2C || bms.mode425() == 0x2A, now)) {
+          enterPhase(ChgTrickle, now);
+        }
+        break;
+
+      case ChgTrickle:
+        addr = 0x84; mode = 0x91;
+        if (!plugged || key || now - phaseStart >= trickleSec * 1000000ULL) {
+          trickleDone = true;
+          enterPhase(ChgStopTrickle, now);
+        }
+        break;
+
+      case ChgStopTrickle:
+        addr = 0xE4; mode = 0xD1;
+        if (waitFor(bms.mode425() == 0x24, now)) {
+          enterPhase(ChgReady, now);
+        }
+        break;
+
+      case ChgShutdown:
+        addr = 0xE0; mode = 0xD1;
+        if (offSent) {
+          enterPhase(ChgOff, now);
+          return;
+        }
+        if (now - phaseStart >= 100000) {
+          // second cycle: CHG→BMS OFF
+          offSent = true;
+        }
+        break;
+    }
+
+    cycles++;
+
+    byte id423[8] = { (byte)(offSent ? 0x00 : 0x03), 0x00, 0xFF, 0xFF, 0x00, 0xE0, 0x00, 0x00 };
+    byte id597[8] = {
+      (byte)(plugged ? 0x20 : 0x00),
+      (byte)(addr | (key ? 0x10 : 0x00)),
+      0x1B,                           // DC converter current: 5.4 A
+      mode,
+      0x2F, 0x00, 0x01,
+      (byte)(temperature + 40)
+    };
+    bus->inject(0x423, 8, id423);
+    bus->inject(0x597, 8, id597);
+  }
+
+};
+
+
+// -----------------------------------------------------
+// SEVCON (drive controller) model
+//
+
+class TwizyHostSevcon {
+
+public:
+
+  // Inputs:
+  long demand = 0;                    // power demand [W], positive = drive, negative = recuperation
+  byte enablePin = TWIZY_3MW_CONTROL_PIN;   // 3MW (ECU_OK) line from the BMS
+
+  // BMS frames received:
+  TwizyHostBmsFrames bms;
+
+  // Statistics:
+  unsigned long limitedTicks = 0;     // ticks the demand exceeded the BMS limit
+  unsigned long disabledTicks = 0;    // ticks with demand while not enabled
+  long maxPower = 0, minPower = 0;    // power peaks [W]
+
+  void attach(TwizyHostCanBus *hostBus = NULL) {
+    TwizyHostCanBus *bus = hostBus ? hostBus : (twizyHost->canBus ? twizyHost->canBus : &twizyHostCanBus);
+    twizyHostListen(bus, this);
+  }
+
+  // Enabled: BMS in drive mode & 3MW high
+  bool isEnabled() const {
+    return bms.mode425() == 0x2A && digitalRead(enablePin) == HIGH;
+  }
+
+  // Actual power [W]:
+  long getPower() const {
+    return power;
+  }
+
+  // Battery current [1/4 A], negative = discharge:
+  long getCurrentQA() const {
+    return currentQA;
+  }
+
+  // Energy drawn / recuperated [Wh]:
+  double getDriveWh() const {
+    return driveSum / 360000.0;
+  }
+  double getRecupWh() const {
+    return recupSum / 360000.0;
+  }
+
+  // Step: updates power & current every 10 ms
+  void loop() {
+    unsigned long long now = twizyHost->clockUs;
+    if (now < next) {
+      return;
+    }
+    next = now + 10000;
+
+    if (!isEnabled()) {
+      if (demand != 0) {
+        disabledTicks++;
+      }
+      power = 0;
+    }
+    else {
+      long driveLimit = bms.driveLimit(), recupLimit = bms.recupLimit();
+      power = demand;
+      if (power > driveLimit) {
+        power = driveLimit;
+      }
+      else if (power < -recupLimit) {
+        power = -recupLimit;
+      }
+      if (power != demand) {
+        limitedTicks++;
+      }
+    }
+
+    // I = P / U, U from 55F [1/10 V]:
+    unsigned int voltageDV = bms.voltageDV();
+    currentQA = voltageDV ? -(power * 40 / (long) voltageDV) : 0;
+
+    if (power > 0) {
+      driveSum += power;
+    }
+    else {
+      recupSum += -power;
+    }
+    maxPower = std::max(maxPower, power);
+    minPower = std::min(minPower, power);
+  }
+
+private:
+
+  unsigned long long next = 0;
+  long power = 0;
+  long currentQA = 0;
+  unsigned long long driveSum = 0;    // [W * 10 ms]
+  unsigned long long recupSum = 0;
+
+};
+
+
+#endif // _TwizyVirtualBMS_models_h
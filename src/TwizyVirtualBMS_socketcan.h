@@ -0,0 +1,364 @@
+/**
+ * ==========================================================================
+ * Twizy Virtual BMS: SocketCAN gateway (Linux)
+ * ==========================================================================
+ *
+ * Runs the VirtualBMS on a Linux system with a native CAN interface
+ * (i.e. an SBC with a CAN HAT, or vcan0 for testing), using the host
+ * backend:
+ *  - CAN: the in-memory bus of the host backend is bridged to a SocketCAN
+ *    raw socket, frames are received & sent in batches (recvmmsg/sendmmsg)
+ *  - Kernel CAN filters: built from the acceptance filters of the bus
+ *    nodes, updated automatically (i.e. on onFrame())
+ *  - CAN clock: timerfd with period TWIZY_CAN_CLOCK_US, the virtual clock
+ *    follows CLOCK_MONOTONIC
+ *  - Event loop: epoll on the CAN socket & the timerfd
+ *  - Tick jitter: lateness of each timer expiry & missed ticks are measured
+ *    in the same loop, see getStats()
+ *
+ * Usage:
+ *   #include "TwizyVirtualBMS_config.h"
+ *   #include "TwizyVirtualBMS.h"
+ *   #include "TwizyVirtualBMS_socketcan.h"
+ *
+ *   TwizySocketCan socketCan;
+ *   …
+ *   twizy.begin();
+ *   socketCan.open("can0");
+ *   socketCan.run(loop);   // loop() calls twizy.looper()
+ *
+ * See extras/host/SocketCanBMS.cpp for a complete program.
+ *
+ */
+
+#ifndef _TwizyVirtualBMS_socketcan_h
+#define _TwizyVirtualBMS_socketcan_h
+
+#ifndef TWIZY_HOST
+#error "TwizyVirtualBMS_socketcan.h needs the host backend (TWIZY_HOST)"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#ifndef TWIZY_SOCKETCAN_BATCH
+#define TWIZY_SOCKETCAN_BATCH     32      // frames per recvmmsg/sendmmsg call
+#endif
+
+
+// Tick timing & frame statistics:
+struct TwizySocketCanStats {
+  unsigned long ticks;            // timer expiries processed
+  unsigned long missed;           // timer expiries lost (loop too slow)
+  long jitterMinUs;               // timer expiry lateness min [us]
+  long jitterMaxUs;               // … max [us]
+  unsigned long long jitterSumUs; // … sum [us] (avg = sum / ticks)
+  unsigned long rxFrames, rxBatches;
+  unsigned long txFrames, txBatches, txDrops;
+  unsigned long filterUpdates;
+};
+
+
+class TwizySocketCan {
+
+public:
+
+  ~TwizySocketCan() {
+    close();
+  }
+
+  // Open & bind raw CAN socket, attach to the host bus:
+  //  returns false on error (see errno)
+  bool open(const char *ifname, TwizyHostCanBus *hostBus = &twizyHostCanBus) {
+    close();
+    bus = hostBus;
+
+    sock = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (sock < 0) {
+      return false;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
+      close();
+      return false;
+    }
+    // set the kernel filters before binding, so no unwanted frame gets
+    // queued in between:
+    resetStats();
+    updateFilters();
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close();
+      return false;
+    }
+
+    // sync virtual clock to CLOCK_MONOTONIC:
+    clockOffset = monotonicUs() - twizyHost->clockUs;
+
+    bus->gateway = [this](const TwizyHostCanFrame &frame) {
+      if (txLen == TWIZY_SOCKETCAN_BATCH) {
+        flushTx();
+      }
+      struct can_frame &cf = txFrames[txLen++];
+      cf.can_id = frame.id & CAN_SFF_MASK;
+      cf.can_dlc = frame.len;
+      memcpy(cf.data, frame.buf, frame.len);
+    };
+
+    return true;
+  }
+
+  void close() {
+    if (bus) {
+      bus->gateway = nullptr;
+      bus = NULL;
+    }
+    if (timer >= 0) {
+      ::close(timer);
+      timer = -1;
+    }
+    if (sock >= 0) {
+      ::close(sock);
+      sock = -1;
+    }
+    txLen = 0;
+    filterCnt = -1;   // the next socket needs its filters set
+  }
+
+  // Event loop: run until *stop becomes true (i.e. set by a signal handler)
+  //  loop: called after each event, needs to call TwizyVirtualBMS::looper()
+  //  returns false on error (see errno)
+  bool run(void (*loop)(), volatile sig_atomic_t *stop = NULL) {
+    if (sock < 0 || twizyHost->timerISRs.empty()) {
+      errno = EINVAL;
+      return false;
+    }
+
+    // CAN clock timer, aligned to the virtual timer:
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0) {
+      return false;
+    }
+    syncClock();
+    unsigned long long firstUs = clockOffset + twizyHost->timerNext;
+    struct itimerspec its;
+    its.it_value.tv_sec = firstUs / 1000000;
+    its.it_value.tv_nsec = (firstUs % 1000000) * 1000;
+    its.it_interval.tv_sec = twizyHost->timerPeriod / 1000000;
+    its.it_interval.tv_nsec = (twizyHost->timerPeriod % 1000000) * 1000;
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+      return false;
+    }
+    tickDueUs = firstUs;
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+      return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.fd = timer;
+    epoll_ctl(ep, EPOLL_CTL_ADD, timer, &ev);
+
+    while (!stop || !*stop) {
+      struct epoll_event events[2];
+      int n = epoll_wait(ep, events, 2, -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ::close(ep);
+        return false;
+      }
+
+      for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == timer) {
+          handleTimer();
+        }
+        else if (events[i].data.fd == sock) {
+          handleReceive(loop);
+        }
+      }
+
+      syncClock();
+      (*loop)();
+      flushTx();
+      updateFilters();
+    }
+
+    ::close(ep);
+    ::close(timer);
+    timer = -1;
+    return true;
+  }
+
+  const TwizySocketCanStats &getStats() {
+    return stats;
+  }
+  void resetStats() {
+    memset(&stats, 0, sizeof(stats));
+    stats.jitterMinUs = LONG_MAX;
+  }
+
+private:
+
+  TwizyHostCanBus *bus = NULL;
+  int sock = -1;
+  int timer = -1;
+  long long clockOffset = 0;            // CLOCK_MONOTONIC - virtual clock [us]
+  unsigned long long tickDueUs = 0;     // next timer expiry [us, CLOCK_MONOTONIC]
+
+  struct can_frame txFrames[TWIZY_SOCKETCAN_BATCH];
+  byte txLen = 0;
+
+  struct can_filter filters[8];
+  int filterCnt = -1;
+
+  TwizySocketCanStats stats;
+
+  static unsigned long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // Advance the virtual clock to now (runs the CAN clock ISR when due):
+  void syncClock() {
+    long long now = monotonicUs() - clockOffset;
+    if (now > (long long) twizyHost->clockUs) {
+      twizyHostAdvance(now - twizyHost->clockUs);
+    }
+  }
+
+  void handleTimer() {
+    uint64_t expirations;
+    if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+      return;
+    }
+    long lateUs = (long)(monotonicUs() - tickDueUs);
+    tickDueUs += expirations * twizyHost->timerPeriod;
+    stats.ticks++;
+    stats.missed += expirations - 1;
+    if (lateUs < stats.jitterMinUs) stats.jitterMinUs = lateUs;
+    if (lateUs > stats.jitterMaxUs) stats.jitterMaxUs = lateUs;
+    stats.jitterSumUs += lateUs;
+  }
+
+  void handleReceive(void (*loop)()) {
+    struct can_frame frames[TWIZY_SOCKETCAN_BATCH];
+    struct iovec iov[TWIZY_SOCKETCAN_BATCH];
+    struct mmsghdr msgs[TWIZY_SOCKETCAN_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < TWIZY_SOCKETCAN_BATCH; i++) {
+      iov[i].iov_base = &frames[i];
+      iov[i].iov_len = sizeof(frames[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // the nodes need to buffer a complete batch:
+    for (size_t i = 0; i < bus->nodes.size(); i++) {
+      bus->nodes[i]->rxCapacity = std::max(bus->nodes[i]->rxCapacity, (size_t) TWIZY_SOCKETCAN_BATCH);
+    }
+
+    int n;
+    while ((n = recvmmsg(sock, msgs, TWIZY_SOCKETCAN_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+      syncClock();
+      stats.rxBatches++;
+      for (int i = 0; i < n; i++) {
+        const struct can_frame &cf = frames[i];
+        if (cf.can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)) {
+          continue;
+        }
+        bus->inject(cf.can_id & CAN_SFF_MASK, std::min((int) cf.can_dlc, 8), cf.data);
+        stats.rxFrames++;
+      }
+      (*loop)();
+      flushTx();
+      if (n < TWIZY_SOCKETCAN_BATCH) {
+        break;
+      }
+    }
+  }
+
+  void flushTx() {
+    if (txLen == 0) {
+      return;
+    }
+    struct iovec iov[TWIZY_SOCKETCAN_BATCH];
+    struct mmsghdr msgs[TWIZY_SOCKETCAN_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (byte i = 0; i < txLen; i++) {
+      iov[i].iov_base = &txFrames[i];
+      iov[i].iov_len = sizeof(txFrames[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(sock, msgs, txLen, MSG_DONTWAIT);
+    if (sent < 0) {
+      sent = 0;
+    }
+    stats.txBatches++;
+    stats.txFrames += sent;
+    // kernel TX queue full: drop the rest (the VirtualBMS resends cyclically)
+    stats.txDrops += txLen - sent;
+    txLen = 0;
+  }
+
+  // Build kernel filters from the MCP2515 style acceptance filters of all
+  // nodes (mask 0: filters 0-1, mask 1: filters 2-5), standard frames only:
+  void updateFilters() {
+    struct can_filter f[8 * 6];
+    int cnt = 0;
+    for (size_t n = 0; n < bus->nodes.size(); n++) {
+      const TwizyCanDriver *node = bus->nodes[n];
+      for (int i = 0; i < 6; i++) {
+        canid_t mask = ((node->masks[i < 2 ? 0 : 1] >> 16) & CAN_SFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+        canid_t id = (node->filters[i] >> 16) & CAN_SFF_MASK & mask;
+        int j = 0;
+        while (j < cnt && !(f[j].can_id == id && f[j].can_mask == mask)) {
+          j++;
+        }
+        if (j == cnt && cnt < 8 * 6) {
+          f[cnt].can_id = id;
+          f[cnt].can_mask = mask;
+          cnt++;
+        }
+      }
+    }
+    if (cnt > 8) {
+      // too many nodes for the filter cache, pass everything
+      cnt = 1;
+      f[0].can_id = 0;
+      f[0].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+    }
+    if (cnt == filterCnt && memcmp(f, filters, cnt * sizeof(f[0])) == 0) {
+      return;
+    }
+    memcpy(filters, f, cnt * sizeof(f[0]));
+    filterCnt = cnt;
+    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters, cnt * sizeof(filters[0]));
+    stats.filterUpdates++;
+  }
+
+};
+
+
+#endif // _TwizyVirtualBMS_socketcan_h